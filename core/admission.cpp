@@ -0,0 +1,337 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file decides when the requests of a Modbus client are served. Every
+// client belongs to a priority class, picked by its IP address on
+// ADMISSION_CONFIG_FILE:
+//
+//   high     the SCADA master and anything else that must never wait. Its
+//            requests are served first and are never deferred
+//   normal   every client that isn't listed
+//   low      HMIs, historians and other clients that can wait
+//
+// The normal and low classes may limit how many requests per second a
+// connection sends, with a token bucket per connection. A request that
+// finds the bucket empty stays on the connection until a token is
+// available. Modbus/UDP keeps a bucket per source address and the RTU line
+// is one client of the normal class, classified as address 0.0.0.0. Their
+// requests can't wait on a connection, so they are dropped instead.
+//
+// The server may also be given a budget of request processing time per
+// scan cycle. Requests of every class are charged to it, but once it is
+// spent the normal and low classes wait for the next scan (or are dropped,
+// over UDP and RTU), so a client flooding the server can't take more than
+// the budget from the scan and from the high class. Without the file
+// nothing is limited.
+//
+// The counters of deferred requests, which include the dropped ones, are
+// published with the scan stats.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "ladder.h"
+
+//Opened on the directory the runtime is started from (the OpenPLC folder,
+//next to dnp3.cfg), like the other configuration files
+#define ADMISSION_CONFIG_FILE   "mbclients.cfg"
+#define MAX_CLIENT_RULES        64
+
+struct client_rule
+{
+    uint32_t network;           //host byte order
+    uint32_t netmask;
+    int client_class;
+};
+
+struct admission_class
+{
+    const char *name;
+    long long interval;         //ns between tokens, 0 for no limit
+    long long tolerance;        //ns of tokens a full bucket holds, minus one
+    volatile uint32_t throttled;
+    volatile uint32_t deferred;
+};
+
+static struct admission_class classes[NUM_CLIENT_CLASSES] =
+{
+    {"high", 0, 0, 0, 0},
+    {"normal", 0, 0, 0, 0},
+    {"low", 0, 0, 0, 0},
+};
+
+static struct client_rule rules[MAX_CLIENT_RULES];
+static int rule_count = 0;
+
+//The budget is shared by the TCP, UDP and RTU server threads
+static long long scan_budget = 0;          //ns, 0 for no budget
+static long long budget_used = 0;
+static unsigned int budget_scan = 0;
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile uint32_t exhausted_scans = 0;
+
+//-----------------------------------------------------------------------------
+// Adds the addresses or networks on a list like "10.0.0.5, 10.0.1.0/24"
+// to a class
+//-----------------------------------------------------------------------------
+static void parseClientList(const char *list, int client_class)
+{
+    char address[32];
+    const char *p = list;
+
+    while (*p != '\0')
+    {
+        while (*p == ',' || *p == ' ') p++;
+        int len = strcspn(p, ", ");
+        if (len == 0) break;
+        if (len >= (int)sizeof(address)) len = sizeof(address) - 1;
+        memcpy(address, p, len);
+        address[len] = '\0';
+        p += strcspn(p, ", ");
+
+        int bits = 32;
+        char *slash = strchr(address, '/');
+        if (slash != NULL)
+        {
+            *slash = '\0';
+            bits = atoi(slash + 1);
+        }
+
+        struct in_addr addr;
+        if (inet_pton(AF_INET, address, &addr) != 1 || bits < 0 || bits > 32)
+        {
+            printf("Client admission: invalid address %s\n", address);
+            continue;
+        }
+        if (rule_count == MAX_CLIENT_RULES)
+        {
+            printf("Client admission: too many addresses, ignoring %s\n", address);
+            continue;
+        }
+
+        struct client_rule *rule = &rules[rule_count++];
+        rule->netmask = bits ? 0xffffffffU << (32 - bits) : 0;
+        rule->network = ntohl(addr.s_addr) & rule->netmask;
+        rule->client_class = client_class;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Reads the client classes, rate limits and scan budget from
+// ADMISSION_CONFIG_FILE. Lines look like class.parameter = "value" or
+// budget = "value". Must be called before the Modbus server starts
+//-----------------------------------------------------------------------------
+void loadAdmissionConfig()
+{
+    char line[1024];
+    char value[1024];
+    double rates[NUM_CLIENT_CLASSES] = {0, 0, 0};
+    int bursts[NUM_CLIENT_CLASSES] = {1, 1, 1};
+    FILE *cfgfile = fopen(ADMISSION_CONFIG_FILE, "r");
+
+    if (cfgfile == NULL)
+    {
+        printf("No client admission settings (%s). No client is limited\n", ADMISSION_CONFIG_FILE);
+        return;
+    }
+
+    printf("Reading client admission settings from %s\n", ADMISSION_CONFIG_FILE);
+    while (fgets(line, sizeof(line), cfgfile) != NULL)
+    {
+        if (line[0] == '#' || strlen(line) <= 1) continue;
+
+        //value between the quotes
+        const char *start = strchr(line, '"');
+        value[0] = '\0';
+        if (start != NULL)
+        {
+            int i = 0;
+            start++;
+            while (start[i] != '"' && start[i] != '\0' && i < (int)sizeof(value) - 1)
+            {
+                value[i] = start[i];
+                i++;
+            }
+            value[i] = '\0';
+        }
+
+        if (!strncmp(line, "budget", 6))
+        {
+            scan_budget = atoll(value) * 1000;
+            if (scan_budget < 0) scan_budget = 0;
+            continue;
+        }
+
+        for (int i = 0; i < NUM_CLIENT_CLASSES; i++)
+        {
+            int len = strlen(classes[i].name);
+            if (strncmp(line, classes[i].name, len) || line[len] != '.') continue;
+
+            const char *parameter = line + len + 1;
+            if (!strncmp(parameter, "clients", 7))
+            {
+                parseClientList(value, i);
+            }
+            else if (!strncmp(parameter, "rate", 4))
+            {
+                if (i == CLIENT_CLASS_HIGH)
+                    printf("Client admission: the high class is never rate limited, ignoring high.rate\n");
+                else
+                    rates[i] = atof(value);
+            }
+            else if (!strncmp(parameter, "burst", 5))
+            {
+                bursts[i] = atoi(value);
+                if (bursts[i] < 1) bursts[i] = 1;
+            }
+            break;
+        }
+    }
+    fclose(cfgfile);
+
+    for (int i = 0; i < NUM_CLIENT_CLASSES; i++)
+    {
+        struct admission_class *c = &classes[i];
+        c->interval = (rates[i] > 0) ? (long long)(1e9 / rates[i]) : 0;
+        c->tolerance = c->interval * (bursts[i] - 1);
+        if (c->interval)
+            printf("Client class %s: %g requests/s per connection, bursts of %d\n", c->name, rates[i], bursts[i]);
+        else
+            printf("Client class %s: no rate limit\n", c->name);
+    }
+    if (scan_budget) printf("Client admission: %lld us of requests per scan\n", scan_budget / 1000);
+}
+
+//-----------------------------------------------------------------------------
+// Helper to read the monotonic clock in nanoseconds
+//-----------------------------------------------------------------------------
+long long monotonicNanoseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//-----------------------------------------------------------------------------
+// Sets up the admission state of a new connection from the IPv4 address
+// (network byte order) of the client. The first rule that matches picks
+// the class
+//-----------------------------------------------------------------------------
+void admitClient(struct client_admission *admission, uint32_t address)
+{
+    uint32_t host = ntohl(address);
+
+    admission->client_class = CLIENT_CLASS_NORMAL;
+    admission->full_at = 0;
+    for (int i = 0; i < rule_count; i++)
+    {
+        if ((host & rules[i].netmask) == rules[i].network)
+        {
+            admission->client_class = rules[i].client_class;
+            break;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Takes a token from the bucket of a connection at time now (ns on
+// CLOCK_MONOTONIC). Returns 0 if the request can be served, or how many ns
+// the connection must wait for a token. The bucket is kept as the time at
+// which it will be full again, so it never has to be refilled. The high
+// class is never limited
+//-----------------------------------------------------------------------------
+long long admitRequest(struct client_admission *admission, long long now)
+{
+    struct admission_class *c = &classes[admission->client_class];
+    if (c->interval == 0 || admission->client_class == CLIENT_CLASS_HIGH) return 0;
+
+    if (admission->full_at < now) admission->full_at = now;
+    long long wait = admission->full_at - c->tolerance - now;
+    if (wait > 0) return wait;
+
+    admission->full_at += c->interval;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Tells if a request of the class may be served on this scan cycle. The
+// high class always may
+//-----------------------------------------------------------------------------
+bool scanBudgetLeft(int client_class)
+{
+    if (scan_budget == 0 || client_class == CLIENT_CLASS_HIGH) return true;
+
+    //the snapshot token changes every time a scan publishes the image
+    const struct process_image *image;
+    unsigned int scan = beginSnapshotRead(&image);
+
+    pthread_mutex_lock(&budget_lock);
+    if (scan != budget_scan)
+    {
+        budget_scan = scan;
+        budget_used = 0;
+    }
+    bool left = budget_used < scan_budget;
+    pthread_mutex_unlock(&budget_lock);
+
+    return left;
+}
+
+//-----------------------------------------------------------------------------
+// Charges the time taken by a request to the budget of the scan cycle
+//-----------------------------------------------------------------------------
+void chargeScanBudget(long long ns)
+{
+    if (scan_budget == 0) return;
+
+    pthread_mutex_lock(&budget_lock);
+    if (budget_used < scan_budget && budget_used + ns >= scan_budget) exhausted_scans++;
+    budget_used += ns;
+    pthread_mutex_unlock(&budget_lock);
+}
+
+//-----------------------------------------------------------------------------
+// Counts a request that had to wait or was dropped, either for a token
+// (throttled) or for the next scan cycle
+//-----------------------------------------------------------------------------
+void countDeferredRequest(int client_class, bool throttled)
+{
+    if (throttled)
+        __sync_fetch_and_add(&classes[client_class].throttled, 1);
+    else
+        __sync_fetch_and_add(&classes[client_class].deferred, 1);
+}
+
+//-----------------------------------------------------------------------------
+// Copies the admission counters: for each class the throttled and the
+// deferred requests, followed by the scans on which the budget ran out
+//-----------------------------------------------------------------------------
+void readAdmissionCounters(uint32_t *counters)
+{
+    for (int i = 0; i < NUM_CLIENT_CLASSES; i++)
+    {
+        counters[i * 2] = classes[i].throttled;
+        counters[i * 2 + 1] = classes[i].deferred;
+    }
+    counters[NUM_CLIENT_CLASSES * 2] = exhausted_scans;
+}
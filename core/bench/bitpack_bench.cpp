@@ -0,0 +1,303 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// Microbenchmark for the bit pack/unpack kernels of bitpack.cpp. It compares
+// them with the loops the Modbus server used before, one bit at a time with
+// bitWrite/bitRead, on the largest coil transfers Modbus allows (2000 coils
+// read, 1968 coils written), at every bit alignment. Build it with
+// core_builders/build_bench.sh.
+//
+// The results of both ways are compared first, so a wrong kernel makes the
+// benchmark fail instead of reporting a good time.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "ladder.h"
+
+#define DEFAULT_ROUNDS          100000
+#define READ_COILS              2000
+#define WRITE_COILS             1968
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) (bitvalue ? bitSet(value, bit) : bitClear(value, bit))
+
+static IEC_BOOL coils[BUFFER_SIZE][8];
+static unsigned char packed[256];
+static IEC_BOOL unpacked[BUFFER_SIZE * 8];
+static uint64_t lanes[256];
+
+//Keeps the compiler from dropping the loops being measured
+static volatile unsigned int sink;
+
+long long timespecDiff(struct timespec *end, struct timespec *start)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+//-----------------------------------------------------------------------------
+// Read Coils as it was done before: one bit at a time
+//-----------------------------------------------------------------------------
+static void packLegacy(int start, int count, unsigned char *dest)
+{
+    int bytes = (count + 7) / 8;
+    for (int i = 0; i < bytes; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            int position = start + i * 8 + j;
+            if (i * 8 + j < count)
+                bitWrite(dest[i], j, coils[position / 8][position % 8]);
+            else
+                bitClear(dest[i], j);
+        }
+    }
+}
+
+static void packKernel(int start, int count, unsigned char *dest)
+{
+    memset(dest, 0, (count + 7) / 8);
+    packBits(&coils[0][0] + start, count, dest, 0);
+}
+
+//-----------------------------------------------------------------------------
+// Write Multiple Coils as it was done before: the byte lanes of the image
+// writes are filled one bit at a time
+//-----------------------------------------------------------------------------
+static void lanesLegacy(int start, int count, const unsigned char *src, uint64_t *dest)
+{
+    memset(dest, 0, ((start % 8 + count + 7) / 8) * sizeof(uint64_t));
+    for (int i = 0; i < count; i++)
+    {
+        int position = start % 8 + i;
+        dest[position / 8] |= (uint64_t)bitRead(src[i / 8], i % 8) << ((position % 8) * 8);
+    }
+}
+
+static void lanesKernel(int start, int count, const unsigned char *src, uint64_t *dest)
+{
+    //only whole byte addresses go through the kernel, as on mapCoilWrites()
+    int first = start % 8;
+    memset(dest, 0, ((first + count + 7) / 8) * sizeof(uint64_t));
+
+    int i = 0;
+    for (; i < count && (first + i) % 8 != 0; i++)
+    {
+        dest[0] |= (uint64_t)bitRead(src[i / 8], i % 8) << ((first + i) * 8);
+    }
+    for (; count - i >= 8; i += 8)
+    {
+        unsigned int byte = src[i / 8] >> (i % 8);
+        if (i % 8) byte |= src[i / 8 + 1] << (8 - i % 8);
+        dest[(first + i) / 8] = unpackByteLanes(byte);
+    }
+    for (; i < count; i++)
+    {
+        int position = first + i;
+        dest[position / 8] |= (uint64_t)bitRead(src[i / 8], i % 8) << ((position % 8) * 8);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Unpacking into IEC_BOOL, one bit at a time and with the kernel
+//-----------------------------------------------------------------------------
+static void unpackLegacy(const unsigned char *src, int count, IEC_BOOL *dest)
+{
+    for (int i = 0; i < count; i++)
+    {
+        dest[i] = bitRead(src[i / 8], i % 8);
+    }
+}
+
+static void unpackKernel(const unsigned char *src, int count, IEC_BOOL *dest)
+{
+    unpackBits(src, 0, count, dest);
+}
+
+//-----------------------------------------------------------------------------
+// Checks that the kernels give the same results as the old loops, for every
+// alignment and for counts around the kernel block sizes
+//-----------------------------------------------------------------------------
+static bool checkKernels()
+{
+    unsigned char expected[256], got[256];
+    uint64_t expectedLanes[256], gotLanes[256];
+    IEC_BOOL expectedBools[2048], gotBools[2048];
+
+    for (int start = 0; start < 16; start++)
+    {
+        for (int count = 1; count <= READ_COILS; count += (count < 40) ? 1 : 37)
+        {
+            packLegacy(start, count, expected);
+            memset(got, 0xa5, sizeof(got));
+            packKernel(start, count, got);
+            if (memcmp(expected, got, (count + 7) / 8) || got[(count + 7) / 8] != 0xa5)
+            {
+                printf("packBits is wrong for start %d and %d coils\n", start, count);
+                return false;
+            }
+
+            if (count > WRITE_COILS) continue;
+            lanesLegacy(start, count, packed, expectedLanes);
+            lanesKernel(start, count, packed, gotLanes);
+            if (memcmp(expectedLanes, gotLanes, ((start % 8 + count + 7) / 8) * sizeof(uint64_t)))
+            {
+                printf("unpackByteLanes is wrong for start %d and %d coils\n", start, count);
+                return false;
+            }
+
+            unpackLegacy(packed, count, expectedBools);
+            memset(gotBools, 0xa5, sizeof(gotBools));
+            unpackKernel(packed, count, gotBools);
+            if (memcmp(expectedBools, gotBools, count) || gotBools[count] != 0xa5)
+            {
+                printf("unpackBits is wrong for %d coils\n", count);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Runs one kind of transfer the given number of rounds, going through all
+// bit alignments. Returns the average time per transfer in ns
+//-----------------------------------------------------------------------------
+static double timePack(void (*pack)(int, int, unsigned char *), unsigned long rounds)
+{
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 0; i < rounds; i++)
+    {
+        pack(i % 8, READ_COILS, packed);
+        sink += packed[i % 250];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (double)timespecDiff(&end, &start) / rounds;
+}
+
+static double timeLanes(void (*spread)(int, int, const unsigned char *, uint64_t *), unsigned long rounds)
+{
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 0; i < rounds; i++)
+    {
+        spread(i % 8, WRITE_COILS, packed, lanes);
+        sink += (unsigned int)lanes[i % 246];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (double)timespecDiff(&end, &start) / rounds;
+}
+
+static double timeUnpack(void (*unpack)(const unsigned char *, int, IEC_BOOL *), unsigned long rounds)
+{
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 0; i < rounds; i++)
+    {
+        unpack(packed, WRITE_COILS, unpacked);
+        sink += unpacked[i % WRITE_COILS];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (double)timespecDiff(&end, &start) / rounds;
+}
+
+static void printResult(const char *name, double legacy, double kernel)
+{
+    printf("%-28s %9.1f ns %9.1f ns %7.1fx\n", name, legacy, kernel, legacy / kernel);
+}
+
+static void print_usage()
+{
+    printf("Usage: ./bitpack_bench [-n rounds]\n");
+    printf("Compares the bit pack/unpack kernels with the bit by bit loops\n");
+    printf("(%d rounds by default)\n", DEFAULT_ROUNDS);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long rounds = DEFAULT_ROUNDS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                rounds = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+    if (rounds == 0)
+    {
+        print_usage();
+        exit(1);
+    }
+
+    //random booleans, with a few non zero values other than 1
+    srand(1);
+    for (int i = 0; i < BUFFER_SIZE; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            int r = rand() % 4;
+            coils[i][j] = (r == 3) ? 0x40 : (r & 1);
+        }
+    }
+    for (int i = 0; i < (int)sizeof(packed); i++)
+    {
+        packed[i] = rand();
+    }
+
+#if defined(__BMI2__)
+    printf("Kernels: BMI2\n");
+#elif defined(__SSE2__)
+    printf("Kernels: SSE2\n");
+#else
+    printf("Kernels: portable\n");
+#endif
+
+    if (!checkKernels())
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+
+    printf("%-28s %12s %12s %8s\n", "", "bit by bit", "kernel", "speedup");
+    printResult("pack 2000 coils", timePack(packLegacy, rounds), timePack(packKernel, rounds));
+    printResult("lanes for 1968 coils", timeLanes(lanesLegacy, rounds), timeLanes(lanesKernel, rounds));
+    printResult("unpack 1968 coils", timeUnpack(unpackLegacy, rounds), timeUnpack(unpackKernel, rounds));
+
+    return 0;
+}
@@ -0,0 +1,273 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// Latency test client for the Modbus servers of the OpenPLC. It sends Read
+// Holding Registers requests to a running runtime and reports the time from
+// each request to its response: min, average, percentiles, max and a
+// histogram. Build it with core_builders/build_bench.sh.
+//
+// Requests can be pipelined (-d), which is where the socket options of the
+// real-time profile matter most: without TCP_NODELAY, a response written
+// while an earlier one is still unacknowledged waits for the client's ACK.
+// Run it once for each socket profile on rtconfig.cfg to compare them.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_REQUESTS        10000
+#define MAX_DEPTH               16
+#define LATENCY_HIST_BUCKETS    16
+#define REQUEST_SIZE            12
+
+static long long *latencies;
+
+long long timespecDiff(struct timespec *end, struct timespec *start)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+//-----------------------------------------------------------------------------
+// Connects to the server, with TCP or UDP. Returns the socket, or -1
+//-----------------------------------------------------------------------------
+static int connectToServer(const char *host, int port, bool udp, bool quickack)
+{
+    struct sockaddr_in server_addr;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1)
+    {
+        printf("Invalid address %s\n", host);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("Can't connect to the server");
+        return -1;
+    }
+
+    if (udp)
+    {
+        //a lost datagram ends the test instead of blocking it
+        struct timeval timeout = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    else
+    {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (quickack) setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+    return fd;
+}
+
+//-----------------------------------------------------------------------------
+// Builds a Read Holding Registers request
+//-----------------------------------------------------------------------------
+static void buildRequest(unsigned char *request, int transaction, int start, int count)
+{
+    request[0] = transaction >> 8;
+    request[1] = transaction & 0xff;
+    request[2] = 0;
+    request[3] = 0;
+    request[4] = 0;
+    request[5] = 6;
+    request[6] = 1;
+    request[7] = 3;
+    request[8] = start >> 8;
+    request[9] = start & 0xff;
+    request[10] = count >> 8;
+    request[11] = count & 0xff;
+}
+
+//-----------------------------------------------------------------------------
+// Reads one response from a TCP stream. Returns its transaction id, or -1
+//-----------------------------------------------------------------------------
+static int readResponse(int fd, unsigned char *buffer, int size, bool udp)
+{
+    if (udp)
+    {
+        int n = recv(fd, buffer, size, 0);
+        return (n >= 8) ? (buffer[0] << 8 | buffer[1]) : -1;
+    }
+
+    int length = 0, needed = 6;
+    while (length < needed)
+    {
+        int n = read(fd, buffer + length, needed - length);
+        if (n <= 0) return -1;
+        length += n;
+        if (length == 6) needed = 6 + (buffer[4] << 8 | buffer[5]);
+        if (needed > size) return -1;
+    }
+
+    return buffer[0] << 8 | buffer[1];
+}
+
+static int compareLatencies(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void printResults(long requests)
+{
+    unsigned long histogram[LATENCY_HIST_BUCKETS];
+    long long total = 0;
+
+    memset(histogram, 0, sizeof(histogram));
+    qsort(latencies, requests, sizeof(long long), compareLatencies);
+    for (long i = 0; i < requests; i++)
+    {
+        total += latencies[i];
+
+        //bucket 0 counts responses below 1us and bucket N the range [2^(N-1), 2^N) us
+        int bucket = 0;
+        for (long long us = latencies[i] / 1000; us > 0 && bucket < LATENCY_HIST_BUCKETS - 1; us >>= 1) bucket++;
+        histogram[bucket]++;
+    }
+
+    printf("%ld requests: min %.1f us, avg %.1f us, max %.1f us\n", requests,
+           latencies[0] / 1000.0, total / 1000.0 / requests, latencies[requests - 1] / 1000.0);
+    printf("p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us\n",
+           latencies[requests / 2] / 1000.0, latencies[requests * 9 / 10] / 1000.0,
+           latencies[requests * 99 / 100] / 1000.0, latencies[requests * 999 / 1000] / 1000.0);
+    for (int i = 0; i < LATENCY_HIST_BUCKETS; i++)
+    {
+        if (histogram[i] == 0) continue;
+        if (i == 0) printf("  < 1 us: %lu\n", histogram[i]);
+        else if (i == LATENCY_HIST_BUCKETS - 1) printf("  >= %d us: %lu\n", 1 << (i - 1), histogram[i]);
+        else printf("  < %d us: %lu\n", 1 << i, histogram[i]);
+    }
+}
+
+static void print_usage()
+{
+    printf("Usage: ./modbus_latency [-a address] [-p port] [-n requests] [-d depth] [-r registers] [-u] [-q]\n");
+    printf("  -a  address of the runtime (127.0.0.1)\n");
+    printf("  -p  Modbus port (502)\n");
+    printf("  -n  number of requests (%d)\n", DEFAULT_REQUESTS);
+    printf("  -d  requests sent back to back before waiting for the responses (1, up to %d)\n", MAX_DEPTH);
+    printf("  -r  registers read by each request (10)\n");
+    printf("  -u  use Modbus/UDP instead of Modbus/TCP\n");
+    printf("  -q  set TCP_QUICKACK on the client socket\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = "127.0.0.1";
+    int port = 502, depth = 1, registers = 10;
+    long requests = DEFAULT_REQUESTS;
+    bool udp = false, quickack = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:n:d:r:uqh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': requests = atol(optarg); break;
+            case 'd': depth = atoi(optarg); break;
+            case 'r': registers = atoi(optarg); break;
+            case 'u': udp = true; break;
+            case 'q': quickack = true; break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+    if (requests <= 0 || depth < 1 || depth > MAX_DEPTH || registers < 1 || registers > 125)
+    {
+        print_usage();
+        exit(1);
+    }
+
+    int fd = connectToServer(host, port, udp, quickack);
+    if (fd < 0) return 1;
+
+    latencies = (long long *)malloc(requests * sizeof(long long));
+    if (latencies == NULL) return 1;
+
+    printf("Reading %d registers from %s:%d over %s, %d request(s) at a time\n",
+           registers, host, port, udp ? "UDP" : "TCP", depth);
+
+    unsigned char requestBuffer[REQUEST_SIZE * MAX_DEPTH];
+    unsigned char response[300];
+    struct timespec sent[MAX_DEPTH], now;
+    long done = 0;
+
+    while (done < requests)
+    {
+        int batch = (requests - done < depth) ? requests - done : depth;
+        for (int i = 0; i < batch; i++)
+        {
+            buildRequest(requestBuffer + i * REQUEST_SIZE, i, 0, registers);
+        }
+
+        //TCP gets the whole pipeline in one write, UDP one datagram each
+        clock_gettime(CLOCK_MONOTONIC, &sent[0]);
+        if (udp)
+        {
+            for (int i = 0; i < batch; i++)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &sent[i]);
+                send(fd, requestBuffer + i * REQUEST_SIZE, REQUEST_SIZE, 0);
+            }
+        }
+        else
+        {
+            for (int i = 1; i < batch; i++) sent[i] = sent[0];
+            if (write(fd, requestBuffer, batch * REQUEST_SIZE) != batch * REQUEST_SIZE)
+            {
+                perror("Can't send the requests");
+                return 1;
+            }
+        }
+
+        for (int i = 0; i < batch; i++)
+        {
+            int transaction = readResponse(fd, response, sizeof(response), udp);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (transaction < 0 || transaction >= batch)
+            {
+                printf("Lost the connection or got an invalid response\n");
+                return 1;
+            }
+            latencies[done + i] = timespecDiff(&now, &sent[transaction]);
+        }
+        done += batch;
+    }
+
+    close(fd);
+    printResults(requests);
+
+    return 0;
+}
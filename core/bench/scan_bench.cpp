@@ -0,0 +1,377 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// Headless scan benchmark for a compiled PLC program. It is linked with
+// Config0.c, Res0.c and the glue against the blank hardware layer (see
+// core_builders/build_bench.sh), and runs the program back to back with
+// scripted input stimuli, without I/O, protocols or sleeping.
+//
+// Reports the time per scan (average and percentiles) and, where
+// perf_event_open is available, cycles, instructions and cache misses per
+// scan. Exits with 1 if the average scan time is above the limit given
+// with -l, so it can gate a program review.
+//
+// Stimulus file: one stimulus per line, "scan address value", where address
+// is %IXa.b, %IBa or %IWa. The value is written to the input image before
+// the given scan. The script repeats after its last scan, so a file with
+// "0 %IX0.0 1" and "10 %IX0.0 0" toggles %IX0.0 every 10 scans.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "iec_types.h"
+#include "ladder.h"
+
+#define DEFAULT_SCANS           1000000
+#define WARMUP_SCANS            1000
+
+IEC_BOOL __DEBUG;
+pthread_mutex_t bufferLock;
+
+//the program is linked into the benchmark instead of loaded with dlopen
+extern "C" struct plc_program plc_program_entry;
+struct plc_program *plc_program = &plc_program_entry;
+
+struct stimulus
+{
+    unsigned long scan;
+    char area;              //'X', 'B' or 'W'
+    int index;
+    int bit;
+    unsigned int value;
+};
+
+static std::vector<struct stimulus> stimuli;
+static unsigned long script_length = 0;
+
+//Hardware counters read around the benchmark loop
+#define COUNTER_CYCLES          0
+#define COUNTER_INSTRUCTIONS    1
+#define COUNTER_CACHE_REFS      2
+#define COUNTER_CACHE_MISSES    3
+#define NUM_COUNTERS            4
+
+static const char *counter_names[NUM_COUNTERS] = {"cycles", "instructions", "cache references", "cache misses"};
+static int counter_fds[NUM_COUNTERS] = {-1, -1, -1, -1};
+
+//-----------------------------------------------------------------------------
+// Helper function - Makes the running thread sleep for the ammount of time
+// in milliseconds. Needed by bindings.cpp, which main.cpp usually provides
+//-----------------------------------------------------------------------------
+void sleep_thread(int milliseconds)
+{
+    struct timespec ts;
+    ts.tv_sec = milliseconds / 1000;
+    ts.tv_nsec = (milliseconds % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// Needed by process_image.cpp. There are no task threads to wake here
+//-----------------------------------------------------------------------------
+void notifyImageChange()
+{
+}
+
+//-----------------------------------------------------------------------------
+// Reads the stimulus file. Returns false if the file can't be used
+//-----------------------------------------------------------------------------
+static bool readStimuli(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char line[256];
+    int line_number = 0;
+
+    if (file == NULL)
+    {
+        printf("Can't open stimulus file %s\n", path);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        struct stimulus s;
+        char address[32];
+        line_number++;
+
+        if (line[0] == '#' || strlen(line) <= 1) continue;
+        if (sscanf(line, "%lu %31s %u", &s.scan, address, &s.value) != 3 ||
+            strncmp(address, "%I", 2))
+        {
+            printf("Invalid stimulus on line %d\n", line_number);
+            fclose(file);
+            return false;
+        }
+
+        s.area = address[2];
+        s.bit = 0;
+        if (s.area == 'X')
+        {
+            if (sscanf(address + 3, "%d.%d", &s.index, &s.bit) != 2 || s.bit < 0 || s.bit > 7)
+                s.index = -1;
+        }
+        else if (s.area == 'B' || s.area == 'W')
+        {
+            if (sscanf(address + 3, "%d", &s.index) != 1)
+                s.index = -1;
+        }
+        else
+        {
+            s.index = -1;
+        }
+
+        if (s.index < 0 || s.index >= BUFFER_SIZE)
+        {
+            printf("Invalid address %s on line %d\n", address, line_number);
+            fclose(file);
+            return false;
+        }
+
+        stimuli.push_back(s);
+        if (s.scan + 1 > script_length) script_length = s.scan + 1;
+    }
+    fclose(file);
+
+    std::stable_sort(stimuli.begin(), stimuli.end(),
+                     [](const struct stimulus &a, const struct stimulus &b) { return a.scan < b.scan; });
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Writes the stimuli for a scan into the input image
+//-----------------------------------------------------------------------------
+static void applyStimuli(unsigned long scan, size_t *next)
+{
+    if (stimuli.empty()) return;
+
+    unsigned long script_scan = scan % script_length;
+    if (script_scan == 0) *next = 0;
+
+    while (*next < stimuli.size() && stimuli[*next].scan == script_scan)
+    {
+        struct stimulus *s = &stimuli[*next];
+        switch (s->area)
+        {
+            case 'X':
+                bool_input[s->index][s->bit] = (s->value != 0);
+                break;
+            case 'B':
+                byte_input[s->index] = s->value;
+                break;
+            case 'W':
+                int_input[s->index] = s->value;
+                break;
+        }
+        (*next)++;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Opens the hardware counters for the calling thread. Counters that can't be
+// opened are left out
+//-----------------------------------------------------------------------------
+static void openCounters()
+{
+#ifdef __linux__
+    static const unsigned long long configs[NUM_COUNTERS] =
+    {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_REFERENCES,
+        PERF_COUNT_HW_CACHE_MISSES
+    };
+
+    for (int i = 0; i < NUM_COUNTERS; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        counter_fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+}
+
+static void startCounters()
+{
+#ifdef __linux__
+    for (int i = 0; i < NUM_COUNTERS; i++)
+    {
+        if (counter_fds[i] < 0) continue;
+        ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static void stopCounters()
+{
+#ifdef __linux__
+    for (int i = 0; i < NUM_COUNTERS; i++)
+    {
+        if (counter_fds[i] >= 0) ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Prints the value of each hardware counter per scan
+//-----------------------------------------------------------------------------
+static void printCounters(unsigned long scans)
+{
+    bool available = false;
+
+    for (int i = 0; i < NUM_COUNTERS; i++)
+    {
+        unsigned long long value;
+        if (counter_fds[i] < 0 || read(counter_fds[i], &value, sizeof(value)) != sizeof(value)) continue;
+
+        printf("  %-18s %.1f per scan\n", counter_names[i], (double)value / scans);
+        available = true;
+        close(counter_fds[i]);
+    }
+
+    if (!available)
+    {
+        printf("  hardware counters not available\n");
+    }
+}
+
+static void print_usage()
+{
+    printf("Usage: ./scan_bench [-n scans] [-s stimulus_file] [-l max_avg_ns]\n");
+    printf("Runs the PLC program for the given number of scans (%d by default)\n", DEFAULT_SCANS);
+    printf("and reports the time per scan\n");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long scans = DEFAULT_SCANS;
+    long long limit = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:l:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                scans = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                if (!readStimuli(optarg)) exit(1);
+                break;
+            case 'l':
+                limit = atoll(optarg);
+                break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+    if (scans == 0)
+    {
+        print_usage();
+        exit(1);
+    }
+
+    pthread_mutex_init(&bufferLock, NULL);
+
+    plc_program->init();
+    if (bindLocatedVariables() > 0)
+    {
+        printf("Located variables are not attached to the process image\n");
+        exit(1);
+    }
+    initializeHardware();
+
+    //the PLC time advances one tick per scan, as if the program was paced
+    //by the runtime, so the timers in the program behave the same way
+    unsigned long tick = 0;
+    size_t next_stimulus = 0;
+    plc_program->update_time(0);
+    for (int i = 0; i < WARMUP_SCANS; i++)
+    {
+        applyStimuli(tick, &next_stimulus);
+        plc_program->run(tick++);
+        plc_program->update_time((unsigned long long)tick * *plc_program->ticktime);
+    }
+
+    std::vector<unsigned int> samples(scans);
+    struct timespec scan_start, scan_end, run_start, run_end;
+
+    openCounters();
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+    startCounters();
+    for (unsigned long i = 0; i < scans; i++)
+    {
+        applyStimuli(tick, &next_stimulus);
+
+        clock_gettime(CLOCK_MONOTONIC, &scan_start);
+        updateBuffersIn();
+        plc_program->run(tick++);
+        updateBuffersOut();
+        clock_gettime(CLOCK_MONOTONIC, &scan_end);
+
+        plc_program->update_time((unsigned long long)tick * *plc_program->ticktime);
+        samples[i] = timespecDiff(&scan_end, &scan_start);
+    }
+    stopCounters();
+    clock_gettime(CLOCK_MONOTONIC, &run_end);
+
+    long long total = timespecDiff(&run_end, &run_start);
+    long long average = total / scans;
+    std::sort(samples.begin(), samples.end());
+
+    printf("Scans:    %lu (%lu stimuli, script of %lu scans)\n", scans, (unsigned long)stimuli.size(), script_length);
+    printf("Average:  %lld ns per scan\n", average);
+    printf("Minimum:  %u ns\n", samples[0]);
+    printf("p50:      %u ns\n", samples[scans * 50 / 100]);
+    printf("p90:      %u ns\n", samples[scans * 90 / 100]);
+    printf("p99:      %u ns\n", samples[scans * 99 / 100]);
+    printf("p99.9:    %u ns\n", samples[scans * 999 / 1000]);
+    printf("Maximum:  %u ns\n", samples[scans - 1]);
+    printf("Counters:\n");
+    printCounters(scans);
+
+    if (limit > 0 && average > limit)
+    {
+        printf("FAIL: average scan time is above %lld ns\n", limit);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,162 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file validates the binding between the located variables of the IEC
+// program and the process image. The binding table is generated by the
+// glue_generator program together with glueVars.cpp. Binding happens before
+// the main loop starts and again when the PLC program is replaced. Every time the table is (re)validated the
+// binding version is increased, so threads that cache the addresses of
+// located variables know when they must resolve them again.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ladder.h"
+
+static volatile unsigned int binding_version = 0;
+
+//-----------------------------------------------------------------------------
+// Checks every entry of the binding table. Returns the number of located
+// variables that are not pointing to their place on the process image
+//-----------------------------------------------------------------------------
+int checkBindings()
+{
+    struct located_binding *bindings = plc_program->bindings;
+    int errors = 0;
+
+    for (int i = 0; bindings[i].name != NULL; i++)
+    {
+        if (bindings[i].location != NULL && *bindings[i].pointer != bindings[i].location)
+        {
+            printf("Binding error: %s is not attached to the process image\n", bindings[i].name);
+            errors++;
+        }
+    }
+
+    return errors;
+}
+
+//-----------------------------------------------------------------------------
+// Validates the binding table and publishes a new binding version. Must be
+// called after the program is initialized, and with bufferLock held when the
+// main loop is running. Returns the number of broken bindings
+//-----------------------------------------------------------------------------
+int bindLocatedVariables()
+{
+    int errors = checkBindings();
+    __sync_fetch_and_add(&binding_version, 1);
+
+    return errors;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the current binding version. Cached addresses obtained with an
+// older version must be resolved again
+//-----------------------------------------------------------------------------
+unsigned int getBindingVersion()
+{
+    return __sync_fetch_and_add(&binding_version, 0);
+}
+
+//-----------------------------------------------------------------------------
+// Finds the address of a located variable by its name (ex: __IX0_0). The
+// binding version the address belongs to is stored on version. Returns NULL
+// if the program has no such variable. Must be called with bufferLock held
+// when the main loop is running
+//-----------------------------------------------------------------------------
+void *resolveLocatedVariable(const char *name, unsigned int *version)
+{
+    struct located_binding *bindings = plc_program->bindings;
+    *version = getBindingVersion();
+
+    for (int i = 0; bindings[i].name != NULL; i++)
+    {
+        if (!strcmp(bindings[i].name, name))
+        {
+            return *bindings[i].pointer;
+        }
+    }
+
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Finds the element of the process image at an address, as the location of
+// a binding. Booleans are numbered as byte address * 8 + bit, as on the scan
+// journal. Returns false if the address is not on the process image
+//-----------------------------------------------------------------------------
+bool findImageElement(const void *location, uint8_t *area, int *index)
+{
+    struct image_area
+    {
+        uint8_t area;
+        const void *start;
+        int size;           //bytes per element
+        int count;
+    };
+    static const struct image_area areas[] =
+    {
+        {IMAGE_BOOL_INPUT, bool_input, 1, BUFFER_SIZE * 8},
+        {IMAGE_BOOL_OUTPUT, bool_output, 1, BUFFER_SIZE * 8},
+        {IMAGE_BYTE_INPUT, byte_input, 1, BUFFER_SIZE},
+        {IMAGE_BYTE_OUTPUT, byte_output, 1, BUFFER_SIZE},
+        {IMAGE_INT_INPUT, int_input, 2, BUFFER_SIZE},
+        {IMAGE_INT_OUTPUT, int_output, 2, BUFFER_SIZE},
+        {IMAGE_INT_MEMORY, int_memory, 2, BUFFER_SIZE},
+        {IMAGE_DINT_MEMORY, dint_memory, 4, BUFFER_SIZE},
+        {IMAGE_LINT_MEMORY, lint_memory, 8, BUFFER_SIZE},
+    };
+
+    const char *address = (const char *)location;
+    for (unsigned int i = 0; i < sizeof(areas) / sizeof(areas[0]); i++)
+    {
+        const char *start = (const char *)areas[i].start;
+        if (address < start || address >= start + areas[i].size * areas[i].count) continue;
+
+        *area = areas[i].area;
+        *index = (address - start) / areas[i].size;
+        return true;
+    }
+
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// Debug thread. Checks the binding table periodically, outside of the main
+// loop. The argument is the interval between checks in milliseconds
+//-----------------------------------------------------------------------------
+void *bindingCheckThread(void *arg)
+{
+    int interval = *(int *)arg;
+
+    while (1)
+    {
+        sleep_thread(interval);
+
+        //the lock keeps the program from being replaced during the check
+        pthread_mutex_lock(&bufferLock);
+        int errors = checkBindings();
+        pthread_mutex_unlock(&bufferLock);
+        if (errors > 0)
+        {
+            printf("WARNING: Binding integrity check failed on version %u\n", getBindingVersion());
+        }
+    }
+}
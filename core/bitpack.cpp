@@ -0,0 +1,179 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file converts between runs of IEC_BOOL (one byte per boolean, as the
+// process image keeps them) and packed bit fields (eight booleans per byte,
+// first one on the lowest bit, as Modbus sends them). Eight or sixteen
+// booleans are converted at once:
+//
+//   SSE2     movemask packs sixteen bytes at once
+//   BMI2     pext/pdep move the lowest bit of every byte in one instruction,
+//            for unpacking and for packing the last blocks of eight
+//   others   a multiplication gathers the eight bits into the top byte, and
+//            another one spreads them back
+//
+// The instruction set is picked at compile time. x86-64 always has SSE2,
+// and BMI2 is used when the runtime is built with -mbmi2 or -march=native.
+// Any non zero IEC_BOOL counts as TRUE, the same as the program does.
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+
+#if defined(__BMI2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "ladder.h"
+
+#define LANE_LOW_BITS           0x0101010101010101ULL
+#define LANE_HIGH_BITS          0x8080808080808080ULL
+#define LANE_LOW_7_BITS         0x7f7f7f7f7f7f7f7fULL
+
+//-----------------------------------------------------------------------------
+// Loads eight booleans with boolean i on the byte lane i (bits 8i to 8i+7),
+// and stores them back
+//-----------------------------------------------------------------------------
+static inline uint64_t loadLanes(const IEC_BOOL *src)
+{
+    uint64_t x;
+    memcpy(&x, src, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+static inline void storeLanes(IEC_BOOL *dest, uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(dest, &x, 8);
+}
+
+//-----------------------------------------------------------------------------
+// Turns every non zero byte of x into 1
+//-----------------------------------------------------------------------------
+static inline uint64_t normalizeLanes(uint64_t x)
+{
+    return ((((x & LANE_LOW_7_BITS) + LANE_LOW_7_BITS) | x) & LANE_HIGH_BITS) >> 7;
+}
+
+//-----------------------------------------------------------------------------
+// Packs eight booleans into a byte
+//-----------------------------------------------------------------------------
+static inline unsigned int pack8(const IEC_BOOL *src)
+{
+#if defined(__SSE2__) && !defined(__BMI2__)
+    __m128i bytes = _mm_loadl_epi64((const __m128i *)src);
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128())) & 0xff;
+#else
+    uint64_t x = normalizeLanes(loadLanes(src));
+#if defined(__BMI2__)
+    return (unsigned int)_pext_u64(x, LANE_LOW_BITS);
+#else
+    //boolean i is on bit 8i, and the multiplication moves it to bit 56 + i
+    //without carrying into the top byte
+    return (unsigned int)((x * 0x0102040810204080ULL) >> 56);
+#endif
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Packs count booleans into dest, from bit destBit on. The bits are ORed into
+// dest, so dest must be cleared first. Bytes of dest past the last bit are
+// never touched
+//-----------------------------------------------------------------------------
+void packBits(const IEC_BOOL *src, int count, unsigned char *dest, int destBit)
+{
+    int shift = destBit % 8;
+    int i = 0;
+    dest += destBit / 8;
+
+#if defined(__SSE2__)
+    for (; count - i >= 16; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(src + i));
+        unsigned int bits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128())) & 0xffff;
+        bits <<= shift;
+        dest[0] |= bits;
+        dest[1] |= bits >> 8;
+        if (shift) dest[2] |= bits >> 16;
+        dest += 2;
+    }
+#endif
+    for (; count - i >= 8; i += 8)
+    {
+        unsigned int bits = pack8(src + i) << shift;
+        dest[0] |= bits;
+        if (shift) dest[1] |= bits >> 8;
+        dest++;
+    }
+
+    //the last few booleans
+    unsigned int bits = 0;
+    for (int j = 0; i + j < count; j++)
+    {
+        if (src[i + j]) bits |= 1 << j;
+    }
+    bits <<= shift;
+    if (bits & 0xff) dest[0] |= bits;
+    if (bits >> 8) dest[1] |= bits >> 8;
+}
+
+//-----------------------------------------------------------------------------
+// Spreads the bits of a byte into the byte lanes of a 64-bit value, bit i
+// on lane i. That is the layout of the booleans on a process image write
+//-----------------------------------------------------------------------------
+uint64_t unpackByteLanes(unsigned int bits)
+{
+#if defined(__BMI2__)
+    return _pdep_u64(bits, LANE_LOW_BITS);
+#else
+    //copy the byte to every lane and keep bit i on lane i
+    uint64_t x = ((uint64_t)(bits & 0xff) * LANE_LOW_BITS) & 0x8040201008040201ULL;
+    return ((x + LANE_LOW_7_BITS) >> 7) & LANE_LOW_BITS;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Unpacks count bits from src, starting at bit srcBit, into booleans
+//-----------------------------------------------------------------------------
+void unpackBits(const unsigned char *src, int srcBit, int count, IEC_BOOL *dest)
+{
+    int shift = srcBit % 8;
+    int i = 0;
+    src += srcBit / 8;
+
+    for (; count - i >= 8; i += 8)
+    {
+        unsigned int bits = src[0] >> shift;
+        if (shift) bits |= src[1] << (8 - shift);
+
+        storeLanes(dest + i, unpackByteLanes(bits));
+        src++;
+    }
+
+    for (int j = 0; i < count; i++, j++)
+    {
+        int bit = shift + j;
+        dest[i] = (src[bit / 8] >> (bit % 8)) & 1;
+    }
+}
@@ -0,0 +1,14 @@
+#!/bin/bash
+cd core
+echo Generating object files...
+g++ -I ./lib -c Config0.c
+g++ -I ./lib -c Res0.c
+echo Generating glueVars.cpp
+./glue_generator
+echo Compiling scan benchmark
+g++ bench/scan_bench.cpp glueVars.cpp bindings.cpp process_image.cpp telemetry.cpp admission.cpp hardware_layers/blank.cpp *.o -o scan_bench -I ./lib -I . -pthread -fpermissive
+echo Compiling bit pack benchmark
+g++ -O2 bench/bitpack_bench.cpp bitpack.cpp -o bitpack_bench -I ./lib -I .
+echo Compiling Modbus latency client
+g++ -O2 bench/modbus_latency.cpp -o modbus_latency
+cd ..
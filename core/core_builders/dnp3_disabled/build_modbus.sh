@@ -1,10 +1,12 @@
 #!/bin/bash
 cd core
 echo Generating object files...
-g++ -I ./lib -c Config0.c
-g++ -I ./lib -c Res0.c
+g++ -I ./lib -fPIC -c Config0.c
+g++ -I ./lib -fPIC -c Res0.c
 echo Generating glueVars.cpp
 ./glue_generator
+echo Compiling PLC program
+g++ -shared -fPIC glueVars.cpp Config0.o Res0.o -o plc_program.so.tmp -I ./lib -fpermissive && mv -f plc_program.so.tmp plc_program.so
 echo Compiling main program
-g++ *.cpp *.o -o openplc -I ./lib -pthread -fpermissive `pkg-config --cflags --libs libmodbus`
+g++ `ls *.cpp | grep -v glueVars.cpp` -o openplc -I ./lib -pthread -fpermissive `pkg-config --cflags --libs libmodbus` -rdynamic -ldl
 cd ..
@@ -1,10 +1,18 @@
 #!/bin/bash
 cd core
 echo Generating object files...
-g++ -I ./lib -c Config0.c
-g++ -I ./lib -c Res0.c
+g++ -I ./lib -fPIC -c Config0.c
+g++ -I ./lib -fPIC -c Res0.c
 echo Generating glueVars.cpp
 ./glue_generator
-echo Compiling main program
-g++ *.cpp *.o -o openplc -I ./lib -pthread -fpermissive
+if [ "$(uname -o)" = "Cygwin" ]; then
+	#no dlopen on Windows, the program is linked into the runtime
+	echo Compiling main program
+	g++ *.cpp *.o -o openplc -I ./lib -pthread -fpermissive -DSTATIC_PROGRAM
+else
+	echo Compiling PLC program
+	g++ -shared -fPIC glueVars.cpp Config0.o Res0.o -o plc_program.so.tmp -I ./lib -fpermissive && mv -f plc_program.so.tmp plc_program.so
+	echo Compiling main program
+	g++ `ls *.cpp | grep -v glueVars.cpp` -o openplc -I ./lib -pthread -fpermissive -rdynamic -ldl
+fi
 cd ..
@@ -6,5 +6,5 @@ g++ -std=gnu++11 -I ./lib -c Res0.c -lasiodnp3 -lasiopal -lopendnp3 -lopenpal -W
 echo Generating glueVars.cpp
 ./glue_generator
 echo Compiling main program
-g++ -std=gnu++11 *.cpp *.o -o openplc -I ./lib -pthread -fpermissive -I /usr/local/include/modbus -L /usr/local/lib -lmodbus -lasiodnp3 -lasiopal -lopendnp3 -lopenpal -Wno-narrowing
+g++ -std=gnu++11 *.cpp *.o -o openplc -I ./lib -pthread -fpermissive -DSTATIC_PROGRAM -I /usr/local/include/modbus -L /usr/local/lib -lmodbus -lasiodnp3 -lasiopal -lopendnp3 -lopenpal -Wno-narrowing
 cd ..
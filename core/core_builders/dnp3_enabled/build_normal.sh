@@ -1,10 +1,12 @@
 #!/bin/bash
 cd core
 echo Generating object files...
-g++ -std=gnu++11 -I ./lib -c Config0.c -lasiodnp3 -lasiopal -lopendnp3 -lopenpal -Wno-narrowing
-g++ -std=gnu++11 -I ./lib -c Res0.c -lasiodnp3 -lasiopal -lopendnp3 -lopenpal -Wno-narrowing
+g++ -std=gnu++11 -I ./lib -fPIC -c Config0.c -lasiodnp3 -lasiopal -lopendnp3 -lopenpal -Wno-narrowing
+g++ -std=gnu++11 -I ./lib -fPIC -c Res0.c -lasiodnp3 -lasiopal -lopendnp3 -lopenpal -Wno-narrowing
 echo Generating glueVars.cpp
 ./glue_generator
+echo Compiling PLC program
+g++ -std=gnu++11 -shared -fPIC glueVars.cpp Config0.o Res0.o -o plc_program.so.tmp -I ./lib -fpermissive -Wno-narrowing && mv -f plc_program.so.tmp plc_program.so
 echo Compiling main program
-g++ -std=gnu++11 *.cpp *.o -o openplc -I ./lib -pthread -fpermissive -lasiodnp3 -lasiopal -lopendnp3 -lopenpal -Wno-narrowing
+g++ -std=gnu++11 `ls *.cpp | grep -v glueVars.cpp` -o openplc -I ./lib -pthread -fpermissive -lasiodnp3 -lasiopal -lopendnp3 -lopenpal -Wno-narrowing -rdynamic -ldl
 cd ..
@@ -25,23 +25,29 @@
 #include <cctype>
 #include <locale>
 #include <fstream>
+#include <string.h>
+#include <vector>
+#include <map>
 
 #include "ladder.h"
 
-//some modbus defines
-#define MAX_DISCRETE_INPUT 		800
-#define MAX_COILS 				800
-#define MAX_HOLD_REGS 			8192
-#define MAX_INP_REGS			1024
+//records taken from the scan journal at once
+#define JOURNAL_BATCH           1024
 
-#define MIN_16B_RANGE			1024
-#define MAX_16B_RANGE			2047
-#define MIN_32B_RANGE			2048
-#define MAX_32B_RANGE			4095
-#define MIN_64B_RANGE			4096
-#define MAX_64B_RANGE			8191
+//settings of the points, read together with dnp3.cfg
+#define POINT_CONFIG_FILE       "dnp3points.cfg"
 
-#define OPLC_CYCLE              50000000
+//name of the outstation when dnp3.cfg doesn't list any
+#define DEFAULT_OUTSTATION      "outstation"
+
+//types of points on the outstation database
+#define POINT_BINARY            0
+#define POINT_BINARY_OUTPUT     1
+#define POINT_ANALOG            2
+#define POINT_ANALOG_OUTPUT     3
+#define NUM_POINT_TYPES         4
+
+#define NUM_IMAGE_AREAS         9
 
 
 
@@ -52,12 +58,6 @@ using namespace asiopal;
 using namespace asiodnp3;
 
 
-IEC_BOOL dnp3_discrete_input[MAX_DISCRETE_INPUT];
-IEC_BOOL dnp3_coils[MAX_COILS];
-IEC_UINT dnp3_input_regs[MAX_INP_REGS];
-IEC_UINT dnp3_holding_regs[MAX_HOLD_REGS];
-
-
 // trim string from left
 static inline std::string &ltrim(std::string &s) {
     s.erase(s.begin(), std::find_if(s.begin(), s.end(),
@@ -78,11 +78,139 @@ static inline std::string &trim(std::string &s) {
 }
 
 
+//------------------------------------------------------------------
+// Map between the DNP3 points and the process image. Only the located
+// variables of the program become points. They are numbered from 0 on
+// each type, in the order of their IEC addresses: %IX are binary inputs,
+// %QX binary outputs, %IW analog inputs, and %QW, %MW, %MD and %ML are
+// analog outputs. The map is built once, before the outstation starts
+//------------------------------------------------------------------
+struct dnp3_point {
+    uint8_t area;
+    uint16_t index;     //element of the area
+};
+
+//type of the points of each area of the process image, -1 for none
+static const int area_points[NUM_IMAGE_AREAS] = {
+    POINT_BINARY, POINT_BINARY_OUTPUT, -1, -1, POINT_ANALOG,
+    POINT_ANALOG_OUTPUT, POINT_ANALOG_OUTPUT, POINT_ANALOG_OUTPUT, POINT_ANALOG_OUTPUT
+};
+static const char *area_names[NUM_IMAGE_AREAS] = {"%IX", "%QX", "%IB", "%QB", "%IW", "%QW", "%MW", "%MD", "%ML"};
+static const char *point_names[NUM_POINT_TYPES] = {"binary input", "binary output", "analog input", "analog output"};
+static const char *point_keys[NUM_POINT_TYPES] = {"binary_input", "binary_output", "analog_input", "analog_output"};
+
+static std::vector<struct dnp3_point> points[NUM_POINT_TYPES];  //by DNP3 index
+static std::vector<int> point_index[NUM_IMAGE_AREAS];           //by element, -1 if not a point
+static unsigned int mapped_binding_version;
+
+//------------------------------------------------------------------
+// Builds the point map from the binding table of the program
+//------------------------------------------------------------------
+static void buildPointMap() {
+    for (int a = 0; a < NUM_IMAGE_AREAS; a++)
+        point_index[a].assign((a <= IMAGE_BOOL_OUTPUT) ? BUFFER_SIZE * 8 : BUFFER_SIZE, -1);
+
+    //the lock keeps the program from being replaced while its table is read
+    pthread_mutex_lock(&bufferLock);
+    struct located_binding *bindings = plc_program->bindings;
+    for (int i = 0; bindings[i].name != NULL; i++) {
+        uint8_t area;
+        int element;
+        if (bindings[i].location == NULL || !findImageElement(bindings[i].location, &area, &element))
+            continue;
+        if (area_points[area] >= 0)
+            point_index[area][element] = 0;
+    }
+    mapped_binding_version = getBindingVersion();
+    pthread_mutex_unlock(&bufferLock);
+
+    //the areas are in the order of the IEC addresses, so walking them in
+    //order numbers the points of each type densely
+    for (int a = 0; a < NUM_IMAGE_AREAS; a++) {
+        for (size_t e = 0; e < point_index[a].size(); e++) {
+            if (point_index[a][e] < 0)
+                continue;
+            std::vector<struct dnp3_point> &list = points[area_points[a]];
+            struct dnp3_point point = {(uint8_t)a, (uint16_t)e};
+            point_index[a][e] = list.size();
+            list.push_back(point);
+        }
+    }
+}
+
+//------------------------------------------------------------------
+// Writes the IEC address of a point (ex: %IX0.3, %QW12)
+//------------------------------------------------------------------
+static void formatAddress(const struct dnp3_point &point, char *address, size_t size) {
+    if (point.area <= IMAGE_BOOL_OUTPUT)
+        snprintf(address, size, "%s%d.%d", area_names[point.area], point.index / 8, point.index % 8);
+    else
+        snprintf(address, size, "%s%d", area_names[point.area], point.index);
+}
+
+//------------------------------------------------------------------
+// Prints the point map, with consecutive addresses as ranges, so the
+// master can be configured with it
+//------------------------------------------------------------------
+static void printPointMap() {
+    for (int t = 0; t < NUM_POINT_TYPES; t++) {
+        std::vector<struct dnp3_point> &list = points[t];
+        printf("DNP3: %d %s points\n", (int)list.size(), point_names[t]);
+
+        size_t first = 0;
+        for (size_t i = 1; i <= list.size(); i++) {
+            if (i < list.size() && list[i].area == list[i-1].area && list[i].index == list[i-1].index + 1)
+                continue;
+
+            char start[16], stop[16];
+            formatAddress(list[first], start, sizeof(start));
+            formatAddress(list[i-1], stop, sizeof(stop));
+            if (first == i - 1)
+                printf("  %d: %s\n", (int)first, start);
+            else
+                printf("  %d-%d: %s-%s\n", (int)first, (int)(i - 1), start, stop);
+            first = i;
+        }
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Class to handle commands from the master
 //-----------------------------------------------------------------------------
 class CommandCallback: public ICommandHandler {
 public:
+
+    //Commands are queued on the process image and applied on the next scan
+    static CommandStatus QueueWrite(uint8_t area, uint16_t index, uint64_t value, uint64_t mask) {
+        struct image_write write;
+        write.area = area;
+        write.index = index;
+        write.value = value;
+        write.mask = mask;
+
+        if(!queueImageWrites(&write, 1))
+            return CommandStatus::PROCESSING_LIMITED;
+
+        return CommandStatus::SUCCESS;
+    }
+
+    //Analog outputs are written with the width of the element they are
+    //mapped to, whatever the type of the command
+    static CommandStatus WriteAnalog(uint16_t index, int64_t value) {
+        if(index >= points[POINT_ANALOG_OUTPUT].size())
+            return CommandStatus::OUT_OF_RANGE;
+
+        const struct dnp3_point &point = points[POINT_ANALOG_OUTPUT][index];
+        switch(point.area) {
+            case IMAGE_INT_OUTPUT:
+            case IMAGE_INT_MEMORY:
+                return QueueWrite(point.area, point.index, (IEC_UINT)value, 0xffff);
+            case IMAGE_DINT_MEMORY:
+                return QueueWrite(point.area, point.index, (uint32_t)(IEC_DINT)value, 0xffffffff);
+            default:
+                return QueueWrite(point.area, point.index, (uint64_t)(IEC_LINT)value, 0xffffffffffffffffULL);
+        }
+    }
    
     //CROB
     virtual CommandStatus Select(const ControlRelayOutputBlock& command, uint16_t index) {
@@ -93,14 +221,14 @@ public:
         CommandStatus return_val;
 
         if(code == ControlCode::LATCH_ON || code == ControlCode::LATCH_OFF) {
-            return_val = CommandStatus::SUCCESS;
-
             IEC_BOOL crob_val = (code == ControlCode::LATCH_ON);
-            pthread_mutex_lock(&bufferLock);
-            if(bool_output[index/8][index%8] != NULL) {
-                *bool_output[index/8][index%8] = crob_val;
-            }
-            pthread_mutex_unlock(&bufferLock);
+            if(index >= points[POINT_BINARY_OUTPUT].size())
+                return CommandStatus::OUT_OF_RANGE;
+
+            //one byte lane per coil
+            int coil = points[POINT_BINARY_OUTPUT][index].index;
+            int lane = (coil % 8) * 8;
+            return_val = QueueWrite(IMAGE_BOOL_OUTPUT, coil/8, (uint64_t)crob_val << lane, (uint64_t)0xff << lane);
         }
         else {
             return_val = CommandStatus::NOT_SUPPORTED;
@@ -114,20 +242,7 @@ public:
         return CommandStatus::SUCCESS;
     }
     virtual CommandStatus Operate(const AnalogOutputInt16& command, uint16_t index, OperateType opType) {
-        auto ao_val = command.value;
-        pthread_mutex_lock(&bufferLock);
-        if(index < MIN_16B_RANGE && int_output[index] != NULL) {
-            *int_output[index] = ao_val;
-        }
-        else if(index < MAX_16B_RANGE && 
-                int_memory[index - MIN_16B_RANGE] != NULL) {
-            *int_memory[index - MIN_16B_RANGE] = ao_val;
-        }
-        else if(index > MAX_16B_RANGE) {
-            return CommandStatus::OUT_OF_RANGE;
-        }
-        pthread_mutex_unlock(&bufferLock);
-        return CommandStatus::SUCCESS;
+        return WriteAnalog(index, command.value);
     }
 
     //AnalogOut 32 (Int)
@@ -135,18 +250,7 @@ public:
         return CommandStatus::SUCCESS;
     }
     virtual CommandStatus Operate(const AnalogOutputInt32& command, uint16_t index, OperateType opType) {
-        auto ao_val = command.value;
-
-        if(index < MIN_32B_RANGE || index >= MAX_32B_RANGE)
-            return CommandStatus::OUT_OF_RANGE;
-        
-        pthread_mutex_lock(&bufferLock);
-        if(dint_memory[index - MIN_32B_RANGE] != NULL) {
-            *dint_memory[index - MIN_32B_RANGE] = ao_val;
-        }
-        pthread_mutex_unlock(&bufferLock);
-
-        return CommandStatus::SUCCESS;
+        return WriteAnalog(index, (int64_t)command.value);
     }
 
     //AnalogOut 32 (Float)
@@ -155,18 +259,7 @@ public:
         return CommandStatus::SUCCESS;
     }
     virtual CommandStatus Operate(const AnalogOutputFloat32& command, uint16_t index, OperateType opType) {
-        auto ao_val = command.value;
-
-        if(index < MIN_32B_RANGE || index >= MAX_32B_RANGE)
-            return CommandStatus::OUT_OF_RANGE;
-        
-        pthread_mutex_lock(&bufferLock);
-        if(dint_memory[index - MIN_32B_RANGE] != NULL) {
-            *dint_memory[index - MIN_32B_RANGE] = ao_val;
-        }
-        pthread_mutex_unlock(&bufferLock);
-
-        return CommandStatus::SUCCESS;
+        return WriteAnalog(index, (int64_t)command.value);
     }
 
     //AnalogOut 64
@@ -174,120 +267,457 @@ public:
         return CommandStatus::SUCCESS;
     }
     virtual CommandStatus Operate(const AnalogOutputDouble64& command, uint16_t index, OperateType opType) {
-        auto ao_val = command.value;
-
-        if(index < MIN_64B_RANGE || index >= MAX_64B_RANGE)
-            return CommandStatus::OUT_OF_RANGE;
-        
-        pthread_mutex_lock(&bufferLock);
-        if(lint_memory[index - MIN_64B_RANGE] != NULL) {
-            *lint_memory[index - MIN_64B_RANGE] = ao_val;
-        }
-        pthread_mutex_unlock(&bufferLock);
-
-        return CommandStatus::SUCCESS;
+        return WriteAnalog(index, (int64_t)command.value);
     }
 protected:
     void Start() final {}
     void End() final {}
 };
 
+//values the outstations already have. Every outstation gets the same
+//updates, so one shadow serves all of them
+static struct process_image shadow;
+
 //------------------------------------------------------------------
-// Function to update DNP3 values every time they may have changed
+// Applies the updates on the builder to every outstation. They all share
+// the same list of updates, which is built only once
 //------------------------------------------------------------------
-void update_vals(std::shared_ptr<IOutstation> outstation){
-    UpdateBuilder builder;
-    // Update Discrete input (Binary input)
-    for(int i = 1; i < MAX_DISCRETE_INPUT; i++) {
-        builder.Update(Binary((bool)(*bool_input[i/8][i%8])), i);
+static void applyUpdates(const std::vector<std::shared_ptr<IOutstation>> &outstations, UpdateBuilder &builder) {
+    Updates updates = builder.Build();
+    for (size_t i = 0; i < outstations.size(); i++)
+        outstations[i]->Apply(updates);
+}
 
+//------------------------------------------------------------------
+// Reads an element of a copy of the process image, with the bits it has
+// on the scan journal
+//------------------------------------------------------------------
+static uint64_t imageElement(const struct process_image *image, uint8_t area, int i) {
+    switch (area) {
+        case IMAGE_BOOL_INPUT:
+            return image->bool_input[i/8][i%8];
+        case IMAGE_BOOL_OUTPUT:
+            return image->bool_output[i/8][i%8];
+        case IMAGE_INT_INPUT:
+            return image->int_input[i];
+        case IMAGE_INT_OUTPUT:
+            return image->int_output[i];
+        case IMAGE_INT_MEMORY:
+            return image->int_memory[i];
+        case IMAGE_DINT_MEMORY:
+            return (uint32_t)image->dint_memory[i];
+        case IMAGE_LINT_MEMORY:
+            return (uint64_t)image->lint_memory[i];
     }
-    // Update Coils (Binary Output)
-    for(int i = 0; i < MAX_COILS; i++) {
-        builder.Update(BinaryOutputStatus((bool)(*bool_output[i/8][i%8])), i);
 
-    }    
-    // Update Input Registers (Analog Input)
-    for (int i = 0; i < MAX_INP_REGS; i++) {
-        builder.Update(Analog((int)(*int_input[i])), i);
+    return 0;
+}
 
+//------------------------------------------------------------------
+// Adds the new value of an element of the process image to the updates
+// for the outstation, stamped with time (ms since the epoch), and keeps
+// it on the shadow. Returns false if the element is not a DNP3 point
+//------------------------------------------------------------------
+static bool updatePoint(UpdateBuilder &builder, uint8_t area, int i, uint64_t value, DNPTime time) {
+    const uint8_t online = 0x01;
+
+    if (area >= NUM_IMAGE_AREAS || point_index[area][i] < 0)
+        return false;
+
+    uint16_t index = point_index[area][i];
+    switch (area) {
+        // Discrete input (Binary input)
+        case IMAGE_BOOL_INPUT:
+            shadow.bool_input[i/8][i%8] = value;
+            builder.Update(Binary((bool)value, online, time), index);
+            break;
+        // Coils (Binary Output)
+        case IMAGE_BOOL_OUTPUT:
+            shadow.bool_output[i/8][i%8] = value;
+            builder.Update(BinaryOutputStatus((bool)value, online, time), index);
+            break;
+        // Input Registers (Analog Input)
+        case IMAGE_INT_INPUT:
+            shadow.int_input[i] = value;
+            builder.Update(Analog((int)(IEC_UINT)value, online, time), index);
+            break;
+        // Holding Registers (Analog Output)
+        case IMAGE_INT_OUTPUT:
+            shadow.int_output[i] = value;
+            builder.Update(AnalogOutputStatus((int)(IEC_UINT)value, online, time), index);
+            break;
+        // Holding registers for memory
+        case IMAGE_INT_MEMORY:
+            shadow.int_memory[i] = value;
+            builder.Update(AnalogOutputStatus((int)(IEC_UINT)value, online, time), index);
+            break;
+        // Holding registers for 32 b memory
+        case IMAGE_DINT_MEMORY:
+            shadow.dint_memory[i] = value;
+            builder.Update(AnalogOutputStatus((int)(IEC_DINT)value, online, time), index);
+            break;
+        // Holding registers for 64 b memory
+        case IMAGE_LINT_MEMORY:
+            shadow.lint_memory[i] = value;
+            builder.Update(AnalogOutputStatus((int)(IEC_LINT)value, online, time), index);
+            break;
     }
-    // Update Holding Registers (Analog Output)
-    for (int i = 0; i < MIN_16B_RANGE; i++) {
-        builder.Update(AnalogOutputStatus((int)(*int_output[i])), i);
+
+    return true;
+}
+
+//------------------------------------------------------------------
+// Brings the outstation up to date with the published snapshot, stamping
+// the changes with the current time. Only the points whose value differs
+// from the shadow are sent, and the first update sends every point.
+// Returns the number of the snapshot the outstations are synchronized with
+//------------------------------------------------------------------
+unsigned int update_vals(const std::vector<std::shared_ptr<IOutstation>> &outstations){
+    //the outstation works on a copy of the image, so the scan is never held
+    //while the database is updated
+    static struct process_image image;
+    static bool shadow_valid = false;
+
+    unsigned int scan = copyImageSnapshot(&image);
+
+    //the builder only allocates once a point is added to it
+    UpdateBuilder builder;
+    bool changed = false;
+    DNPTime now(asiopal::UTCTimeSource::Instance().Now().msSinceEpoch);
+
+    for (int t = 0; t < NUM_POINT_TYPES; t++) {
+        for (size_t p = 0; p < points[t].size(); p++) {
+            uint8_t area = points[t][p].area;
+            int i = points[t][p].index;
+            uint64_t value = imageElement(&image, area, i);
+            if (shadow_valid && value == imageElement(&shadow, area, i))
+                continue;
+            changed |= updatePoint(builder, area, i, value, now);
+        }
+    }
+    shadow_valid = true;
+
+    if (changed)
+        applyUpdates(outstations, builder);
+
+    return scan;
+}
+
+//------------------------------------------------------------------
+// Sends the changes recorded after every scan to the outstations, in the
+// order they happened and stamped with the time of their scan. The
+// journal is read once for all of them. Changes of the snapshots the
+// outstations already have are skipped. If the journal overflows, the
+// outstations are synchronized with a full snapshot again
+//------------------------------------------------------------------
+void publishScanChanges(const std::vector<std::shared_ptr<IOutstation>> &outstations) {
+    static struct scan_change changes[JOURNAL_BATCH];
+
+    enableScanJournal();
+    unsigned int synced = update_vals(outstations);
+
+    for(;;) {
+        waitScanChanges();
+
+        bool overflow;
+        int count = readScanChanges(changes, JOURNAL_BATCH, &overflow);
+
+        UpdateBuilder builder;
+        bool changed = false;
+        for (int i = 0; i < count; i++) {
+            struct scan_change *c = &changes[i];
+            if ((int)(c->scan - synced) <= 0)
+                continue;
+            changed |= updatePoint(builder, c->area, c->index, c->value, DNPTime(c->time));
+        }
+        if (changed)
+            applyUpdates(outstations, builder);
+
+        if (overflow) {
+            printf("DNP3: event journal overflow, resynchronizing\n");
+            synced = update_vals(outstations);
+        }
+
+        //the database can't be resized while the outstation runs
+        if (getBindingVersion() != mapped_binding_version) {
+            mapped_binding_version = getBindingVersion();
+            printf("DNP3: the PLC program changed. The points keep the located variables of the first program until the runtime restarts\n");
+        }
     }
-    // Update Holding registers for memory
-    for (int i = MIN_16B_RANGE; i < MAX_16B_RANGE; i++) {
-        if(int_memory[i - MIN_16B_RANGE] != NULL)
-            builder.Update(
-                    AnalogOutputStatus((int)(*int_memory[i - MIN_16B_RANGE])),
-                    i
-            );
-    } 
-    // Update Holding registers for 32 b memory
-    for (int i = MIN_32B_RANGE; i < MAX_32B_RANGE; i++) {
-        if(dint_memory[i - MIN_32B_RANGE] != NULL)
-            builder.Update(
-                    AnalogOutputStatus((int)(*dint_memory[i - MIN_32B_RANGE])),
-                    i
-            );
-    } 
-    // Update Holding registers for 64 b memory
-    for (int i = MIN_64B_RANGE; 
-         (i < MAX_64B_RANGE && 
-            i - MIN_64B_RANGE < sizeof(lint_memory) / sizeof(lint_memory[0])); 
-         i++) {
-        if(lint_memory[i - MIN_64B_RANGE] != NULL)
-            builder.Update(
-                    AnalogOutputStatus((int)(*lint_memory[i - MIN_64B_RANGE])),
-                    i
-            );
-    } 
-    outstation->Apply(builder.Build());
 }
 
 //----------------------------------------------------------------------
-// Need to parse 'database_size' first
+// The database has one entry for each point on the point map
 //----------------------------------------------------------------------
 OutstationStackConfig create_config() {
+    return OutstationStackConfig(DatabaseSizes(
+               points[POINT_BINARY].size(), 0,
+               points[POINT_ANALOG].size(), 0, 0,
+               points[POINT_BINARY_OUTPUT].size(),
+               points[POINT_ANALOG_OUTPUT].size(), 0
+           ));
+}
+
+//------------------------------------------------------------------
+// Reads an IEC address (ex: %IX0.3, %MD12) into its area and element.
+// Returns false if it is not the address of a DNP3 point
+//------------------------------------------------------------------
+static bool parseAddress(const string &address, uint8_t *area, int *element) {
+    for (int a = 0; a < NUM_IMAGE_AREAS; a++) {
+        if (area_points[a] < 0 || address.compare(0, 3, area_names[a]) != 0)
+            continue;
+
+        int byte, bit = 0;
+        char extra;
+        if (a <= IMAGE_BOOL_OUTPUT) {
+            if (sscanf(address.c_str() + 3, "%d.%d%c", &byte, &bit, &extra) != 2 || bit < 0 || bit > 7)
+                return false;
+        }
+        else if (sscanf(address.c_str() + 3, "%d%c", &byte, &extra) != 1) {
+            return false;
+        }
+        if (byte < 0 || byte >= BUFFER_SIZE)
+            return false;
+
+        *area = a;
+        *element = (a <= IMAGE_BOOL_OUTPUT) ? byte * 8 + bit : byte;
+        return true;
+    }
+
+    return false;
+}
+
+//------------------------------------------------------------------
+// Finds the points a setting applies to. They are given either by type,
+// optionally with a range of DNP3 indices (analog_input, binary_input[4],
+// analog_output[0-9]), or by a range of IEC addresses of one type (%IW3,
+// %IW0-%IW15). Returns false if no point matches
+//------------------------------------------------------------------
+static bool selectPoints(const string &selector, int *type, int *first, int *last) {
+    if (selector[0] != '%') {
+        size_t bracket = selector.find('[');
+        string name = selector.substr(0, bracket);
+
+        *type = -1;
+        for (int t = 0; t < NUM_POINT_TYPES; t++) {
+            if (name == point_keys[t])
+                *type = t;
+        }
+        if (*type < 0)
+            return false;
+
+        *first = 0;
+        *last = (int)points[*type].size() - 1;
+        if (bracket != string::npos) {
+            int n = sscanf(selector.c_str() + bracket, "[%d-%d]", first, last);
+            if (n == 1)
+                *last = *first;
+            else if (n != 2)
+                return false;
+            if (*last >= (int)points[*type].size())
+                *last = (int)points[*type].size() - 1;
+        }
+        return *first >= 0 && *first <= *last;
+    }
+
+    size_t dash = selector.find('-');
+    uint8_t startArea, stopArea;
+    int start, stop;
+    if (!parseAddress(selector.substr(0, dash), &startArea, &start))
+        return false;
+    if (dash == string::npos) {
+        stopArea = startArea;
+        stop = start;
+    }
+    else if (!parseAddress(selector.substr(dash + 1), &stopArea, &stop)) {
+        return false;
+    }
+    if (area_points[startArea] != area_points[stopArea])
+        return false;
+
+    //the points of a type are in the order of their addresses
+    *type = area_points[startArea];
+    *first = -1;
+    *last = -1;
+    std::vector<struct dnp3_point> &list = points[*type];
+    for (size_t i = 0; i < list.size(); i++) {
+        bool afterStart = list[i].area > startArea || (list[i].area == startArea && list[i].index >= start);
+        bool beforeStop = list[i].area < stopArea || (list[i].area == stopArea && list[i].index <= stop);
+        if (!afterStart || !beforeStop)
+            continue;
+        if (*first < 0)
+            *first = i;
+        *last = i;
+    }
+    return *first >= 0;
+}
+
+//------------------------------------------------------------------
+// Sets the event class or a variation of a point
+//------------------------------------------------------------------
+template <class T>
+static void applyPointSetting(T &config, const string &setting, int value) {
+    if (setting == "class")
+        config.clazz = (PointClass)value;
+    else if (setting == "static_variation")
+        config.svariation = (decltype(config.svariation))value;
+    else if (setting == "event_variation")
+        config.evariation = (decltype(config.evariation))value;
+}
+
+//------------------------------------------------------------------
+// Reads a point settings file and sets the event class, deadband and
+// variations of the points on the database. Lines look like
+// 'points setting = value'. Points without settings keep the defaults
+// of opendnp3: class 1, no deadband
+//------------------------------------------------------------------
+void parsePointConfig(DatabaseConfig &db, const string &file) {
+    //variations each type supports, static then event
+    static const int variations[NUM_POINT_TYPES][2][2] = {
+        {{1, 2}, {1, 3}},   //g1, g2
+        {{2, 2}, {1, 2}},   //g10, g11
+        {{1, 6}, {1, 8}},   //g30, g32
+        {{1, 4}, {1, 8}},   //g40, g42
+    };
     string line;
-    ifstream cfgfile("dnp3.cfg");
-    bool found = false;
-    if(cfgfile.is_open()) {
-        while (getline(cfgfile, line)) {
-            if (line[0] == '#')
-                continue;
-            try {
-                istringstream iss(line);
-                string token;
-                getline(iss, token, '=');
-                token = trim(token);
-                if (token == "database_size") {
-                    getline(iss, token, '=');
-                    return OutstationStackConfig(
-                               DatabaseSizes::AllTypes(atoi(token.c_str()))
-                           );
-                }
-                else 
-                    continue;
-            } catch(...) {
-                cout << "Malformatted Line: " << line << endl;
-                exit(1);
-            } 
+    ifstream cfgfile(file.c_str());
+
+    if (!cfgfile.is_open())
+        return;
+
+    printf("DNP3: reading point settings from %s\n", file.c_str());
+    while (getline(cfgfile, line)) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        istringstream iss(line);
+        string target, value;
+        getline(iss, target, '=');
+        getline(iss, value);
+        value = trim(value);
+
+        istringstream targets(target);
+        string selector, setting;
+        targets >> selector >> setting;
+
+        int type, first, last;
+        if (value.empty() || setting.empty() || !selectPoints(selector, &type, &first, &last)) {
+            cout << "DNP3: no points for setting: " << line << endl;
+            continue;
+        }
 
+        //every setting is checked before it is applied to the points
+        bool analog = (type == POINT_ANALOG || type == POINT_ANALOG_OUTPUT);
+        double deadband = 0;
+        int number = 0;
+        bool valid = true;
+        if (setting == "class") {
+            if (value == "none")
+                number = (int)PointClass::Class0;
+            else if (value == "1")
+                number = (int)PointClass::Class1;
+            else if (value == "2")
+                number = (int)PointClass::Class2;
+            else if (value == "3")
+                number = (int)PointClass::Class3;
+            else
+                valid = false;
+        }
+        else if (setting == "deadband") {
+            deadband = atof(value.c_str());
+            valid = analog && deadband >= 0;
+        }
+        else if (setting == "static_variation" || setting == "event_variation") {
+            const int *range = variations[type][setting == "event_variation"];
+            number = atoi(value.c_str());
+            valid = (number >= range[0] && number <= range[1]);
+            number -= range[0];
+        }
+        else {
+            valid = false;
+        }
+        if (!valid) {
+            cout << "DNP3: invalid point setting: " << line << endl;
+            continue;
+        }
+
+        for (int i = first; i <= last; i++) {
+            switch (type) {
+                case POINT_BINARY:
+                    applyPointSetting(db.binary[i], setting, number);
+                    break;
+                case POINT_BINARY_OUTPUT:
+                    applyPointSetting(db.boStatus[i], setting, number);
+                    break;
+                case POINT_ANALOG:
+                    applyPointSetting(db.analog[i], setting, number);
+                    if (setting == "deadband")
+                        db.analog[i].deadband = deadband;
+                    break;
+                case POINT_ANALOG_OUTPUT:
+                    applyPointSetting(db.aoStatus[i], setting, number);
+                    if (setting == "deadband")
+                        db.aoStatus[i].deadband = deadband;
+                    break;
+            }
         }
     }
-    return OutstationStackConfig(DatabaseSizes::AllTypes(10));
 }
 
+//An outstation listed on dnp3.cfg
+struct dnp3_outstation {
+    string name;
+    int port;
+    string points;      //point settings file
+};
+
 //----------------------------------------------------------------------
-// parse dnp3.cfg and set dnp3 settings
+// Reads the names of the outstations from the 'outstations' line of
+// dnp3.cfg (ex: outstations = primary, backup). Without it there is a
+// single outstation
 //----------------------------------------------------------------------
-OutstationStackConfig parseDNP3Config() {
+std::vector<string> parseOutstationNames() {
+    std::vector<string> names;
+    string line;
+    ifstream cfgfile("dnp3.cfg");
+    while (cfgfile.is_open() && getline(cfgfile, line)) {
+        if (line[0] == '#')
+            continue;
+        istringstream iss(line);
+        string token;
+        getline(iss, token, '=');
+        if (trim(token) != "outstations")
+            continue;
+
+        while (getline(iss, token, ',')) {
+            token = trim(token);
+            if (!token.empty())
+                names.push_back(token);
+        }
+    }
+
+    if (names.empty())
+        names.push_back(DEFAULT_OUTSTATION);
+    return names;
+}
+
+//----------------------------------------------------------------------
+// parse dnp3.cfg and set dnp3 settings for an outstation. Plain settings
+// apply to every outstation, and settings prefixed with the name of the
+// outstation (ex: backup.local_address) override them for that one.
+// The outstation may also get its own port and point settings file
+//----------------------------------------------------------------------
+OutstationStackConfig parseDNP3Config(struct dnp3_outstation &instance) {
     string line;
     ifstream cfgfile("dnp3.cfg");
     OutstationStackConfig config = create_config();
-    if(cfgfile.is_open()) {
+    const string prefix = instance.name + ".";
+
+    //plain settings first, then the ones of this outstation
+    for (int pass = 0; pass < 2 && cfgfile.is_open(); pass++) {
+        cfgfile.clear();
+        cfgfile.seekg(0);
         while (getline(cfgfile, line)) {
             if (line[0] == '#')
                 continue;
@@ -296,7 +726,21 @@ OutstationStackConfig parseDNP3Config() {
                 string token;
                 getline(iss, token, '=');
                 token = trim(token);
-                if (token == "local_address") {
+                bool prefixed = (token.compare(0, prefix.size(), prefix) == 0);
+                if (pass == 0 && token.find('.') != string::npos)
+                    continue;
+                if (pass == 1 && !prefixed)
+                    continue;
+                if (prefixed)
+                    token = token.substr(prefix.size());
+
+                if (token == "port") {
+                    getline(iss, token, '=');
+                    instance.port = atoi(token.c_str());
+                } else if (token == "points") {
+                    getline(iss, token, '=');
+                    instance.points = trim(token);
+                } else if (token == "local_address") {
                     getline(iss, token, '=');     
                     config.link.LocalAddr = atoi(token.c_str());
                 } else if (token == "remote_address") {
@@ -364,48 +808,77 @@ OutstationStackConfig parseDNP3Config() {
             }
         }
     }
+    parsePointConfig(config.dbConfig, instance.points);
     return config;
 } 
 
 //------------------------------------------------------------------
-//Function to begin DNP3 server functions
+//Function to begin DNP3 server functions. Every outstation listed on
+//dnp3.cfg is served, on one TCP server channel per port, and all of them
+//are fed from the same per-scan changes
 //------------------------------------------------------------------
 void dnp3StartServer(int port) {
 
     const uint32_t FILTERS = levels::NORMAL;
 
-    // Allocate a single thread to the pool since this is a single outstation
+    // The points and the size of the database come from the program
+    buildPointMap();
+    printPointMap();
+
+    // Read the settings of every outstation, so the channels are known
+    // before the manager is created
+    std::vector<string> names = parseOutstationNames();
+    std::vector<struct dnp3_outstation> instances(names.size());
+    std::vector<std::unique_ptr<OutstationStackConfig>> configs;
+    std::map<int, std::shared_ptr<IChannel>> channels;
+    for (size_t i = 0; i < names.size(); i++) {
+        instances[i].name = names[i];
+        instances[i].port = port;
+        instances[i].points = POINT_CONFIG_FILE;
+        configs.push_back(std::unique_ptr<OutstationStackConfig>(
+                new OutstationStackConfig(parseDNP3Config(instances[i]))));
+        channels[instances[i].port] = nullptr;
+    }
+
+    // One thread per channel, as the channels don't share any state
     // Log messages to the console
-    DNP3Manager manager(1, ConsoleLogger::Create());
+    DNP3Manager manager(channels.size(), ConsoleLogger::Create());
 
-    // Create a listener server
-    auto channel = manager.AddTCPServer("server", FILTERS, ChannelRetry::Default(), "0.0.0.0", port, PrintingChannelListener::Create());
+    // Create a listener server for each port
+    for (auto &channel : channels) {
+        string id = "server" + std::to_string(channel.first);
+        channel.second = manager.AddTCPServer(id, FILTERS, ChannelRetry::Default(), "0.0.0.0", channel.first, PrintingChannelListener::Create());
+    }
 
-    // Create a new outstation with a log level, command handler, and
-    // config info this returns a thread-safe interface used for
-    // updating the outstation's database.
+    // Create the outstations with a log level, command handler, and
+    // config info. Each returns a thread-safe interface used for
+    // updating the outstation's database. Outstations on the same port
+    // must have different link addresses
     std::shared_ptr<ICommandHandler> cc = std::make_shared<CommandCallback>();
-    auto outstation = channel->AddOutstation(
-            "outstation",
-            cc, 
-            DefaultOutstationApplication::Create(), 
-            parseDNP3Config()
-    );
-
-    // Enable the outstation and start communications
-    outstation->Enable();
-    printf("DNP3 Enabled \n");
-
-    mapUnusedIO();
-
-    // Continuously update
-    struct timespec timer_start;
-    clock_gettime(CLOCK_MONOTONIC, &timer_start);
-    int i = 0;
-    for(;;) {
-        pthread_mutex_lock(&bufferLock);
-        update_vals(outstation);
-        pthread_mutex_unlock(&bufferLock);
-        sleep_until(&timer_start, OPLC_CYCLE);
+    std::vector<std::shared_ptr<IOutstation>> outstations;
+    for (size_t i = 0; i < instances.size(); i++) {
+        auto outstation = channels[instances[i].port]->AddOutstation(
+                instances[i].name,
+                cc, 
+                DefaultOutstationApplication::Create(), 
+                *configs[i]
+        );
+        if (outstation == nullptr) {
+            printf("DNP3: can't add outstation %s on port %d, its link addresses are in use\n",
+                   instances[i].name.c_str(), instances[i].port);
+            continue;
+        }
+
+        // Enable the outstation and start communications
+        outstation->Enable();
+        outstations.push_back(outstation);
+        printf("DNP3 outstation %s enabled on port %d, address %d\n", instances[i].name.c_str(),
+               instances[i].port, configs[i]->link.LocalAddr);
     }
+    configs.clear();
+    if (outstations.empty())
+        return;
+
+    // Every scan sends its own changes
+    publishScanChanges(outstations);
 }
@@ -1,77 +1,134 @@
-//-----------------------------------------------------------------------------
-// Copyright 2015 Thiago Alves
-// This file is part of the OpenPLC Software Stack.
-//
-// OpenPLC is free software: you can redistribute it and/or modify
-// it under the terms of the GNU General Public License as published by
-// the Free Software Foundation, either version 3 of the License, or
-// (at your option) any later version.
-//
-// OpenPLC is distributed in the hope that it will be useful,
-// but WITHOUT ANY WARRANTY; without even the implied warranty of
-// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-// GNU General Public License for more details.
-//
-// You should have received a copy of the GNU General Public License
-// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
-//------
-//
-// This file is responsible for gluing the variables from the IEC program to
-// the OpenPLC memory pointers. It is automatically generated by the
-// glue_generator program. PLEASE DON'T EDIT THIS FILE!
-// Thiago Alves, May 2016
-//-----------------------------------------------------------------------------
-
-#include "iec_std_lib.h"
-
-TIME __CURRENT_TIME;
-
-//Internal buffers for I/O and memory. These buffers are defined in the
-//auto-generated glueVars.cpp file
-#define BUFFER_SIZE		100
-
-//Booleans
-IEC_BOOL *bool_input[BUFFER_SIZE][BUFFER_SIZE];
-IEC_BOOL *bool_output[BUFFER_SIZE][BUFFER_SIZE];
-
-//Ints
-IEC_SINT *sint_input[BUFFER_SIZE][BUFFER_SIZE];
-IEC_SINT *sint_output[BUFFER_SIZE][BUFFER_SIZE];
-IEC_INT *int_input[BUFFER_SIZE][BUFFER_SIZE];
-IEC_INT *int_output[BUFFER_SIZE][BUFFER_SIZE];
-IEC_DINT *dint_input[BUFFER_SIZE][BUFFER_SIZE];
-IEC_DINT *dint_output[BUFFER_SIZE][BUFFER_SIZE];
-IEC_LINT *lint_input[BUFFER_SIZE][BUFFER_SIZE];
-IEC_LINT *lint_output[BUFFER_SIZE][BUFFER_SIZE];
-
-//Unsigned Ints
-IEC_USINT *usint_input[BUFFER_SIZE][BUFFER_SIZE];
-IEC_USINT *usint_output[BUFFER_SIZE][BUFFER_SIZE];
-IEC_UINT *uint_input[BUFFER_SIZE][BUFFER_SIZE];
-IEC_UINT *uint_output[BUFFER_SIZE][BUFFER_SIZE];
-IEC_UDINT *udint_input[BUFFER_SIZE][BUFFER_SIZE];
-IEC_UDINT *udint_output[BUFFER_SIZE][BUFFER_SIZE];
-IEC_ULINT *ulint_input[BUFFER_SIZE][BUFFER_SIZE];
-IEC_ULINT *ulint_output[BUFFER_SIZE][BUFFER_SIZE];
-
-//Floats
-IEC_REAL *float_input[BUFFER_SIZE][BUFFER_SIZE];
-IEC_REAL *float_output[BUFFER_SIZE][BUFFER_SIZE];
-IEC_LREAL *double_input[BUFFER_SIZE][BUFFER_SIZE];
-IEC_LREAL *double_output[BUFFER_SIZE][BUFFER_SIZE];
-
-
-#define __LOCATED_VAR(type, name, ...) type __##name;
-#include "LOCATED_VARIABLES.h"
-#undef __LOCATED_VAR
-#define __LOCATED_VAR(type, name, ...) type* name = &__##name;
-#include "LOCATED_VARIABLES.h"
-#undef __LOCATED_VAR
-
-void glueVars()
-{
-	bool_input[0][0] = __IX0_0;
-	bool_input[0][1] = __IX0_1;
-	bool_output[0][0] = __QX0_0;
-	bool_output[0][1] = __QX0_1;
-}
\ No newline at end of file
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file is responsible for gluing the variables from the IEC program to
+// the OpenPLC memory pointers. It is automatically generated by the
+// glue_generator program. PLEASE DON'T EDIT THIS FILE!
+// Thiago Alves, May 2016
+//-----------------------------------------------------------------------------
+
+#include "iec_std_lib.h"
+#include "POUS.h"
+
+TIME __CURRENT_TIME;
+extern unsigned long long common_ticktime__;
+
+//Process image for I/O and memory. Located variables are bound directly
+//to their positions on these buffers. The buffers belong to the runtime,
+//so they outlive the program when it is swapped for a new one
+#define BUFFER_SIZE		1024
+
+//Booleans
+extern IEC_BOOL bool_input[BUFFER_SIZE][8];
+extern IEC_BOOL bool_output[BUFFER_SIZE][8];
+
+//Bytes
+extern IEC_BYTE byte_input[BUFFER_SIZE];
+extern IEC_BYTE byte_output[BUFFER_SIZE];
+
+//Analog I/O
+extern IEC_UINT int_input[BUFFER_SIZE];
+extern IEC_UINT int_output[BUFFER_SIZE];
+
+//Memory
+extern IEC_UINT int_memory[BUFFER_SIZE];
+extern IEC_DINT dint_memory[BUFFER_SIZE];
+extern IEC_LINT lint_memory[BUFFER_SIZE];
+
+//Located variables
+BOOL *__IX0_0 = (BOOL *)&bool_input[0][0];
+BOOL *__IX0_1 = (BOOL *)&bool_input[0][1];
+BOOL *__QX0_0 = (BOOL *)&bool_output[0][0];
+BOOL *__QX0_1 = (BOOL *)&bool_output[0][1];
+
+//Binding table. Lists where each located variable must point to on the
+//process image (NULL if it has its own storage). The last entry is empty.
+//This struct must match the one declared on ladder.h
+struct located_binding
+{
+	const char *name;
+	void **pointer;
+	void *location;
+};
+
+struct located_binding located_bindings[] =
+{
+	{"__IX0_0", (void **)&__IX0_0, (void *)&bool_input[0][0]},
+	{"__IX0_1", (void **)&__IX0_1, (void *)&bool_input[0][1]},
+	{"__QX0_0", (void **)&__QX0_0, (void *)&bool_output[0][0]},
+	{"__QX0_1", (void **)&__QX0_1, (void *)&bool_output[0][1]},
+	{NULL, NULL, NULL}
+};
+
+//Program variables, from VARIABLES.csv. When the runtime swaps programs,
+//it copies every variable whose name and type match on both programs.
+//This struct must match the one declared on ladder.h
+struct program_variable
+{
+	const char *name;
+	const char *type;
+	void *pointer;
+	unsigned int size;
+};
+
+extern PROG0 RES0__INST0;
+
+struct program_variable program_variables[] =
+{
+	{"CONFIG0.RES0.INST0.VAR_IN", "BOOL", (void *)&RES0__INST0.VAR_IN, sizeof(RES0__INST0.VAR_IN)},
+	{"CONFIG0.RES0.INST0.VAR_OUT", "BOOL", (void *)&RES0__INST0.VAR_OUT, sizeof(RES0__INST0.VAR_OUT)},
+	{NULL, NULL, NULL, 0}
+};
+
+//The main loop passes the monotonic time since the first scan, so the IEC
+//timers don't drift when a scan overruns
+void updateTime(unsigned long long elapsed_ns)
+{
+	__CURRENT_TIME.tv_sec = elapsed_ns / 1000000000ULL;
+	__CURRENT_TIME.tv_nsec = elapsed_ns % 1000000000ULL;
+}
+
+//Entry points of the program. The runtime looks plc_program_entry up by
+//name when it loads the program, so it is the only symbol it needs.
+//This struct must match the one declared on ladder.h
+void config_init__(void);
+void config_run__(unsigned long tick);
+extern __IEC_TASK_t *config_tasks__[] __attribute__((weak));
+
+struct plc_program
+{
+	void (*init)(void);
+	void (*run)(unsigned long tick);
+	void (*update_time)(unsigned long long elapsed_ns);
+	__IEC_TASK_t **tasks;
+	struct located_binding *bindings;
+	struct program_variable *variables;
+	unsigned long long *ticktime;
+};
+
+extern "C" struct plc_program plc_program_entry;
+struct plc_program plc_program_entry =
+{
+	config_init__,
+	config_run__,
+	updateTime,
+	config_tasks__,
+	located_bindings,
+	program_variables,
+	&common_ticktime__
+};
\ No newline at end of file
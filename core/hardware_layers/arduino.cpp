@@ -324,6 +324,8 @@ bool receivePacket()
 //-----------------------------------------------------------------------------
 void *exchangeData(void *arg)
 {
+	applyRealTimeProfile(RT_THREAD_DRIVER, -1, "arduino thread");
+
 	while(1)
 	{
 		sendPacket();
@@ -572,13 +574,13 @@ void updateBuffersIn()
 	//Digital Input
 	for (int i = 0; i < (sizeof(input_data.digital)*8); i++)
 	{
-		if (bool_input[i/8][i%8] != NULL) *bool_input[i/8][i%8] = bitRead(input_data.digital[i/8], i%8);
+		bool_input[i/8][i%8] = bitRead(input_data.digital[i/8], i%8);
 	}
 
 	//Analog Input
 	for (int i = 0; i < (sizeof(input_data.analog)/2); i++)
 	{
-		if (int_input[i] != NULL) *int_input[i] = input_data.analog[i];
+		int_input[i] = input_data.analog[i];
 	}
 
 	pthread_mutex_unlock(&ioLock);
@@ -599,13 +601,13 @@ void updateBuffersOut()
 	//Digital Output
 	for (int i = 0; i < (sizeof(output_data.digital)*8); i++)
 	{
-		if (bool_output[i/8][i%8] != NULL) bitWrite(output_data.digital[i/8], i%8, *bool_output[i/8][i%8]);
+		bitWrite(output_data.digital[i/8], i%8, bool_output[i/8][i%8]);
 	}
 
 	//Analog Output
 	for (int i = 0; i < (sizeof(output_data.analog)/2); i++)
 	{
-		if (int_output[i] != NULL) output_data.analog[i] = *int_output[i];
+		output_data.analog[i] = int_output[i];
 	}
 
 	pthread_mutex_unlock(&ioLock);
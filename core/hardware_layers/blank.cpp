@@ -51,11 +51,11 @@ void updateBuffersIn()
 
 	/*********READING AND WRITING TO I/O**************
 
-	*bool_input[0][0] = read_digital_input(0);
-	write_digital_output(0, *bool_output[0][0]);
+	bool_input[0][0] = read_digital_input(0);
+	write_digital_output(0, bool_output[0][0]);
 
-	*int_input[0] = read_analog_input(0);
-	write_analog_output(0, *int_output[0]);
+	int_input[0] = read_analog_input(0);
+	write_analog_output(0, int_output[0]);
 
 	**************************************************/
 
@@ -73,11 +73,11 @@ void updateBuffersOut()
 
 	/*********READING AND WRITING TO I/O**************
 
-	*bool_input[0][0] = read_digital_input(0);
-	write_digital_output(0, *bool_output[0][0]);
+	bool_input[0][0] = read_digital_input(0);
+	write_digital_output(0, bool_output[0][0]);
 
-	*int_input[0] = read_analog_input(0);
-	write_analog_output(0, *int_output[0]);
+	int_input[0] = read_analog_input(0);
+	write_analog_output(0, int_output[0]);
 
 	**************************************************/
 
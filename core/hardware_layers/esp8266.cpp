@@ -141,33 +141,22 @@ void processMessage_esp(unsigned char *buffer, int bufferSize, int client_fd)
 			//Digital Inputs
 			for (int i = 0; i < 8; i++)
 			{
-				if (bool_input[input_data.device_id][i] != NULL)
-				{
-					*bool_input[input_data.device_id][i] = bitRead(input_data.digital, i);
-				}
+				bool_input[input_data.device_id][i] = bitRead(input_data.digital, i);
 			}
 			
 			//Analog Input
-			if (int_input[input_data.device_id] != NULL)
-			{
-				*int_input[input_data.device_id] = input_data.analog;
-			}
+			int_input[input_data.device_id] = input_data.analog;
 			
 			//Digital Outputs
 			for (int i = 0; i < 8; i++)
 			{
-				if (bool_output[input_data.device_id][i] != NULL)
-				{
-					bitWrite(output_data.digital, i, *bool_output[input_data.device_id][i]);
-				}
+				bitWrite(output_data.digital, i, bool_output[input_data.device_id][i]);
 			}
 			
 			//Analog Output
-			if (int_output[input_data.device_id] != NULL)
-			{
-				output_data.analog = *int_output[input_data.device_id];
-			}
+			output_data.analog = int_output[input_data.device_id];
 			pthread_mutex_unlock(&bufferLock); //unlock mutex
+			notifyImageChange(); //wake the SINGLE tasks
 			
 			//Sending packet back to client
 			output_data.device_id = input_data.device_id;
@@ -209,6 +198,8 @@ void *startServer_esp(void *arg)
 {
 	int socket_fd, client_fd;
 
+	applyRealTimeProfile(RT_THREAD_DRIVER, -1, "esp8266 thread");
+
 	socket_fd = createSocket_esp(ESP_PORT);
 
 	while(1)
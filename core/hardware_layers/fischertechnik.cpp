@@ -151,28 +151,28 @@ void updateBuffersIn()
 	pthread_mutex_lock(&bufferLock);
 	for (i=0; i<8; i++)
 	{
-		if (bool_output[0][i] != NULL) sendBytes[1] = sendBytes[1] | (*bool_output[0][i] << i); //write each bit
+		sendBytes[1] = sendBytes[1] | (bool_output[0][i] << i); //write each bit
 	}
 	for (i=8; i<16; i++)
 	{
-		if (bool_output[1][i%8] != NULL) sendBytes[2] = sendBytes[2] | (*bool_output[1][i%8] << (i-8)); //write each bit
+		sendBytes[2] = sendBytes[2] | (bool_output[1][i%8] << (i-8)); //write each bit
 	}
 	pthread_mutex_unlock(&bufferLock);
 
 	sendOutput(sendBytes, recvBytes);
 
 	pthread_mutex_lock(&bufferLock);
-	//if (int_input[0] != NULL) *int_input[0] = (int)(recvBytes[2] << 8) | (int)recvBytes[3]; //EX
-	//if (int_input[1] != NULL) *int_input[1] = (int)(recvBytes[4] << 8) | (int)recvBytes[5]; //EY
+	//int_input[0] = (int)(recvBytes[2] << 8) | (int)recvBytes[3]; //EX
+	//int_input[1] = (int)(recvBytes[4] << 8) | (int)recvBytes[5]; //EY
 
 	for (i=0; i<8; i++)
 	{
-		if (bool_input[0][i] != NULL) *bool_input[0][i] = (recvBytes[0] >> i) & 0x01;
+		bool_input[0][i] = (recvBytes[0] >> i) & 0x01;
 		//printf("%d\t", DiscreteInputBuffer0[i]);
 	}
 	for (i=8; i<16; i++)
 	{
-		if (bool_input[1][i%8] != NULL) *bool_input[1][i%8] = (recvBytes[1] >> (i-8)) & 0x01;
+		bool_input[1][i%8] = (recvBytes[1] >> (i-8)) & 0x01;
 		//printf("%d\t", DiscreteInputBuffer0[i]);
 	}
 	//printf("\n");
@@ -194,28 +194,28 @@ void updateBuffersOut()
 	pthread_mutex_lock(&bufferLock);
 	for (i=0; i<8; i++)
 	{
-		if (bool_output[0][i] != NULL) sendBytes[1] = sendBytes[1] | (*bool_output[0][i] << i); //write each bit
+		sendBytes[1] = sendBytes[1] | (bool_output[0][i] << i); //write each bit
 	}
 	for (i=8; i<16; i++)
 	{
-		if (bool_output[1][i%8] != NULL) sendBytes[2] = sendBytes[2] | (*bool_output[1][i%8] << (i-8)); //write each bit
+		sendBytes[2] = sendBytes[2] | (bool_output[1][i%8] << (i-8)); //write each bit
 	}
 	pthread_mutex_unlock(&bufferLock);
 
 	sendOutput(sendBytes, recvBytes);
 
 	pthread_mutex_lock(&bufferLock);
-	//if (int_input[0] != NULL) *int_input[0] = (int)(recvBytes[2] << 8) | (int)recvBytes[3]; //EX
-	//if (int_input[1] != NULL) *int_input[1] = (int)(recvBytes[4] << 8) | (int)recvBytes[5]; //EY
+	//int_input[0] = (int)(recvBytes[2] << 8) | (int)recvBytes[3]; //EX
+	//int_input[1] = (int)(recvBytes[4] << 8) | (int)recvBytes[5]; //EY
 
 	for (i=0; i<8; i++)
 	{
-		if (bool_input[0][i] != NULL) *bool_input[0][i] = (recvBytes[0] >> i) & 0x01;
+		bool_input[0][i] = (recvBytes[0] >> i) & 0x01;
 		//printf("%d\t", DiscreteInputBuffer0[i]);
 	}
 	for (i=8; i<16; i++)
 	{
-		if (bool_input[1][i%8] != NULL) *bool_input[1][i%8] = (recvBytes[1] >> (i-8)) & 0x01;
+		bool_input[1][i%8] = (recvBytes[1] >> (i-8)) & 0x01;
 		//printf("%d\t", DiscreteInputBuffer0[i]);
 	}
 	//printf("\n");
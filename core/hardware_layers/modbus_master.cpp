@@ -319,6 +319,8 @@ void parseConfig()
 
 void *exchangeData(void *arg)
 {
+	applyRealTimeProfile(RT_THREAD_DRIVER, -1, "modbus master thread");
+
 	while(1)
 	{
 		uint16_t bool_input_index = 0;
@@ -494,11 +496,9 @@ void updateBuffersIn()
 	pthread_mutex_lock(&bufferLock); //lock mutex
 	pthread_mutex_lock(&ioLock);
 
-	for (int i = 0; i < MAX_MB_IO; i++)
-	{
-		if (bool_input[i/8][i%8] != NULL) *bool_input[i/8][i%8] = bool_input_buf[i];
-		if (int_input[i] != NULL) *int_input[i] = int_input_buf[i];
-	}
+	//the process image is contiguous, so bit i lives at bool_input[i/8][i%8]
+	memcpy(bool_input, bool_input_buf, sizeof(bool_input_buf));
+	memcpy(int_input, int_input_buf, sizeof(int_input_buf));
 
 	pthread_mutex_unlock(&ioLock);
 	pthread_mutex_unlock(&bufferLock); //unlock mutex
@@ -515,11 +515,8 @@ void updateBuffersOut()
 	pthread_mutex_lock(&bufferLock); //lock mutex
 	pthread_mutex_lock(&ioLock);
 
-	for (int i = 0; i < MAX_MB_IO; i++)
-	{
-		if (bool_output[i/8][i%8] != NULL) bool_output_buf[i] = *bool_output[i/8][i%8];
-		if (int_output[i] != NULL) int_output_buf[i] = *int_output[i];
-	}
+	memcpy(bool_output_buf, bool_output, sizeof(bool_output_buf));
+	memcpy(int_output_buf, int_output, sizeof(int_output_buf));
 
 	pthread_mutex_unlock(&ioLock);
 	pthread_mutex_unlock(&bufferLock); //unlock mutex
@@ -784,6 +784,8 @@ void *updateLocalBuffers(void *args)
 	struct pixtOut OutputData_thread;
 	struct pixtOutDAC OutputDataDAC_thread;
 
+	applyRealTimeProfile(RT_THREAD_DRIVER, -1, "pixtend thread");
+
 	while(1)
 	{
 		pthread_mutex_lock(&localBufferLock);
@@ -831,7 +833,7 @@ void updateBuffersIn()
 	//DIGITAL INPUT
 	for (int i = 0; i < MAX_DIG_IN; i++)
 	{
-		if (bool_input[i/8][i%8] != NULL) *bool_input[i/8][i%8] = bitRead(InputData.byDigIn, i);
+		bool_input[i/8][i%8] = bitRead(InputData.byDigIn, i);
 	}
 
 	//ANALOG IN
@@ -839,7 +841,7 @@ void updateBuffersIn()
 	analogInputs = &InputData.wAi0;
 	for (int i = 0; i < MAX_ANALOG_IN; i++)
 	{
-		if (int_input[i] != NULL) *int_input[i] = analogInputs[i];
+		int_input[i] = analogInputs[i];
 	}
 
 	//unlock mutexes
@@ -863,11 +865,11 @@ void updateBuffersOut()
 	{
 		if (i < 6)
 		{
-			if (bool_output[i/8][i%8] != NULL) bitWrite(OutputData.byDigOut, i, *bool_output[i/8][i%8]);
+			bitWrite(OutputData.byDigOut, i, bool_output[i/8][i%8]);
 		}
 		else
 		{
-			if (bool_output[i/8][i%8] != NULL) bitWrite(OutputData.byRelayOut, i-6, *bool_output[i/8][i%8]);
+			bitWrite(OutputData.byRelayOut, i-6, bool_output[i/8][i%8]);
 		}
 	}
 
@@ -880,11 +882,11 @@ void updateBuffersOut()
 	{
 		if (i < 2)
 		{
-			if (int_output[i] != NULL) analogOutputs[i] = (*int_output[i] / 64);
+			analogOutputs[i] = (int_output[i] / 64);
 		}
 		else
 		{
-			if (int_output[i] != NULL) pwmOutputs[i-2] = *int_output[i];
+			pwmOutputs[i-2] = int_output[i];
 		}
 	}
 
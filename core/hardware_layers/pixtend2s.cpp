@@ -504,6 +504,8 @@ void *updateLocalBuffers(void *args)
     struct pixtOutV2S OutputData_thread;
     struct pixtOutDAC OutputDataDAC_thread;
 
+    applyRealTimeProfile(RT_THREAD_DRIVER, -1, "pixtend thread");
+
     while(1)
     {
         pthread_mutex_lock(&localBufferLock);
@@ -551,25 +553,25 @@ void updateBuffersIn()
     //DIGITAL INPUT
     for (int i = 0; i < MAX_DIG_IN; i++)
     {
-        if (bool_input[i/8][i%8] != NULL) *bool_input[i/8][i%8] = bitRead(InputData.byDigitalIn, i);
+        bool_input[i/8][i%8] = bitRead(InputData.byDigitalIn, i);
     }
     
     //GPIO INPUT
     for (int i = MAX_DIG_IN; i < MAX_DIG_IN+MAX_GPIO_IN; i++)
     {
-        if (bool_input[i/8][i%8] != NULL) *bool_input[i/8][i%8] = bitRead(InputData.byGPIOIn, i-MAX_DIG_IN);
+        bool_input[i/8][i%8] = bitRead(InputData.byGPIOIn, i-MAX_DIG_IN);
     }
     
     // uint8_t byFirmware;
-    if (byte_input[0] != NULL) *byte_input[0] = InputData.byFirmware;
+    byte_input[0] = InputData.byFirmware;
     // uint8_t byHardware;
-    if (byte_input[1] != NULL) *byte_input[1] = InputData.byHardware;
+    byte_input[1] = InputData.byHardware;
     // uint8_t byModelIn;
-    if (byte_input[2] != NULL) *byte_input[2] = InputData.byModelIn;
+    byte_input[2] = InputData.byModelIn;
     // uint8_t byUCState;
-    if (byte_input[3] != NULL) *byte_input[3] = InputData.byUCState;
+    byte_input[3] = InputData.byUCState;
     // uint8_t byUCWarnings
-    if (byte_input[4] != NULL) *byte_input[4] = InputData.byUCWarnings; 
+    byte_input[4] = InputData.byUCWarnings; 
 
     //ANALOG IN - TEMP INPUT - HUMID INPUT
     uint16_t *analogInputs;
@@ -578,40 +580,40 @@ void updateBuffersIn()
     {
         if (i < MAX_ANALOG_IN)
         {
-            if (int_input[i] != NULL) *int_input[i] = analogInputs[i];
+            int_input[i] = analogInputs[i];
         }
         if ((i >= MAX_ANALOG_IN) && ( i < MAX_ANALOG_IN+MAX_TEMP_IN)) 
         {
             if (i == MAX_ANALOG_IN){
-                if (int_input[i] != NULL) *int_input[i] = InputData.wTemp0;
+                int_input[i] = InputData.wTemp0;
             }
             if (i == (MAX_ANALOG_IN+1)){
-                if (int_input[i] != NULL) *int_input[i] = InputData.wTemp1;
+                int_input[i] = InputData.wTemp1;
             }
             if (i == (MAX_ANALOG_IN+2)){
-                if (int_input[i] != NULL) *int_input[i] = InputData.wTemp2;
+                int_input[i] = InputData.wTemp2;
             }
             if (i == (MAX_ANALOG_IN+3)){
-                if (int_input[i] != NULL) *int_input[i] = InputData.wTemp3;
+                int_input[i] = InputData.wTemp3;
             }
         }
         if ((i >= (MAX_ANALOG_IN+MAX_TEMP_IN)) && ( i < (MAX_ANALOG_IN+MAX_TEMP_IN+MAX_HUMID_IN))) 
         {
             if (i == (MAX_ANALOG_IN+MAX_TEMP_IN))
             {
-                if (int_input[i] != NULL) *int_input[i] = InputData.wHumid0;
+                int_input[i] = InputData.wHumid0;
             }
             if (i == ((MAX_ANALOG_IN+MAX_TEMP_IN)+1))
             {
-                if (int_input[i] != NULL) *int_input[i] = InputData.wHumid1;
+                int_input[i] = InputData.wHumid1;
             }
             if (i == ((MAX_ANALOG_IN+MAX_TEMP_IN)+2))
             {
-                if (int_input[i] != NULL) *int_input[i] = InputData.wHumid2;
+                int_input[i] = InputData.wHumid2;
             }
             if (i == ((MAX_ANALOG_IN+MAX_TEMP_IN)+3))
             {
-                if (int_input[i] != NULL) *int_input[i] = InputData.wHumid3;
+                int_input[i] = InputData.wHumid3;
             }
         }
             
@@ -638,10 +640,7 @@ void updateBuffersOut()
     {
         if (i < MAX_DIG_OUT)
         {
-            if (bool_output[i/8][i%8] != NULL)
-            {
-                bitWrite(OutputData.byDigitalOut, i, *bool_output[i/8][i%8]);
-            }   
+            bitWrite(OutputData.byDigitalOut, i, bool_output[i/8][i%8]);
         }
     }
     
@@ -650,7 +649,7 @@ void updateBuffersOut()
     {
         if ((i >= MAX_DIG_OUT) && (i < (MAX_DIG_OUT+MAX_REL_OUT)))
         {
-            if (bool_output[i/8][i%8] != NULL) bitWrite(OutputData.byRelayOut, i-MAX_DIG_OUT, *bool_output[i/8][i%8]);
+            bitWrite(OutputData.byRelayOut, i-MAX_DIG_OUT, bool_output[i/8][i%8]);
         }
     }
     
@@ -659,7 +658,7 @@ void updateBuffersOut()
     {
         if ((i >= MAX_DIG_OUT+MAX_REL_OUT) && (i < (MAX_DIG_OUT+MAX_REL_OUT+MAX_GPIO_OUT)))
         {
-            if (bool_output[i/8][i%8] != NULL) bitWrite(OutputData.byGPIOOut, i-(MAX_DIG_OUT+MAX_REL_OUT), *bool_output[i/8][i%8]);
+            bitWrite(OutputData.byGPIOOut, i-(MAX_DIG_OUT+MAX_REL_OUT), bool_output[i/8][i%8]);
         }
     }
 
@@ -672,32 +671,32 @@ void updateBuffersOut()
     {
         if (i < 2)
         {
-            if (int_output[i] != NULL) analogOutputs[i] = (*int_output[i] / 64);
+            analogOutputs[i] = (int_output[i] / 64);
         }
         else
         {
-            if (int_output[i] != NULL) pwmOutputs[i-2] = *int_output[i];
+            pwmOutputs[i-2] = int_output[i];
         }
     }
     // PWM0Ctrl1L - PWM0Ctrl1H
-    if (int_output[4] != NULL) OutputData.wPWM0Ctrl1 = *int_output[4];
+    OutputData.wPWM0Ctrl1 = int_output[4];
     
     // UCCtrl0
-    if (byte_output[0] != NULL) OutputData.byUCCtrl0 = *byte_output[0];
+    OutputData.byUCCtrl0 = byte_output[0];
     // UCCtrl1
-    if (byte_output[1] != NULL) OutputData.byUCCtrl1 = *byte_output[1];
+    OutputData.byUCCtrl1 = byte_output[1];
     // GPIOCtrl    
-    if (byte_output[2] != NULL) OutputData.byGPIOCtrl = *byte_output[2];
+    OutputData.byGPIOCtrl = byte_output[2];
     // PWM0 - PWM0Ctrl0
-    if (byte_output[3] != NULL) OutputData.byPWM0Ctrl0 = *byte_output[3];
+    OutputData.byPWM0Ctrl0 = byte_output[3];
     // PWM1 - PWM1Ctrl0
-    if (byte_output[4] != NULL) OutputData.byPWM1Ctrl0 = *byte_output[4];
+    OutputData.byPWM1Ctrl0 = byte_output[4];
     // PWM1Ctrl1L - PWM1Ctrl1H
-    if (byte_output[5] != NULL) OutputData.byPWM1Ctrl1 = *byte_output[5];
+    OutputData.byPWM1Ctrl1 = byte_output[5];
     // PWM1AL - PWM1AH
-    if (byte_output[6] != NULL) OutputData.byPWM1A = *byte_output[6];
+    OutputData.byPWM1A = byte_output[6];
     // PWM1BL - PWM1BH     
-    if (byte_output[7] != NULL) OutputData.byPWM1B = *byte_output[7];
+    OutputData.byPWM1B = byte_output[7];
     
 	//unlock mutexes
 	pthread_mutex_unlock(&localBufferLock);
@@ -111,6 +111,8 @@ void *exchangeData(void *arg)
 	struct sockaddr_in client;
 	struct plcData *plc_data = (struct plcData *)malloc(sizeof(struct plcData));
 
+	applyRealTimeProfile(RT_THREAD_DRIVER, -1, "simulink thread");
+
 	cli_len = sizeof(client);
 
 	while(1)
@@ -127,15 +129,16 @@ void *exchangeData(void *arg)
 			pthread_mutex_lock(&bufferLock); //lock mutex
 			for (int i = 0; i < ANALOG_BUF_SIZE; i++)
 			{
-				if (int_input[i] != NULL) *int_input[i] = plc_data->analogIn[i];
-				if (int_output[i] != NULL) plc_data->analogOut[i] = *int_output[i];
+				int_input[i] = plc_data->analogIn[i];
+				plc_data->analogOut[i] = int_output[i];
 			}
 			for (int i = 0; i < DIGITAL_BUF_SIZE; i++)
 			{
-				if (bool_input[i/8][i%8] != NULL) *bool_input[i/8][i%8] = plc_data->digitalIn[i];
-				if (bool_output[i/8][i%8] != NULL) plc_data->digitalOut[i] = *bool_output[i/8][i%8];
+				bool_input[i/8][i%8] = plc_data->digitalIn[i];
+				plc_data->digitalOut[i] = bool_output[i/8][i%8];
 			}
 			pthread_mutex_unlock(&bufferLock); //unlock mutex
+			notifyImageChange(); //wake the SINGLE tasks
 
 			//printf("sending data...\n");
 			net_len = sendto(socket_fd, plc_data, sizeof(*plc_data), 0, (struct sockaddr *) &client, cli_len);
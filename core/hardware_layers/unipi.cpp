@@ -61,6 +61,8 @@ void sleep_ms(int milliseconds)
 
 void *readAdcThread(void *args)
 {
+	applyRealTimeProfile(RT_THREAD_DRIVER, -1, "unipi adc thread");
+
 	while(1)
 	{
 		unsigned char config;
@@ -193,13 +195,13 @@ void updateBuffersIn()
 	pthread_mutex_lock(&bufferLock); //lock mutex
 	for (int i = 0; i < MAX_INPUT; i++)
 	{
-		if (bool_input[i/8][i%8] != NULL) *bool_input[i/8][i%8] = !digitalRead(inputPinMask[i]); //printf("[IO%d]: %d | ", i, !digitalRead(inputPinMask[i]));
+		bool_input[i/8][i%8] = !digitalRead(inputPinMask[i]); //printf("[IO%d]: %d | ", i, !digitalRead(inputPinMask[i]));
 	}
 
 	//printf("\nAnalog Inputs:");
 	for (int i = 0; i < 2; i++)
 	{
-		if (int_input[i] != NULL) *int_input[i] = mcp_adcRead(i); //printf("[AI%d]: %d | ", i, mcp_adcRead(i));
+		int_input[i] = mcp_adcRead(i); //printf("[AI%d]: %d | ", i, mcp_adcRead(i));
 	}
 	//printf("\n");
 
@@ -218,9 +220,9 @@ void updateBuffersOut()
 	//printf("\nDigital Outputs:\n");
 	for (int i = 0; i < MAX_OUTPUT; i++)
 	{
-		if (bool_output[i/8][i%8] != NULL) digitalWrite(DOUT_PINBASE + i, *bool_output[i/8][i%8]); //printf("[IO%d]: %d | ", i, digitalRead(DOUT_PINBASE + i));
+		digitalWrite(DOUT_PINBASE + i, bool_output[i/8][i%8]); //printf("[IO%d]: %d | ", i, digitalRead(DOUT_PINBASE + i));
 	}
-	if(int_output[0] != NULL) pwmWrite(ANALOG_OUT_PIN, (*int_output[0] / 64));
+	pwmWrite(ANALOG_OUT_PIN, (int_output[0] / 64));
 	
 	pthread_mutex_unlock(&bufferLock); //unlock mutex
 }
@@ -26,8 +26,9 @@
 #include <pthread.h>
 #include <stdint.h>
 
-//Internal buffers for I/O and memory. These buffers are defined in the
-//auto-generated glueVars.cpp file
+//Process image for I/O and memory. These buffers are defined in
+//process_image.cpp, and the located variables from the IEC program point
+//directly to their positions on them
 #define BUFFER_SIZE		1024
 /*********************/
 /*  IEC Types defs   */
@@ -54,39 +55,134 @@ typedef float    IEC_REAL;
 typedef double   IEC_LREAL;
 
 //Booleans
-extern IEC_BOOL *bool_input[BUFFER_SIZE][8];
-extern IEC_BOOL *bool_output[BUFFER_SIZE][8];
+extern IEC_BOOL bool_input[BUFFER_SIZE][8];
+extern IEC_BOOL bool_output[BUFFER_SIZE][8];
 
 //Bytes
-extern IEC_BYTE *byte_input[BUFFER_SIZE];
-extern IEC_BYTE *byte_output[BUFFER_SIZE];
+extern IEC_BYTE byte_input[BUFFER_SIZE];
+extern IEC_BYTE byte_output[BUFFER_SIZE];
 
 //Analog I/O
-extern IEC_UINT *int_input[BUFFER_SIZE];
-extern IEC_UINT *int_output[BUFFER_SIZE];
+extern IEC_UINT int_input[BUFFER_SIZE];
+extern IEC_UINT int_output[BUFFER_SIZE];
 
 //Memory
-extern IEC_UINT *int_memory[BUFFER_SIZE];
-extern IEC_DINT *dint_memory[BUFFER_SIZE];
-extern IEC_LINT *lint_memory[BUFFER_SIZE];
+extern IEC_UINT int_memory[BUFFER_SIZE];
+extern IEC_DINT dint_memory[BUFFER_SIZE];
+extern IEC_LINT lint_memory[BUFFER_SIZE];
+
+//Snapshot of the process image, published at the end of every scan for the
+//protocol servers. Fields have the same layout as the buffers above
+struct process_image
+{
+    IEC_BOOL bool_input[BUFFER_SIZE][8];
+    IEC_BOOL bool_output[BUFFER_SIZE][8];
+    IEC_BYTE byte_input[BUFFER_SIZE];
+    IEC_BYTE byte_output[BUFFER_SIZE];
+    IEC_UINT int_input[BUFFER_SIZE];
+    IEC_UINT int_output[BUFFER_SIZE];
+    IEC_UINT int_memory[BUFFER_SIZE];
+    IEC_DINT dint_memory[BUFFER_SIZE];
+    IEC_LINT lint_memory[BUFFER_SIZE];
+};
+
+//Areas of the process image that can be written through the write queue
+#define IMAGE_BOOL_INPUT        0
+#define IMAGE_BOOL_OUTPUT       1
+#define IMAGE_BYTE_INPUT        2
+#define IMAGE_BYTE_OUTPUT       3
+#define IMAGE_INT_INPUT         4
+#define IMAGE_INT_OUTPUT        5
+#define IMAGE_INT_MEMORY        6
+#define IMAGE_DINT_MEMORY       7
+#define IMAGE_LINT_MEMORY       8
+
+//A masked write to one element of the process image. For the boolean areas
+//the element is a whole byte address (8 booleans), and boolean N uses the
+//byte lane N of value and mask
+struct image_write
+{
+    uint8_t area;
+    uint16_t index;
+    uint64_t value;
+    uint64_t mask;
+};
 
 //lock for the buffer
 extern pthread_mutex_t bufferLock;
 
-//Common task timer
-extern unsigned long long common_ticktime__;
+//Task table generated by the MatIEC compiler (must match __IEC_TASK_t and
+//__IEC_TASK_VAR_t on iec_std_lib.h). Programs built with an older compiler
+//have no table
+#define IEC_WRITTEN_FLAG        0x10    //__IEC_WRITTEN_FLAG on iec_types_all.h
+
+struct iec_task_var
+{
+    void **pointer;                 //the located variable pointer of a program instance
+    IEC_BYTE *flags;                //IEC_WRITTEN_FLAG is set when the program writes it
+    unsigned int size;
+};
+
+struct iec_task
+{
+    const char *name;
+    unsigned long long interval;    //ns
+    int priority;                   //0 is the highest, -1 for programs without task
+    void (*run)(unsigned long tick);
+    IEC_BOOL (*trigger)(void);      //rising edge of the SINGLE input, NULL for cyclic tasks
+    struct iec_task_var *vars;      //located variables of the task, NULL if they are shared
+};
+
+//Tables generated on glueVars.cpp by the glue_generator
+struct located_binding
+{
+    const char *name;
+    void **pointer;     //the located variable pointer
+    void *location;     //where it must point to, or NULL if it has its own storage
+};
+
+struct program_variable
+{
+    const char *name;   //IEC name, from VARIABLES.csv
+    const char *type;
+    void *pointer;
+    unsigned int size;
+};
+
+//Entry points of the PLC program (plc_program_entry on glueVars.cpp). The
+//program is built as a shared object and the runtime reaches it only
+//through this struct, so it can be replaced while the runtime is running
+struct plc_program
+{
+    void (*init)(void);
+    void (*run)(unsigned long tick);
+    void (*update_time)(unsigned long long elapsed_ns);
+    struct iec_task **tasks;                //NULL for programs without task table
+    struct located_binding *bindings;
+    struct program_variable *variables;
+    unsigned long long *ticktime;           //common tick, in ns
+};
+
+//The program that is running now. Only changes between two scans, with
+//bufferLock held
+extern struct plc_program *plc_program;
 
 //----------------------------------------------------------------------
 //FUNCTION PROTOTYPES
 //----------------------------------------------------------------------
 
-//MatIEC Compiler
-void config_run__(unsigned long tick);
-void config_init__(void);
+//bitpack.cpp
+void packBits(const IEC_BOOL *src, int count, unsigned char *dest, int destBit);
+void unpackBits(const unsigned char *src, int srcBit, int count, IEC_BOOL *dest);
+uint64_t unpackByteLanes(unsigned int bits);
 
-//glueVars.cpp
-void glueVars();
-void updateTime();
+//bindings.cpp
+int checkBindings();
+int bindLocatedVariables();
+unsigned int getBindingVersion();
+void *resolveLocatedVariable(const char *name, unsigned int *version);
+bool findImageElement(const void *location, uint8_t *area, int *index);
+void *bindingCheckThread(void *arg);
 
 //hardware_layer.cpp
 void initializeHardware();
@@ -99,12 +195,93 @@ void sleep_thread(int milliseconds);
 void *modbusThread();
 void sleep_until(struct timespec *ts, int delay);
 
+//program.cpp
+int loadProgram();
+void *programLoaderThread(void *arg);
+bool programSwapPending();
+bool swapProgram(unsigned long long elapsed_ns);
+
+//scheduler.cpp
+int initializeTaskScheduler();
+void startTaskScheduler(struct timespec *start);
+void stopTaskScheduler();
+void notifyImageChange();
+unsigned long waitNextCycle(struct timespec *deadline, unsigned long long period, bool *overrun);
+
+//rtconfig.cpp
+#define RT_THREAD_SCAN          0
+#define RT_THREAD_TASK          1
+#define RT_THREAD_MODBUS        2
+#define RT_THREAD_MODBUS_CLIENT 3
+#define RT_THREAD_DNP3          4
+#define RT_THREAD_DRIVER        5
+#define RT_NUM_THREAD_CLASSES   6
+
+//What to do when a cycle finishes after the start of the next one
+#define PACING_CATCH_UP         0   //run the missed cycles back to back
+#define PACING_SKIP_MISSED      1   //skip them, keeping the original phase
+#define PACING_REPHASE          2   //start the next cycle now, with a new phase
+
+void readRealTimeConfig();
+int realTimePriority(int thread_class);
+int pacingPolicy();
+int skippedCyclesAddress();
+void applyRealTimeProfile(int thread_class, int priority, const char *name);
+void applySocketProfile(int fd, bool stream);
+void rearmQuickAck(int fd);
+void runLatencyTest(int seconds);
+
+//admission.cpp
+#define CLIENT_CLASS_HIGH       0
+#define CLIENT_CLASS_NORMAL     1
+#define CLIENT_CLASS_LOW        2
+#define NUM_CLIENT_CLASSES      3
+#define ADMISSION_COUNTERS      (NUM_CLIENT_CLASSES * 2 + 1)
+
+struct client_admission
+{
+    int client_class;
+    long long full_at;          //ns on CLOCK_MONOTONIC when the token bucket is full again
+};
+
+void loadAdmissionConfig();
+long long monotonicNanoseconds();
+void admitClient(struct client_admission *admission, uint32_t address);
+long long admitRequest(struct client_admission *admission, long long now);
+bool scanBudgetLeft(int client_class);
+void chargeScanBudget(long long ns);
+void countDeferredRequest(int client_class, bool throttled);
+void readAdmissionCounters(uint32_t *counters);
+
 //server.cpp
-void startServer(int port);
+void startServer(int port, int max_connections, int idle_timeout);
+
+//udp_server.cpp
+void startUdpServer(int port);
+
+//rtu_server.cpp
+void startRtuServer(const char *settings);
 
 //modbus.cpp
-int processModbusMessage(unsigned char *buffer, int bufferSize);
-void mapUnusedIO();
+#define MAX_MODBUS_RESPONSE     264     //MBAP header, function code and 255 bytes of data
+int frameModbusRequest(const unsigned char *buffer, int bufferSize);
+int processModbusRequest(const unsigned char *request, int requestSize, unsigned char *response);
+
+//modbus_map.cpp
+#define MB_TABLE_COILS              0
+#define MB_TABLE_DISCRETE_INPUTS    1
+#define MB_TABLE_HOLDING_REGISTERS  2
+#define MB_TABLE_INPUT_REGISTERS    3
+#define MB_NUM_TABLES               4
+
+void loadModbusMap();
+bool readModbusBits(int table, const struct process_image *image, int start, int count, unsigned char *dest);
+bool readModbusRegisters(int table, const struct process_image *image, int start, int count, unsigned char *dest,
+                         const struct image_write *pending = NULL, int pendingCount = 0);
+bool mapsStatsRegisters(int table, int start, int count);
+int mapCoilWrites(int start, int count, const unsigned char *bits, struct image_write *writes, int max_writes);
+int mapRegisterWrites(int start, int count, const unsigned char *data, struct image_write *writes);
+int mapRegisterMaskWrite(int address, uint16_t andMask, uint16_t orMask, struct image_write *write);
 
 //dnp3.cpp
 void dnp3StartServer(int port);
@@ -112,3 +289,51 @@ void dnp3StartServer(int port);
 //persistent_storage.cpp
 void *persistentStorage(void *args);
 int readPersistentStorage();
+
+//process_image.cpp
+void publishImageSnapshot();
+unsigned int beginSnapshotRead(const struct process_image **image);
+bool endSnapshotRead(unsigned int token);
+unsigned int snapshotNumber(unsigned int token);
+unsigned int copyImageSnapshot(struct process_image *copy);
+unsigned int lastImageSnapshots(const struct process_image **current, const struct process_image **previous);
+bool queueImageWrites(struct image_write *writes, int count);
+int applyImageWrites();
+void saveProcessImage(struct process_image *copy);
+void restoreProcessImage(const struct process_image *copy);
+
+//scan_journal.cpp
+//A change of one element of the process image, as recorded after a scan.
+//Booleans are numbered as byte address * 8 + bit
+struct scan_change
+{
+    uint64_t value;             //new value, with the bits of the element
+    uint64_t time;              //ms since the epoch, when the scan started
+    uint32_t scan;              //number of the snapshot that has the change
+    uint16_t index;
+    uint8_t area;               //IMAGE_* area
+};
+
+void enableScanJournal();
+void recordScanChanges(struct timespec *scan_start);
+void waitScanChanges();
+int readScanChanges(struct scan_change *changes, int max, bool *overflow);
+
+//telemetry.cpp
+#define STATS_PHASE_INPUT       0
+#define STATS_PHASE_LOGIC       1
+#define STATS_PHASE_OUTPUT      2
+#define STATS_PHASE_JITTER      3
+#define STATS_PHASE_CYCLE       4
+#define STATS_NUM_PHASES        5
+
+//Modbus input registers reserved for the scan stats
+#define MIN_STATS_RANGE         1024
+#define MAX_STATS_RANGE         1279
+
+long long timespecDiff(struct timespec *end, struct timespec *start);
+void initializeScanStats();
+void beginScanStats();
+void recordScanPhase(int phase, long long ns);
+void endScanStats(bool overrun);
+void readScanStatsRegisters(int start, int count, IEC_UINT *dest);
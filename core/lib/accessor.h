@@ -100,7 +100,7 @@
 #define __GET_EXTERNAL_FB_BY_REF(name, ...)\
 	__GET_EXTERNAL_BY_REF(((*name) __VA_ARGS__))
 #define __GET_LOCATED_BY_REF(name, ...)\
-	((name.flags & __IEC_FORCE_FLAG) ? &(name.fvalue __VA_ARGS__) : &((*(name.value)) __VA_ARGS__))
+	((name.flags & __IEC_FORCE_FLAG) ? &(name.fvalue __VA_ARGS__) : (name.flags |= __IEC_WRITTEN_FLAG, &((*(name.value)) __VA_ARGS__)))
 
 #define __GET_VAR_REF(name, ...)\
 	(&(name.value __VA_ARGS__))
@@ -131,6 +131,6 @@
 #define __SET_EXTERNAL_FB(prefix, name, suffix, new_value)\
 	__SET_VAR((*(prefix name)), suffix, new_value)
 #define __SET_LOCATED(prefix, name, suffix, new_value)\
-	if (!(prefix name.flags & __IEC_FORCE_FLAG)) *(prefix name.value) suffix = new_value
+	if (!(prefix name.flags & __IEC_FORCE_FLAG)) *(prefix name.value) suffix = (prefix name.flags |= __IEC_WRITTEN_FLAG, new_value)
 
 #endif //__ACCESSOR_H
@@ -71,6 +71,7 @@
 #define __IEC_FORCE_FLAG 0x02
 #define __IEC_RETAIN_FLAG 0x04
 #define __IEC_OUTPUT_FLAG 0x08
+#define __IEC_WRITTEN_FLAG 0x10 /* set when the program writes a located variable */
 
 #define __DECLARE_IEC_TYPE(type)\
 typedef IEC_##type type;\
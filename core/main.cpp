@@ -45,9 +45,16 @@ extern int opterr;
 IEC_BOOL __DEBUG;
 
 static int tick = 0;
+static unsigned long skipped_cycles = 0;
 
 int modbus_port = 502;
 int dnp3_port = 20000;
+int modbus_max_connections = 1024;
+int modbus_idle_timeout = 0;
+int binding_check_interval = 0;
+int latency_test_time = 0;
+char *rtu_settings = NULL;
+int modbus_udp_port = 0;
 
 pthread_mutex_t bufferLock; //mutex for the internal buffers
 
@@ -76,12 +83,30 @@ void sleep_until(struct timespec *ts, int delay)
 
 void *modbusThread(void *arg)
 {
-    startServer(modbus_port);
+    applyRealTimeProfile(RT_THREAD_MODBUS, -1, "modbus thread");
+    startServer(modbus_port, modbus_max_connections, modbus_idle_timeout);
+    return NULL;
+}
+
+void *udpThread(void *arg)
+{
+    applyRealTimeProfile(RT_THREAD_MODBUS, -1, "modbus udp thread");
+    startUdpServer(modbus_udp_port);
+    return NULL;
+}
+
+void *rtuThread(void *arg)
+{
+    applyRealTimeProfile(RT_THREAD_MODBUS, -1, "modbus rtu thread");
+    startRtuServer(rtu_settings);
+    return NULL;
 }
 
 void *dnp3Thread(void *arg)
 {
+    applyRealTimeProfile(RT_THREAD_DNP3, -1, "dnp3 thread");
     dnp3StartServer(dnp3_port);
+    return NULL;
 }
 
 double measureTime(struct timespec *timer_start)
@@ -103,6 +128,16 @@ void print_usage() {
     printf("dnp3 on port 20000\n");
     printf("Selecting only modbus or only dnp3 will only run that ");
     printf("protocol\n");
+    printf("Use -c clients to limit the number of Modbus/TCP clients ");
+    printf("(1024 by default) and -i seconds to close idle clients\n");
+    printf("Use -u port to also serve Modbus/UDP on that port\n");
+    printf("Use -r device[,baud[,format[,slave_id]]] to also serve Modbus RTU ");
+    printf("on a serial port (ex: -r /dev/ttyUSB0,19200,8E1,1)\n");
+    printf("Use -b seconds to check the located variable bindings ");
+    printf("periodically (debug)\n");
+    printf("Use -l seconds to run a latency test with the real-time ");
+    printf("profile before starting the PLC program\n");
+    printf("Send SIGUSR1 to load a new PLC program without stopping\n");
 }
 
 int main(int argc,char **argv)
@@ -118,7 +153,7 @@ int main(int argc,char **argv)
     //                 READ COMMAND LINE ARGS
     //======================================================
 
-    while ((opt = getopt (argc, argv, "m:d:")) != -1) {
+    while ((opt = getopt (argc, argv, "m:d:b:l:c:i:r:u:")) != -1) {
       switch (opt) {
         case 'm':
             modbus_flag = true;
@@ -128,6 +163,25 @@ int main(int argc,char **argv)
             dnp3_flag = true;
             dnp3_port = atoi(optarg);
             break;
+        case 'c':
+            modbus_max_connections = atoi(optarg);
+            if (modbus_max_connections < 1) modbus_max_connections = 1;
+            break;
+        case 'i':
+            modbus_idle_timeout = atoi(optarg);
+            break;
+        case 'u':
+            modbus_udp_port = atoi(optarg);
+            break;
+        case 'r':
+            rtu_settings = optarg;
+            break;
+        case 'b':
+            binding_check_interval = atoi(optarg) * 1000;
+            break;
+        case 'l':
+            latency_test_time = atoi(optarg);
+            break;
         case '?':
             if (isprint (optopt))
                 fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -144,21 +198,52 @@ int main(int argc,char **argv)
     setvbuf(stdout, NULL, _IONBF, 0);
     setvbuf(stderr, NULL, _IONBF, 0);
     printf("OpenPLC Software running...\n");
+    readRealTimeConfig();
+    loadModbusMap();
+    loadAdmissionConfig();
+
+    //SIGUSR1 asks for a new program. It is only received by the program
+    //loader thread, so it is blocked before any other thread starts
+    sigset_t loaderSignals;
+    sigemptyset(&loaderSignals);
+    sigaddset(&loaderSignals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &loaderSignals, NULL);
 
     //======================================================
     //                 PLC INITIALIZATION
     //======================================================
-    config_init__();
-    glueVars();
+    if (loadProgram() != 0)
+    {
+        printf("Can't start without a PLC program\n");
+        exit(1);
+    }
+    if (bindLocatedVariables() > 0)
+    {
+        printf("Located variables are not attached to the process image\n");
+        exit(1);
+    }
+    if (binding_check_interval > 0)
+    {
+        pthread_t binding_thread;
+        pthread_create(&binding_thread, NULL, bindingCheckThread, &binding_check_interval);
+    }
 
     //======================================================
     //               MUTEX INITIALIZATION
     //======================================================
-    if (pthread_mutex_init(&bufferLock, NULL) != 0)
+    //tasks with different priorities share the buffers, so the lock uses
+    //priority inheritance where it is available
+    pthread_mutexattr_t bufferLockAttr;
+    pthread_mutexattr_init(&bufferLockAttr);
+#ifdef __linux__
+    pthread_mutexattr_setprotocol(&bufferLockAttr, PTHREAD_PRIO_INHERIT);
+#endif
+    if (pthread_mutex_init(&bufferLock, &bufferLockAttr) != 0)
     {
         printf("Mutex init failed\n");
         exit(1);
     }
+    pthread_mutexattr_destroy(&bufferLockAttr);
 
     //======================================================
     //              HARDWARE INITIALIZATION
@@ -166,6 +251,7 @@ int main(int argc,char **argv)
     initializeHardware();
     updateBuffersIn();
     updateBuffersOut();
+    publishImageSnapshot();
     pthread_t modbus_thread;
     pthread_t dnp3_thread;
 
@@ -175,6 +261,19 @@ int main(int argc,char **argv)
     if(dnp3_flag || (!modbus_flag && !dnp3_flag)) {
         pthread_create(&dnp3_thread, NULL, dnp3Thread, NULL);
     }
+    if (modbus_udp_port > 0)
+    {
+        pthread_t udp_thread;
+        pthread_create(&udp_thread, NULL, udpThread, NULL);
+    }
+    if (rtu_settings != NULL)
+    {
+        pthread_t rtu_thread;
+        pthread_create(&rtu_thread, NULL, rtuThread, NULL);
+    }
+
+    pthread_t loader_thread;
+    pthread_create(&loader_thread, NULL, programLoaderThread, NULL);
 
     //======================================================
     //          PERSISTENT STORAGE INITIALIZATION
@@ -187,15 +286,6 @@ int main(int argc,char **argv)
     //======================================================
     //              REAL-TIME INITIALIZATION
     //======================================================
-    // Set our thread to real time priority
-    struct sched_param sp;
-    sp.sched_priority = 30;
-    printf("Setting main thread priority to RT\n");
-    if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))
-    {
-        printf("WARNING: Failed to set main thread to real-time priority\n");
-    }
-
     // Lock memory to ensure no swapping is done.
     printf("Locking main thread memory\n");
     if(mlockall(MCL_FUTURE|MCL_CURRENT))
@@ -204,30 +294,92 @@ int main(int argc,char **argv)
     }
 #endif
 
+    // Set our thread to real time priority
+    printf("Setting main thread priority to RT\n");
+    applyRealTimeProfile(RT_THREAD_SCAN, -1, "main thread");
+
+    if (latency_test_time > 0)
+    {
+        runLatencyTest(latency_test_time);
+    }
+
+	//======================================================
+	//              TELEMETRY INITIALIZATION
+	//======================================================
+	initializeScanStats();
+
+	//======================================================
+	//              TASK SCHEDULER INITIALIZATION
+	//======================================================
+	//with more than one task, each task runs on its own thread and the
+	//main loop only does the I/O exchange
+	int task_count = initializeTaskScheduler();
+
 	//gets the starting point for the clock
 	printf("Getting current time\n");
 	struct timespec timer_start;
 	clock_gettime(CLOCK_MONOTONIC, &timer_start);
+	if (task_count > 0) startTaskScheduler(&timer_start);
+
+	//timestamps for each phase of the scan
+	struct timespec cycle_start, input_end, logic_end, output_end, wakeup;
+	bool overrun;
+
+	//the PLC time starts at zero on the first scan
+	struct timespec plc_time_start = timer_start;
+	plc_program->update_time(0);
+	int skipped_cycles_address = skippedCyclesAddress();
 
 	//======================================================
 	//                    MAIN LOOP
 	//======================================================
 	for(;;)
 	{
-		//make sure the buffer pointers are correct and
-		//attached to the user variables
-		glueVars();
-		
+		clock_gettime(CLOCK_MONOTONIC, &cycle_start);
+		if (programSwapPending())
+		{
+			//the new program takes over from this scan on
+			if (swapProgram(timespecDiff(&cycle_start, &plc_time_start)))
+			{
+				task_count = initializeTaskScheduler();
+				if (task_count > 0) startTaskScheduler(&timer_start);
+			}
+		}
 		updateBuffersIn(); //read input image
+		notifyImageChange(); //wake the SINGLE tasks
+		clock_gettime(CLOCK_MONOTONIC, &input_end);
 
 		pthread_mutex_lock(&bufferLock); //lock mutex
-		config_run__(tick++); // execute plc program logic
+		applyImageWrites(); // apply writes from the protocols
+		if (skipped_cycles_address >= 0)
+		{
+			dint_memory[skipped_cycles_address] = (IEC_DINT)skipped_cycles;
+		}
+		if (task_count == 0)
+		{
+			plc_program->run(tick++); // execute plc program logic
+		}
+		clock_gettime(CLOCK_MONOTONIC, &logic_end);
+		plc_program->update_time(timespecDiff(&logic_end, &plc_time_start)); //PLC time follows the clock
 		pthread_mutex_unlock(&bufferLock); //unlock mutex
 
 		updateBuffersOut(); //write output image
-		
-		updateTime();
-
-		sleep_until(&timer_start, common_ticktime__);
+		pthread_mutex_lock(&bufferLock); //lock mutex
+		publishImageSnapshot(); //make this scan visible to the protocols
+		pthread_mutex_unlock(&bufferLock); //unlock mutex
+		recordScanChanges(&cycle_start); //events for DNP3, stamped with this scan
+		clock_gettime(CLOCK_MONOTONIC, &output_end);
+
+		skipped_cycles += waitNextCycle(&timer_start, *plc_program->ticktime, &overrun);
+		clock_gettime(CLOCK_MONOTONIC, &wakeup);
+
+		//timer_start now holds the deadline for this cycle
+		beginScanStats();
+		recordScanPhase(STATS_PHASE_INPUT, timespecDiff(&input_end, &cycle_start));
+		recordScanPhase(STATS_PHASE_LOGIC, timespecDiff(&logic_end, &input_end));
+		recordScanPhase(STATS_PHASE_OUTPUT, timespecDiff(&output_end, &logic_end));
+		recordScanPhase(STATS_PHASE_CYCLE, timespecDiff(&output_end, &cycle_start));
+		recordScanPhase(STATS_PHASE_JITTER, timespecDiff(&wakeup, &timer_start));
+		endScanStats(overrun);
 	}
 }
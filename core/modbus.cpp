@@ -21,27 +21,21 @@
 // This file has all the MODBUS/TCP functions supported by the OpenPLC. If any
 // other function is to be added to the project, it must be added here
 // Thiago Alves, Dec 2015
+//
+// The functions here keep no state between calls, so any number of threads
+// may process requests at the same time. Requests are framed by the length
+// field of their MBAP header (see frameModbusRequest()), and each response is
+// built on its own buffer, leaving the request untouched.
 //-----------------------------------------------------------------------------
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 
 #include "ladder.h"
 
-#define MAX_DISCRETE_INPUT 		800
-#define MAX_COILS 				800
-#define MAX_HOLD_REGS 			8192
-#define MAX_INP_REGS			1024
-
-#define MIN_16B_RANGE			1024
-#define MAX_16B_RANGE			2047
-#define MIN_32B_RANGE			2048
-#define MAX_32B_RANGE			4095
-#define MIN_64B_RANGE			4096
-#define MAX_64B_RANGE			8191
-
 #define MB_FC_NONE							0
 #define MB_FC_READ_COILS					1
 #define MB_FC_READ_INPUTS					2
@@ -51,6 +45,9 @@
 #define MB_FC_WRITE_REGISTER				6
 #define MB_FC_WRITE_MULTIPLE_COILS			15
 #define MB_FC_WRITE_MULTIPLE_REGISTERS		16
+#define MB_FC_MASK_WRITE_REGISTER			22
+#define MB_FC_READ_WRITE_MULTIPLE_REGISTERS	23
+#define MB_FC_ENCAPSULATED_INTERFACE		43
 #define MB_FC_ERROR							255
 
 #define ERR_NONE							0
@@ -60,23 +57,54 @@
 #define ERR_SLAVE_DEVICE_FAILURE			4
 #define ERR_SLAVE_DEVICE_BUSY				6
 
-
-#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
-#define bitSet(value, bit) ((value) |= (1UL << (bit)))
-#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
-#define bitWrite(value, bit, bitvalue) (bitvalue ? bitSet(value, bit) : bitClear(value, bit))
-
 #define lowByte(w) ((unsigned char) ((w) & 0xff))
 #define highByte(w) ((unsigned char) ((w) >> 8))
 
-IEC_BOOL mb_discrete_input[MAX_DISCRETE_INPUT];
-IEC_BOOL mb_coils[MAX_COILS];
-IEC_UINT mb_input_regs[MAX_INP_REGS];
-IEC_UINT mb_holding_regs[MAX_HOLD_REGS];
+#define MBAP_HEADER_SIZE		6	//transaction, protocol and length fields
+#define MIN_MBAP_LENGTH			2	//unit identifier and function code
+#define MAX_MBAP_LENGTH			254	//unit identifier and a 253 bytes PDU
+
+//Addresses are resolved by the Modbus map (see modbus_map.cpp)
+#define MAX_COIL_WRITES			512
 
-int MessageLength;
+#define RESPONSE_CACHE_SIZE		16	//entries per thread, must be a power of 2
 
+#define MEI_READ_DEVICE_ID					14
+#define DEVICE_ID_BASIC						1
+#define DEVICE_ID_REGULAR					2
+#define DEVICE_ID_EXTENDED					3
+#define DEVICE_ID_INDIVIDUAL				4
+#define DEVICE_ID_CONFORMITY				0x82	//regular, stream and individual access
 
+//Objects answered by Read Device Identification. Objects 0 to 2 are the
+//basic category and the others are regular
+static const char *device_id_objects[] =
+{
+	"OpenPLC Project",					//VendorName
+	"OpenPLC",							//ProductCode
+	"2.0",								//MajorMinorRevision
+	"http://www.openplcproject.com",	//VendorUrl
+	"OpenPLC Runtime",					//ProductName
+};
+
+#define NUM_DEVICE_ID_OBJECTS	(int)(sizeof(device_id_objects) / sizeof(device_id_objects[0]))
+#define LAST_BASIC_OBJECT		2
+
+//A read response, encoded for the snapshot it was read from
+struct cached_response
+{
+	unsigned int snapshot;		//token of the snapshot, 0 if the entry is empty
+	uint16_t start;
+	uint16_t quantity;
+	unsigned char function;
+	int length;
+	unsigned char response[MAX_MODBUS_RESPONSE];
+};
+
+//Every thread that serves requests has its own cache, so it is used without
+//locks. On Linux all Modbus/TCP clients are served by the same thread, and
+//share the cache
+static __thread struct cached_response response_cache[RESPONSE_CACHE_SIZE];
 
 //-----------------------------------------------------------------------------
 // Concatenate two bytes into an int
@@ -90,800 +118,634 @@ int word(unsigned char byte1, unsigned char byte2)
 }
 
 //-----------------------------------------------------------------------------
-// This function sets the internal NULL OpenPLC buffers to point to valid
-// positions on the Modbus buffer
+// Response to a Modbus Error. Returns the size of the response
 //-----------------------------------------------------------------------------
-void mapUnusedIO()
+int ModbusError(const unsigned char *request, unsigned char *response, int mb_error)
 {
-	pthread_mutex_lock(&bufferLock);
+	memcpy(response, request, 8);
+	response[4] = 0;
+	response[5] = 3;
+	response[7] = request[7] | 0x80; //set the highest bit
+	response[8] = mb_error;
+	return 9;
+}
 
-	for(int i = 0; i < MAX_DISCRETE_INPUT; i++)
-	{
-		if (bool_input[i/8][i%8] == NULL) bool_input[i/8][i%8] = &mb_discrete_input[i];
-	}
+//-----------------------------------------------------------------------------
+// Common part of Read Coils and Read Discrete Inputs
+//-----------------------------------------------------------------------------
+int ReadBits(int table, const unsigned char *request, int requestSize, unsigned char *response)
+{
+	int Start, ByteDataLength, BitDataLength;
+	bool mapped;
 
-	for(int i = 0; i < MAX_COILS; i++)
+	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
+	if (requestSize < 12)
 	{
-		if (bool_output[i/8][i%8] == NULL) bool_output[i/8][i%8] = &mb_coils[i];
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
 
-	for (int i = 0; i < MAX_INP_REGS; i++)
+	Start = word(request[8], request[9]);
+	BitDataLength = word(request[10], request[11]);
+	ByteDataLength = BitDataLength / 8; //calculating the size of the message in bytes
+	if(ByteDataLength * 8 < BitDataLength) ByteDataLength++;
+
+	//asked for too many bits
+	if (ByteDataLength > 255)
 	{
-		if (int_input[i] == NULL) int_input[i] = &mb_input_regs[i];
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_ADDRESS);
 	}
 
-	for (int i = 0; i <= MAX_16B_RANGE; i++)
+	//preparing response
+	memcpy(response, request, 8);
+	response[4] = highByte(ByteDataLength + 3);
+	response[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
+	response[8] = ByteDataLength;     //Number of bytes of data
+
+	const struct process_image *image;
+	unsigned int snapshot;
+	do
 	{
-		if (i < MIN_16B_RANGE)
-			if (int_output[i] == NULL) int_output[i] = &mb_holding_regs[i];
+		snapshot = beginSnapshotRead(&image);
+		mapped = readModbusBits(table, image, Start, BitDataLength, &response[9]);
+	} while (!endSnapshotRead(snapshot));
 
-		if (i >= MIN_16B_RANGE && i <= MAX_16B_RANGE)
-			if (int_memory[i - MIN_16B_RANGE] == NULL) int_memory[i] = &mb_holding_regs[i];
+	if (!mapped)
+	{
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_ADDRESS);
 	}
 
-	pthread_mutex_unlock(&bufferLock);
-}
-
-//-----------------------------------------------------------------------------
-// Response to a Modbus Error
-//-----------------------------------------------------------------------------
-void ModbusError(unsigned char *buffer, int mb_error)
-{
-	buffer[4] = 0;
-	buffer[5] = 3;
-	buffer[7] = buffer[7] | 0x80; //set the highest bit
-	buffer[8] = mb_error;
-	MessageLength = 9;
+	return ByteDataLength + 9;
 }
 
 //-----------------------------------------------------------------------------
-// Implementation of Modbus/TCP Read Coils
+// Common part of Read Holding Registers and Read Input Registers
 //-----------------------------------------------------------------------------
-void ReadCoils(unsigned char *buffer, int bufferSize)
+int ReadRegisters(int table, const unsigned char *request, int requestSize, unsigned char *response)
 {
-	int Start, ByteDataLength, CoilDataLength;
-	int mb_error = ERR_NONE;
+	int Start, WordDataLength, ByteDataLength;
+	bool mapped;
 
 	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
-	if (bufferSize < 12)
+	if (requestSize < 12)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
-		return;
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
 
-	Start = word(buffer[8], buffer[9]);
-	CoilDataLength = word(buffer[10], buffer[11]);
-	ByteDataLength = CoilDataLength / 8; //calculating the size of the message in bytes
-	if(ByteDataLength * 8 < CoilDataLength) ByteDataLength++;
+	Start = word(request[8], request[9]);
+	WordDataLength = word(request[10], request[11]);
+	ByteDataLength = WordDataLength * 2;
 
-	//asked for too many coils
+	//asked for too many registers
 	if (ByteDataLength > 255)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_ADDRESS);
-		return;
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_ADDRESS);
 	}
 
 	//preparing response
-	buffer[4] = highByte(ByteDataLength + 3);
-	buffer[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
-	buffer[8] = ByteDataLength;     //Number of bytes of data
+	memcpy(response, request, 8);
+	response[4] = highByte(ByteDataLength + 3);
+	response[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
+	response[8] = ByteDataLength;     //Number of bytes of data
 
-	pthread_mutex_lock(&bufferLock);
-	for(int i = 0; i < ByteDataLength ; i++)
+	const struct process_image *image;
+	unsigned int snapshot;
+	do
 	{
-		for(int j = 0; j < 8; j++)
-		{
-			int position = Start + i * 8 + j;
-			if (position < MAX_COILS)
-			{
-				if (bool_output[position/8][position%8] != NULL)
-				{
-					bitWrite(buffer[9 + i], j, *bool_output[position/8][position%8]);
-				}
-				else
-				{
-					bitWrite(buffer[9 + i], j, 0);
-				}
-			}
-			else //invalid address
-			{
-				mb_error = ERR_ILLEGAL_DATA_ADDRESS;
-			}
-		}
+		snapshot = beginSnapshotRead(&image);
+		mapped = readModbusRegisters(table, image, Start, WordDataLength, &response[9]);
+	} while (!endSnapshotRead(snapshot));
+
+	if (!mapped)
+	{
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_ADDRESS);
 	}
-	pthread_mutex_unlock(&bufferLock);
 
-	if (mb_error != ERR_NONE)
+	return ByteDataLength + 9;
+}
+
+//-----------------------------------------------------------------------------
+// Implementation of Modbus/TCP Read Coils
+//-----------------------------------------------------------------------------
+int ReadCoils(const unsigned char *request, int requestSize, unsigned char *response)
+{
+	return ReadBits(MB_TABLE_COILS, request, requestSize, response);
+}
+
+//-----------------------------------------------------------------------------
+// Implementation of Modbus/TCP Read Discrete Inputs
+//-----------------------------------------------------------------------------
+int ReadDiscreteInputs(const unsigned char *request, int requestSize, unsigned char *response)
+{
+	return ReadBits(MB_TABLE_DISCRETE_INPUTS, request, requestSize, response);
+}
+
+//-----------------------------------------------------------------------------
+// Implementation of Modbus/TCP Read Holding Registers
+//-----------------------------------------------------------------------------
+int ReadHoldingRegisters(const unsigned char *request, int requestSize, unsigned char *response)
+{
+	return ReadRegisters(MB_TABLE_HOLDING_REGISTERS, request, requestSize, response);
+}
+
+//-----------------------------------------------------------------------------
+// Implementation of Modbus/TCP Read Input Registers
+//-----------------------------------------------------------------------------
+int ReadInputRegisters(const unsigned char *request, int requestSize, unsigned char *response)
+{
+	return ReadRegisters(MB_TABLE_INPUT_REGISTERS, request, requestSize, response);
+}
+
+//-----------------------------------------------------------------------------
+// Queues the image writes built from the Modbus map. Returns the Modbus
+// error for the request
+//-----------------------------------------------------------------------------
+int queueMappedWrites(struct image_write *writes, int writeCount, int maxWrites)
+{
+	//some address is not on the map
+	if (writeCount < 0)
 	{
-		ModbusError(buffer, mb_error);
+		return ERR_ILLEGAL_DATA_ADDRESS;
 	}
-	else
+
+	//all values are written on the same scan, or none at all
+	if (writeCount > maxWrites || !queueImageWrites(writes, writeCount))
 	{
-		MessageLength = ByteDataLength + 9;
+		return ERR_SLAVE_DEVICE_BUSY;
 	}
+
+	return ERR_NONE;
 }
 
 //-----------------------------------------------------------------------------
-// Implementation of Modbus/TCP Read Discrete Inputs
+// Implementation of Modbus/TCP Write Coil
 //-----------------------------------------------------------------------------
-void ReadDiscreteInputs(unsigned char *buffer, int bufferSize)
+int WriteCoil(const unsigned char *request, int requestSize, unsigned char *response)
 {
-	int Start, ByteDataLength, InputDataLength;
+	int Start;
 	int mb_error = ERR_NONE;
 
 	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
-	if (bufferSize < 12)
+	if (requestSize < 12)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
-		return;
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
 
-	Start = word(buffer[8],buffer[9]);
-	InputDataLength = word(buffer[10],buffer[11]);
-	ByteDataLength = InputDataLength / 8;
-	if(ByteDataLength * 8 < InputDataLength) ByteDataLength++;
+	Start = word(request[8], request[9]);
+	unsigned char value = (word(request[10], request[11]) > 0);
 
-	//asked for too many inputs
-	if (ByteDataLength > 255)
+	struct image_write write;
+	mb_error = queueMappedWrites(&write, mapCoilWrites(Start, 1, &value, &write, 1), 1);
+
+	if (mb_error != ERR_NONE)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_ADDRESS);
-		return;
+		return ModbusError(request, response, mb_error);
 	}
 
-	//Preparing response
-	buffer[4] = highByte(ByteDataLength + 3);
-	buffer[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
-	buffer[8] = ByteDataLength;     //Number of bytes of data
+	//the response echoes the request
+	memcpy(response, request, 12);
+	response[4] = 0;
+	response[5] = 6; //Number of bytes after this one.
+	return 12;
+}
+
+//-----------------------------------------------------------------------------
+// Implementation of Modbus/TCP Write Holding Register
+//-----------------------------------------------------------------------------
+int WriteRegister(const unsigned char *request, int requestSize, unsigned char *response)
+{
+	int Start;
+	int mb_error = ERR_NONE;
 
-	pthread_mutex_lock(&bufferLock);
-	for(int i = 0; i < ByteDataLength ; i++)
+	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
+	if (requestSize < 12)
 	{
-		for(int j = 0; j < 8; j++)
-		{
-			int position = Start + i * 8 + j;
-			if (position < MAX_DISCRETE_INPUT)
-			{
-				if (bool_input[position/8][position%8] != NULL)
-				{
-					bitWrite(buffer[9 + i], j, *bool_input[position/8][position%8]);
-				}
-				else
-				{
-					bitWrite(buffer[9 + i], j, 0);
-				}
-			}
-			else //invalid address
-			{
-				mb_error = ERR_ILLEGAL_DATA_ADDRESS;
-			}
-		}
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
-	pthread_mutex_unlock(&bufferLock);
+
+	Start = word(request[8], request[9]);
+
+	struct image_write write;
+	mb_error = queueMappedWrites(&write, mapRegisterWrites(Start, 1, &request[10], &write), 1);
 
 	if (mb_error != ERR_NONE)
 	{
-		ModbusError(buffer, mb_error);
-	}
-	else
-	{
-		MessageLength = ByteDataLength + 9;
+		return ModbusError(request, response, mb_error);
 	}
+
+	//the response echoes the request
+	memcpy(response, request, 12);
+	response[4] = 0;
+	response[5] = 6; //Number of bytes after this one.
+	return 12;
 }
 
 //-----------------------------------------------------------------------------
-// Implementation of Modbus/TCP Read Holding Registers
+// Implementation of Modbus/TCP Write Multiple Coils
 //-----------------------------------------------------------------------------
-void ReadHoldingRegisters(unsigned char *buffer, int bufferSize)
+int WriteMultipleCoils(const unsigned char *request, int requestSize, unsigned char *response)
 {
-	int Start, WordDataLength, ByteDataLength;
+	int Start, ByteDataLength, CoilDataLength;
 	int mb_error = ERR_NONE;
 
 	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
-	if (bufferSize < 12)
+	if (requestSize < 12)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
-		return;
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
 
-	Start = word(buffer[8],buffer[9]);
-	WordDataLength = word(buffer[10],buffer[11]);
-	ByteDataLength = WordDataLength * 2;
+	Start = word(request[8], request[9]);
+	CoilDataLength = word(request[10], request[11]);
+	ByteDataLength = CoilDataLength / 8;
+	if(ByteDataLength * 8 < CoilDataLength) ByteDataLength++;
 
-	//asked for too many registers
-	if (ByteDataLength > 255)
+	//this request must have all the bytes it wants to write. If it doesn't, it's a corrupted message
+	if ( (requestSize < (13 + ByteDataLength)) || (request[12] != ByteDataLength) )
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_ADDRESS);
-		return;
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
 
-	//preparing response
-	buffer[4] = highByte(ByteDataLength + 3);
-	buffer[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
-	buffer[8] = ByteDataLength;     //Number of bytes of data
-
-	pthread_mutex_lock(&bufferLock);
-	for(int i = 0; i < WordDataLength; i++)
-	{
-		int position = Start + i;
-		if (position <= MIN_16B_RANGE)
-		{
-			if (int_output[position] != NULL)
-			{
-				buffer[ 9 + i * 2] = highByte(*int_output[position]);
-				buffer[10 + i * 2] = lowByte(*int_output[position]);
-			}
-			else
-			{
-				buffer[ 9 + i * 2] = 0;
-				buffer[10 + i * 2] = 0;
-			}
-		}
-		//accessing memory
-		//16-bit registers
-		else if (position >= MIN_16B_RANGE && position <= MAX_16B_RANGE)
-		{
-			if (int_memory[position - MIN_16B_RANGE] != NULL)
-			{
-				buffer[ 9 + i * 2] = highByte(*int_memory[position - MIN_16B_RANGE]);
-				buffer[10 + i * 2] = lowByte(*int_memory[position - MIN_16B_RANGE]);
-			}
-			else
-			{
-				buffer[ 9 + i * 2] = 0;
-				buffer[10 + i * 2] = 0;
-			}
-		}
-		//32-bit registers
-		else if (position >= MIN_32B_RANGE && position <= MAX_32B_RANGE)
-		{
-			if (dint_memory[(position - MIN_32B_RANGE)/2] != NULL)
-			{
-				if ((position - MIN_32B_RANGE) % 2 == 0) //first word
-				{
-					uint16_t tempValue = (uint16_t)(*dint_memory[(position - MIN_32B_RANGE)/2] >> 16);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-				else //second word
-				{
-					uint16_t tempValue = (uint16_t)(*dint_memory[(position - MIN_32B_RANGE)/2] & 0xffff);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-			}
-			else
-			{
-				buffer[ 9 + i * 2] = mb_holding_regs[position];
-				buffer[10 + i * 2] = mb_holding_regs[position];
-			}
-		}
-		//64-bit registers
-		else if (position >= MIN_64B_RANGE && position <= MAX_64B_RANGE)
-		{
-			if (lint_memory[(position - MIN_64B_RANGE)/4] != NULL)
-			{
-				if ((position - MIN_64B_RANGE) % 4 == 0) //first word
-				{
-					uint16_t tempValue = (uint16_t)(*lint_memory[(position - MIN_64B_RANGE)/4] >> 48);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-				else if ((position - MIN_64B_RANGE) % 4 == 1)//second word
-				{
-					uint16_t tempValue = (uint16_t)((*lint_memory[(position - MIN_64B_RANGE)/4] >> 32) & 0xffff);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-				else if ((position - MIN_64B_RANGE) % 4 == 2)//third word
-				{
-					uint16_t tempValue = (uint16_t)((*lint_memory[(position - MIN_64B_RANGE)/4] >> 16) & 0xffff);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-				else if ((position - MIN_64B_RANGE) % 4 == 3)//fourth word
-				{
-					uint16_t tempValue = (uint16_t)(*lint_memory[(position - MIN_64B_RANGE)/4] & 0xffff);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-			}
-			else
-			{
-				buffer[ 9 + i * 2] = mb_holding_regs[position];
-				buffer[10 + i * 2] = mb_holding_regs[position];
-			}
-		}
-		//invalid address
-		else
-		{
-			mb_error = ERR_ILLEGAL_DATA_ADDRESS;
-		}
-	}
-	pthread_mutex_unlock(&bufferLock);
+	//request[12] limits the request to 255 bytes of coils. On the default map
+	//they touch at most 256 bytes of bool_output, but a map with many small
+	//segments may need more writes
+	struct image_write writes[MAX_COIL_WRITES];
+	int writeCount = mapCoilWrites(Start, CoilDataLength, &request[13], writes, MAX_COIL_WRITES);
+	mb_error = queueMappedWrites(writes, writeCount, MAX_COIL_WRITES);
 
 	if (mb_error != ERR_NONE)
 	{
-		ModbusError(buffer, mb_error);
-	}
-	else
-	{
-		MessageLength = ByteDataLength + 9;
+		return ModbusError(request, response, mb_error);
 	}
+
+	//the response echoes the address and quantity
+	memcpy(response, request, 12);
+	response[4] = 0;
+	response[5] = 6; //Number of bytes after this one.
+	return 12;
 }
 
 //-----------------------------------------------------------------------------
-// Implementation of Modbus/TCP Read Input Registers
+// Implementation of Modbus/TCP Write Multiple Registers
 //-----------------------------------------------------------------------------
-void ReadInputRegisters(unsigned char *buffer, int bufferSize)
+int WriteMultipleRegisters(const unsigned char *request, int requestSize, unsigned char *response)
 {
 	int Start, WordDataLength, ByteDataLength;
 	int mb_error = ERR_NONE;
 
 	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
-	if (bufferSize < 12)
+	if (requestSize < 12)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
-		return;
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
 
-	Start = word(buffer[8],buffer[9]);
-	WordDataLength = word(buffer[10],buffer[11]);
+	Start = word(request[8], request[9]);
+	WordDataLength = word(request[10], request[11]);
 	ByteDataLength = WordDataLength * 2;
 
-	//asked for too many registers
-	if (ByteDataLength > 255)
+	//this request must have all the bytes it wants to write. If it doesn't, it's a corrupted message
+	if ( (requestSize < (13 + ByteDataLength)) || (request[12] != ByteDataLength) )
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_ADDRESS);
-		return;
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
 
-	//preparing response
-	buffer[4] = highByte(ByteDataLength + 3);
-	buffer[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
-	buffer[8] = ByteDataLength;     //Number of bytes of data
-
-	pthread_mutex_lock(&bufferLock);
-	for(int i = 0; i < WordDataLength; i++)
-	{
-		int position = Start + i;
-		if (position < MAX_INP_REGS)
-		{
-			if (int_input[position] != NULL)
-			{
-				buffer[ 9 + i * 2] = highByte(*int_input[position]);
-				buffer[10 + i * 2] = lowByte(*int_input[position]);
-			}
-			else
-			{
-				buffer[ 9 + i * 2] = 0;
-				buffer[10 + i * 2] = 0;
-			}
-		}
-		else //invalid address
-		{
-			mb_error = ERR_ILLEGAL_DATA_ADDRESS;
-		}
-	}
-	pthread_mutex_unlock(&bufferLock);
+	//request[12] limits the request to 127 registers, and each register
+	//needs at most one write
+	struct image_write writes[128];
+	int writeCount = mapRegisterWrites(Start, WordDataLength, &request[13], writes);
+	mb_error = queueMappedWrites(writes, writeCount, 128);
 
 	if (mb_error != ERR_NONE)
 	{
-		ModbusError(buffer, mb_error);
-	}
-	else
-	{
-		MessageLength = ByteDataLength + 9;
+		return ModbusError(request, response, mb_error);
 	}
+
+	//the response echoes the address and quantity
+	memcpy(response, request, 12);
+	response[4] = 0;
+	response[5] = 6; //Number of bytes after this one.
+	return 12;
 }
 
 //-----------------------------------------------------------------------------
-// Implementation of Modbus/TCP Write Coil
+// Implementation of Modbus/TCP Mask Write Register. The register is changed
+// by a single masked write, so the scan never sees it half updated and bits
+// written by the program in the meantime are not overwritten
 //-----------------------------------------------------------------------------
-void WriteCoil(unsigned char *buffer, int bufferSize)
+int MaskWriteRegister(const unsigned char *request, int requestSize, unsigned char *response)
 {
 	int Start;
 	int mb_error = ERR_NONE;
 
-	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
-	if (bufferSize < 12)
+	//this request must have 14 bytes. If it doesn't, it's a corrupted message
+	if (requestSize < 14)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
-		return;
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
 
-	Start = word(buffer[8], buffer[9]);
-
-	if (Start < MAX_COILS)
-	{
-		unsigned char value;
-		if (word(buffer[10], buffer[11]) > 0)
-		{
-			value = 1;
-		}
-		else
-		{
-			value = 0;
-		}
-
-		pthread_mutex_lock(&bufferLock);
-		if (bool_output[Start/8][Start%8] != NULL)
-		{
-			*bool_output[Start/8][Start%8] = value;
-		}
-		pthread_mutex_unlock(&bufferLock);
-	}
+	Start = word(request[8], request[9]);
+	uint16_t andMask = word(request[10], request[11]);
+	uint16_t orMask = word(request[12], request[13]);
 
-	else //invalid address
-	{
-		mb_error = ERR_ILLEGAL_DATA_ADDRESS;
-	}
+	struct image_write write;
+	mb_error = queueMappedWrites(&write, mapRegisterMaskWrite(Start, andMask, orMask, &write), 1);
 
 	if (mb_error != ERR_NONE)
 	{
-		ModbusError(buffer, mb_error);
-	}
-	else
-	{
-		buffer[4] = 0;
-		buffer[5] = 6; //Number of bytes after this one.
-		MessageLength = 12;
+		return ModbusError(request, response, mb_error);
 	}
+
+	//the response echoes the request
+	memcpy(response, request, 14);
+	response[4] = 0;
+	response[5] = 8; //Number of bytes after this one.
+	return 14;
 }
 
 //-----------------------------------------------------------------------------
-// Implementation of Modbus/TCP Write Holding Register
+// Implementation of Modbus/TCP Read/Write Multiple Registers. The writes are
+// queued as a single batch, applied at the start of the next scan, and the
+// registers read are the ones of the last scan with those writes applied.
+// That is what the program sees when the next scan starts
 //-----------------------------------------------------------------------------
-void WriteRegister(unsigned char *buffer, int bufferSize)
+int ReadWriteMultipleRegisters(const unsigned char *request, int requestSize, unsigned char *response)
 {
-	int Start;
+	int ReadStart, ReadDataLength, WriteStart, WriteDataLength;
 	int mb_error = ERR_NONE;
+	bool mapped;
 
-	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
-	if (bufferSize < 12)
+	//this request must have at least 17 bytes. If it doesn't, it's a corrupted message
+	if (requestSize < 17)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
-		return;
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
 
-	Start = word(buffer[8],buffer[9]);
+	ReadStart = word(request[8], request[9]);
+	ReadDataLength = word(request[10], request[11]);
+	WriteStart = word(request[12], request[13]);
+	WriteDataLength = word(request[14], request[15]);
 
-	pthread_mutex_lock(&bufferLock);
-	//analog outputs
-	if (Start <= MIN_16B_RANGE)
+	//quantities allowed by the spec, and all the bytes it wants to write
+	if (ReadDataLength < 1 || ReadDataLength > 125 || WriteDataLength < 1 || WriteDataLength > 121 ||
+		request[16] != WriteDataLength * 2 || requestSize < 17 + WriteDataLength * 2)
 	{
-		if (int_output[Start] != NULL)
-		{
-			*int_output[Start] = word(buffer[10],buffer[11]);
-		}
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
-	//accessing memory
-	//16-bit registers
-	else if (Start >= MIN_16B_RANGE && Start <= MAX_16B_RANGE)
+
+	struct image_write writes[121];
+	int writeCount = mapRegisterWrites(WriteStart, WriteDataLength, &request[17], writes);
+	if (writeCount < 0)
 	{
-		if (int_memory[Start - MIN_16B_RANGE] != NULL)
-		{
-			*int_memory[Start - MIN_16B_RANGE] = word(buffer[10],buffer[11]);
-		}
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_ADDRESS);
 	}
-	//32-bit registers
-	else if (Start >= MIN_32B_RANGE && Start <= MAX_32B_RANGE)
-	{
-		if (dint_memory[(Start - MIN_32B_RANGE)/2] != NULL)
-		{
-			uint32_t tempValue = (uint32_t)word(buffer[10],buffer[11]);
 
-			if ((Start - MIN_32B_RANGE) % 2 == 0) //first word
-			{
-				*dint_memory[(Start - MIN_32B_RANGE) / 2] = *dint_memory[(Start - MIN_32B_RANGE) / 2] & 0x0000ffff;
-				*dint_memory[(Start - MIN_32B_RANGE) / 2] = *dint_memory[(Start - MIN_32B_RANGE) / 2] | (tempValue << 16);
-			}
-			else //second word
-			{
-				*dint_memory[(Start - MIN_32B_RANGE) / 2] = *dint_memory[(Start - MIN_32B_RANGE) / 2] & 0xffff0000;
-				*dint_memory[(Start - MIN_32B_RANGE) / 2] = *dint_memory[(Start - MIN_32B_RANGE) / 2] | tempValue;
-			}
-		}
-		else
-		{
-			mb_holding_regs[Start] = word(buffer[10],buffer[11]);
-		}
-	}
-	//64-bit registers
-	else if (Start >= MIN_64B_RANGE && Start <= MAX_64B_RANGE)
+	//preparing response
+	memcpy(response, request, 8);
+	response[4] = 0;
+	response[5] = ReadDataLength * 2 + 3; //Number of bytes after this one
+	response[8] = ReadDataLength * 2;     //Number of bytes of data
+
+	const struct process_image *image;
+	unsigned int snapshot;
+	do
 	{
-		if (lint_memory[(Start - MIN_64B_RANGE)/4] != NULL)
-		{
-			uint64_t tempValue = (uint64_t)word(buffer[10],buffer[11]);
+		snapshot = beginSnapshotRead(&image);
+		mapped = readModbusRegisters(MB_TABLE_HOLDING_REGISTERS, image, ReadStart, ReadDataLength, &response[9],
+									 writes, writeCount);
+	} while (!endSnapshotRead(snapshot));
 
-			if ((Start - MIN_64B_RANGE) % 4 == 0) //first word
-			{
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] & 0x0000ffffffffffff;
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] | (tempValue << 48);
-			}
-			else if ((Start - MIN_64B_RANGE) % 4 == 1) //second word
-			{
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] & 0xffff0000ffffffff;
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] | (tempValue << 32);
-			}
-			else if ((Start - MIN_64B_RANGE) % 4 == 2) //third word
-			{
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] & 0xffffffff0000ffff;
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] | (tempValue << 16);
-			}
-			else if ((Start - MIN_64B_RANGE) % 4 == 3) //fourth word
-			{
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] & 0xffffffffffff0000;
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] | tempValue;
-			}
-		}
-		else
-		{
-			mb_holding_regs[Start] = word(buffer[10],buffer[11]);
-		}
-	}
-	else //invalid address
+	//nothing is written if the read can't be done
+	if (!mapped)
 	{
 		mb_error = ERR_ILLEGAL_DATA_ADDRESS;
 	}
-	pthread_mutex_unlock(&bufferLock);
-
-	if (mb_error != ERR_NONE)
+	else
 	{
-		ModbusError(buffer, mb_error);
+		mb_error = queueMappedWrites(writes, writeCount, 121);
 	}
-	else
+
+	if (mb_error != ERR_NONE)
 	{
-		buffer[4] = 0;
-		buffer[5] = 6; //Number of bytes after this one.
-		MessageLength = 12;
+		return ModbusError(request, response, mb_error);
 	}
+
+	return ReadDataLength * 2 + 9;
 }
 
 //-----------------------------------------------------------------------------
-// Implementation of Modbus/TCP Write Multiple Coils
+// Implementation of Modbus/TCP Read Device Identification (function 43, MEI
+// type 14). All objects fit on a single response, so there is never more to
+// follow
 //-----------------------------------------------------------------------------
-void WriteMultipleCoils(unsigned char *buffer, int bufferSize)
+int ReadDeviceIdentification(const unsigned char *request, int requestSize, unsigned char *response)
 {
-	int Start, ByteDataLength, CoilDataLength;
-	int mb_error = ERR_NONE;
-
-	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
-	if (bufferSize < 12)
+	//this request must have 11 bytes. If it doesn't, it's a corrupted message
+	if (requestSize < 11)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
-		return;
+		return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
 
-	Start = word(buffer[8],buffer[9]);
-	CoilDataLength = word(buffer[10],buffer[11]);
-	ByteDataLength = CoilDataLength / 8;
-	if(ByteDataLength * 8 < CoilDataLength) ByteDataLength++;
-
-	//this request must have all the bytes it wants to write. If it doesn't, it's a corrupted message
-	if ( (bufferSize < (13 + ByteDataLength)) || (buffer[12] != ByteDataLength) )
+	//no other MEI transport is supported
+	if (request[8] != MEI_READ_DEVICE_ID)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
-		return;
+		return ModbusError(request, response, ERR_ILLEGAL_FUNCTION);
 	}
 
-	//preparing response
-	buffer[4] = 0;
-	buffer[5] = 6; //Number of bytes after this one.
+	int code = request[9];
+	int object = request[10];
+	int first, last;
 
-	pthread_mutex_lock(&bufferLock);
-	for(int i = 0; i < ByteDataLength ; i++)
+	switch (code)
 	{
-		for(int j = 0; j < 8; j++)
-		{
-			int position = Start + i * 8 + j;
-			if (position < MAX_COILS)
-			{
-				if (bool_output[position/8][position%8] != NULL) *bool_output[position/8][position%8] = bitRead(buffer[13 + i], j);
-			}
-			else //invalid address
+		case DEVICE_ID_BASIC:
+			first = object;
+			last = LAST_BASIC_OBJECT;
+			break;
+		case DEVICE_ID_REGULAR:
+		case DEVICE_ID_EXTENDED:
+			first = object;
+			last = NUM_DEVICE_ID_OBJECTS - 1;
+			break;
+		case DEVICE_ID_INDIVIDUAL:
+			if (object >= NUM_DEVICE_ID_OBJECTS)
 			{
-				mb_error = ERR_ILLEGAL_DATA_ADDRESS;
+				return ModbusError(request, response, ERR_ILLEGAL_DATA_ADDRESS);
 			}
-		}
+			first = last = object;
+			break;
+		default:
+			return ModbusError(request, response, ERR_ILLEGAL_DATA_VALUE);
 	}
-	pthread_mutex_unlock(&bufferLock);
 
-	if (mb_error != ERR_NONE)
-	{
-		ModbusError(buffer, mb_error);
-	}
-	else
+	//a stream starting on an unknown object starts from the first one
+	if (first > last)
 	{
-		MessageLength = 12;
+		first = 0;
 	}
+
+	//preparing response
+	memcpy(response, request, 8);
+	response[8] = MEI_READ_DEVICE_ID;
+	response[9] = code;
+	response[10] = DEVICE_ID_CONFORMITY;
+	response[11] = 0; //more follows
+	response[12] = 0; //next object id
+	response[13] = last - first + 1;
+
+	int position = 14;
+	for (int i = first; i <= last; i++)
+	{
+		int length = strlen(device_id_objects[i]);
+		response[position++] = i;
+		response[position++] = length;
+		memcpy(&response[position], device_id_objects[i], length);
+		position += length;
+	}
+
+	response[4] = highByte(position - 6);
+	response[5] = lowByte(position - 6); //Number of bytes after this one
+	return position;
 }
 
 //-----------------------------------------------------------------------------
-// Implementation of Modbus/TCP Write Multiple Registers
+// Serves a read request (functions 1 to 4) from the response cache. Requests
+// for the same function, start and quantity that arrive while the same
+// snapshot is published get a copy of the response already encoded for it,
+// with the transaction and unit identifiers of the new request. Writes only
+// reach the snapshot at the end of the next scan, which also publishes a new
+// snapshot, so entries read from the image are never stale. The scan stats
+// registers are read live, and change between two snapshots, so reads that
+// include them are never cached. Returns the size of the response
 //-----------------------------------------------------------------------------
-void WriteMultipleRegisters(unsigned char *buffer, int bufferSize)
+int CachedRead(int (*read)(const unsigned char *, int, unsigned char *),
+			   const unsigned char *request, int requestSize, unsigned char *response)
 {
-	int Start, WordDataLength, ByteDataLength;
-	int mb_error = ERR_NONE;
-
-	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
-	if (bufferSize < 12)
+	if (requestSize < 12)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
-		return;
+		return read(request, requestSize, response);
 	}
 
-	Start = word(buffer[8],buffer[9]);
-	WordDataLength = word(buffer[10],buffer[11]);
-	ByteDataLength = WordDataLength * 2;
+	unsigned char function = request[7];
+	uint16_t start = word(request[8], request[9]);
+	uint16_t quantity = word(request[10], request[11]);
 
-	//this request must have all the bytes it wants to write. If it doesn't, it's a corrupted message
-	if ( (bufferSize < (13 + ByteDataLength)) || (buffer[12] != ByteDataLength) )
+	if (function == MB_FC_READ_INPUT_REGISTERS && mapsStatsRegisters(MB_TABLE_INPUT_REGISTERS, start, quantity))
 	{
-		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
-		return;
+		return read(request, requestSize, response);
 	}
 
-	//preparing response
-	buffer[4] = 0;
-	buffer[5] = 6; //Number of bytes after this one.
-
-	pthread_mutex_lock(&bufferLock);
-	for(int i = 0; i < WordDataLength; i++)
-	{
-		int position = Start + i;
-		//analog outputs
-		if (position <= MIN_16B_RANGE)
-		{
-			if (int_output[position] != NULL) *int_output[position] =  word(buffer[13 + i * 2], buffer[14 + i * 2]);
-		}
-		//accessing memory
-		//16-bit registers
-		else if (position >= MIN_16B_RANGE && position <= MAX_16B_RANGE)
-		{
-			if (int_memory[position - MIN_16B_RANGE] != NULL) *int_memory[position - MIN_16B_RANGE] = word(buffer[13 + i * 2], buffer[14 + i * 2]);
-		}
-		//32-bit registers
-		else if (position >= MIN_32B_RANGE && position <= MAX_32B_RANGE)
-		{
-			if (dint_memory[(Start - MIN_32B_RANGE)/2] != NULL)
-			{
-				uint32_t tempValue = (uint32_t)word(buffer[13 + i * 2], buffer[14 + i * 2]);
-
-				if ((position - MIN_32B_RANGE) % 2 == 0) //first word
-				{
-					*dint_memory[(position - MIN_32B_RANGE) / 2] = *dint_memory[(position - MIN_32B_RANGE) / 2] & 0x0000ffff;
-					*dint_memory[(position - MIN_32B_RANGE) / 2] = *dint_memory[(position - MIN_32B_RANGE) / 2] | (tempValue << 16);
-				}
-				else //second word
-				{
-					*dint_memory[(position - MIN_32B_RANGE) / 2] = *dint_memory[(position - MIN_32B_RANGE) / 2] & 0xffff0000;
-					*dint_memory[(position - MIN_32B_RANGE) / 2] = *dint_memory[(position - MIN_32B_RANGE) / 2] | tempValue;
-				}
-			}
-			else
-			{
-				mb_holding_regs[position] = word(buffer[13 + i * 2], buffer[14 + i * 2]);
-			}
-		}
-		//64-bit registers
-		else if (position >= MIN_64B_RANGE && position <= MAX_64B_RANGE)
-		{
-			if (lint_memory[(position - MIN_64B_RANGE)/4] != NULL)
-			{
-				uint64_t tempValue = (uint64_t)word(buffer[13 + i * 2], buffer[14 + i * 2]);
-
-				if ((position - MIN_64B_RANGE) % 4 == 0) //first word
-				{
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] & 0x0000ffffffffffff;
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] | (tempValue << 48);
-				}
-				else if ((Start - MIN_64B_RANGE) % 4 == 1) //second word
-				{
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] & 0xffff0000ffffffff;
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] | (tempValue << 32);
-				}
-				else if ((Start - MIN_64B_RANGE) % 4 == 2) //third word
-				{
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] & 0xffffffff0000ffff;
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] | (tempValue << 16);
-				}
-				else if ((Start - MIN_64B_RANGE) % 4 == 3) //fourth word
-				{
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] & 0xffffffffffff0000;
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] | tempValue;
-				}
-			}
-			else
-			{
-				mb_holding_regs[Start] = word(buffer[10],buffer[11]);
-			}
-		}
-		else //invalid address
-		{
-			mb_error = ERR_ILLEGAL_DATA_ADDRESS;
-		}
-	}
-	pthread_mutex_unlock(&bufferLock);
+	//a token is never 0, as the first snapshot is published at startup
+	const struct process_image *image;
+	unsigned int snapshot = beginSnapshotRead(&image);
 
-	if (mb_error != ERR_NONE)
+	unsigned int slot = (start * 31 + quantity * 7 + function) & (RESPONSE_CACHE_SIZE - 1);
+	struct cached_response *entry = &response_cache[slot];
+
+	if (entry->snapshot == snapshot && entry->function == function &&
+		entry->start == start && entry->quantity == quantity)
 	{
-		ModbusError(buffer, mb_error);
+		memcpy(response, entry->response, entry->length);
+		response[0] = request[0];	//transaction identifier
+		response[1] = request[1];
+		response[6] = request[6];	//unit identifier
+		return entry->length;
 	}
-	else
+
+	int length = read(request, requestSize, response);
+
+	//the read may have used a newer snapshot, which is fine: the entry won't
+	//match again once a newer snapshot than the one it is tagged with is out
+	if (response[7] == function)
 	{
-		MessageLength = 12;
+		entry->snapshot = snapshot;
+		entry->function = function;
+		entry->start = start;
+		entry->quantity = quantity;
+		entry->length = length;
+		memcpy(entry->response, response, length);
 	}
+
+	return length;
 }
 
 //-----------------------------------------------------------------------------
-// This function must parse and process the client request and write back the
-// response for it. The return value is the size of the response message in
-// bytes.
+// Finds the first request on a stream of bytes received from a client. Returns
+// the size of the request if it was received completely, 0 if more bytes are
+// needed, or -1 if the stream doesn't hold a valid MBAP header, in which case
+// the connection must be closed
 //-----------------------------------------------------------------------------
-int processModbusMessage(unsigned char *buffer, int bufferSize)
+int frameModbusRequest(const unsigned char *buffer, int bufferSize)
 {
-	MessageLength = 0;
+	if (bufferSize < MBAP_HEADER_SIZE) return 0;
+
+	int protocol = word(buffer[2], buffer[3]);
+	int length = word(buffer[4], buffer[5]);
+	if (protocol != 0 || length < MIN_MBAP_LENGTH || length > MAX_MBAP_LENGTH) return -1;
+	if (bufferSize < MBAP_HEADER_SIZE + length) return 0;
+
+	return MBAP_HEADER_SIZE + length;
+}
 
+//-----------------------------------------------------------------------------
+// This function must parse and process one client request, framed by
+// frameModbusRequest(), and write the response for it on response, which
+// must have room for MAX_MODBUS_RESPONSE bytes. The return value is the size
+// of the response message in bytes.
+//-----------------------------------------------------------------------------
+int processModbusRequest(const unsigned char *request, int requestSize, unsigned char *response)
+{
 	//check if the message is long enough
-	if (bufferSize < 8)
+	if (requestSize < 8)
 	{
-		ModbusError(buffer, ERR_ILLEGAL_FUNCTION);
+		return ModbusError(request, response, ERR_ILLEGAL_FUNCTION);
 	}
 
-	//****************** Read Coils **********************
-	else if(buffer[7] == MB_FC_READ_COILS)
+	switch (request[7])
 	{
-		ReadCoils(buffer, bufferSize);
-	}
+		//****************** Read Coils **********************
+		case MB_FC_READ_COILS:
+			return CachedRead(ReadCoils, request, requestSize, response);
 
-	//*************** Read Discrete Inputs ***************
-	else if(buffer[7] == MB_FC_READ_INPUTS)
-	{
-		ReadDiscreteInputs(buffer, bufferSize);
-	}
+		//*************** Read Discrete Inputs ***************
+		case MB_FC_READ_INPUTS:
+			return CachedRead(ReadDiscreteInputs, request, requestSize, response);
 
-	//****************** Read Holding Registers ******************
-	else if(buffer[7] == MB_FC_READ_HOLDING_REGISTERS)
-	{
-		ReadHoldingRegisters(buffer, bufferSize);
-	}
+		//****************** Read Holding Registers ******************
+		case MB_FC_READ_HOLDING_REGISTERS:
+			return CachedRead(ReadHoldingRegisters, request, requestSize, response);
 
-	//****************** Read Input Registers ******************
-	else if(buffer[7] == MB_FC_READ_INPUT_REGISTERS)
-	{
-		ReadInputRegisters(buffer, bufferSize);
-	}
+		//****************** Read Input Registers ******************
+		case MB_FC_READ_INPUT_REGISTERS:
+			return CachedRead(ReadInputRegisters, request, requestSize, response);
 
-	//****************** Write Coil **********************
-	else if(buffer[7] == MB_FC_WRITE_COIL)
-	{
-		WriteCoil(buffer, bufferSize);
-	}
+		//****************** Write Coil **********************
+		case MB_FC_WRITE_COIL:
+			return WriteCoil(request, requestSize, response);
 
-	//****************** Write Register ******************
-	else if(buffer[7] == MB_FC_WRITE_REGISTER)
-	{
-		WriteRegister(buffer, bufferSize);
-	}
+		//****************** Write Register ******************
+		case MB_FC_WRITE_REGISTER:
+			return WriteRegister(request, requestSize, response);
 
-	//****************** Write Multiple Coils **********************
-	else if(buffer[7] == MB_FC_WRITE_MULTIPLE_COILS)
-	{
-		WriteMultipleCoils(buffer, bufferSize);
-	}
+		//****************** Write Multiple Coils **********************
+		case MB_FC_WRITE_MULTIPLE_COILS:
+			return WriteMultipleCoils(request, requestSize, response);
 
-	//****************** Write Multiple Registers ******************
-	else if(buffer[7] == MB_FC_WRITE_MULTIPLE_REGISTERS)
-	{
-		WriteMultipleRegisters(buffer, bufferSize);
-	}
+		//****************** Write Multiple Registers ******************
+		case MB_FC_WRITE_MULTIPLE_REGISTERS:
+			return WriteMultipleRegisters(request, requestSize, response);
 
-	//****************** Function Code Error ******************
-	else
-	{
-		ModbusError(buffer, ERR_ILLEGAL_FUNCTION);
-	}
+		//****************** Mask Write Register ******************
+		case MB_FC_MASK_WRITE_REGISTER:
+			return MaskWriteRegister(request, requestSize, response);
+
+		//************* Read/Write Multiple Registers *************
+		case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+			return ReadWriteMultipleRegisters(request, requestSize, response);
 
-	return MessageLength;
+		//************ Read Device Identification ****************
+		case MB_FC_ENCAPSULATED_INTERFACE:
+			return ReadDeviceIdentification(request, requestSize, response);
+
+		//****************** Function Code Error ******************
+		default:
+			return ModbusError(request, response, ERR_ILLEGAL_FUNCTION);
+	}
 }
@@ -0,0 +1,594 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file maps the Modbus address space onto the process image. Each of
+// the four Modbus tables (coils, discrete inputs, holding registers and input
+// registers) is a sorted list of segments, and each segment maps a range of
+// Modbus addresses onto consecutive located variables of the same kind. A
+// request is served by finding the segment of its first address and copying
+// whole segments from there, instead of deciding where every address goes.
+//
+// The map is built once at startup, before the protocol servers start, and
+// is never changed afterwards, so it is read without any lock. The default
+// map is the one the OpenPLC always had:
+//
+//   coils               0 - 799     %QX0.0 - %QX99.7
+//   discrete inputs     0 - 799     %IX0.0 - %IX99.7
+//   holding registers   0 - 1023    %QW0 - %QW1023
+//                       1024 - 2047 %MW0 - %MW1023
+//                       2048 - 4095 %MD0 - %MD1023 (2 registers each)
+//                       4096 - 8191 %ML0 - %ML1023 (4 registers each)
+//   input registers     0 - 1023    %IW0 - %IW1023
+//                       1024 - 1279 scan stats (see telemetry.cpp)
+//
+// MB_MAP_FILE can add segments to the default map, or replace it, so any
+// located variable can be exposed at any Modbus address. Registers wider
+// than 16 bits are sent with the highest word first.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "ladder.h"
+
+//Opened on the directory the runtime is started from (the OpenPLC folder,
+//next to dnp3.cfg), like the other configuration files
+#define MB_MAP_FILE             "mbmap.cfg"
+#define MAX_MAP_SEGMENTS        256
+
+//Not a process image area. The segment reads the scan stats registers
+#define MAP_AREA_STATS          255
+
+struct map_segment
+{
+    int first;              //first and last Modbus address of the segment
+    int last;
+    uint8_t area;           //IMAGE_* area, or MAP_AREA_STATS
+    uint8_t width;          //registers per variable (1, 2 or 4). 0 for booleans
+    int index;              //first variable. For booleans, byte * 8 + bit
+    size_t offset;          //offset of the area on struct process_image
+};
+
+struct map_table
+{
+    const char *name;       //name used on MB_MAP_FILE
+    bool registers;
+    struct map_segment segments[MAX_MAP_SEGMENTS];
+    int count;
+};
+
+static struct map_table map_tables[MB_NUM_TABLES] =
+{
+    {"coils", false, {}, 0},
+    {"discrete_inputs", false, {}, 0},
+    {"holding_registers", true, {}, 0},
+    {"input_registers", true, {}, 0},
+};
+
+//Located variable kinds that can be mapped
+struct map_area
+{
+    const char *prefix;
+    uint8_t area;
+    uint8_t width;
+    size_t offset;
+};
+
+static const struct map_area map_areas[] =
+{
+    {"%IX", IMAGE_BOOL_INPUT, 0, offsetof(struct process_image, bool_input)},
+    {"%QX", IMAGE_BOOL_OUTPUT, 0, offsetof(struct process_image, bool_output)},
+    {"%IW", IMAGE_INT_INPUT, 1, offsetof(struct process_image, int_input)},
+    {"%QW", IMAGE_INT_OUTPUT, 1, offsetof(struct process_image, int_output)},
+    {"%MW", IMAGE_INT_MEMORY, 1, offsetof(struct process_image, int_memory)},
+    {"%MD", IMAGE_DINT_MEMORY, 2, offsetof(struct process_image, dint_memory)},
+    {"%ML", IMAGE_LINT_MEMORY, 4, offsetof(struct process_image, lint_memory)},
+};
+
+#define NUM_MAP_AREAS   (int)(sizeof(map_areas) / sizeof(map_areas[0]))
+
+//-----------------------------------------------------------------------------
+// Adds a segment to a table. The tables are sorted once all segments are in
+//-----------------------------------------------------------------------------
+static bool addSegment(int table, int first, int count, const struct map_area *area, int index)
+{
+    struct map_table *t = &map_tables[table];
+
+    if (t->count >= MAX_MAP_SEGMENTS)
+    {
+        printf("Modbus map: too many segments on %s\n", t->name);
+        return false;
+    }
+
+    struct map_segment *segment = &t->segments[t->count++];
+    segment->first = first;
+    segment->last = first + count * (area->width ? area->width : 1) - 1;
+    segment->area = area->area;
+    segment->width = area->width;
+    segment->index = index;
+    segment->offset = area->offset;
+
+    return true;
+}
+
+static void addStatsSegment(int first, int index, int count)
+{
+    static const struct map_area stats = {"", MAP_AREA_STATS, 1, 0};
+    addSegment(MB_TABLE_INPUT_REGISTERS, first, count, &stats, index);
+}
+
+static const struct map_area *findArea(const char *prefix)
+{
+    for (int i = 0; i < NUM_MAP_AREAS; i++)
+    {
+        if (!strcmp(map_areas[i].prefix, prefix)) return &map_areas[i];
+    }
+
+    return NULL;
+}
+
+static void addDefaultSegments()
+{
+    addSegment(MB_TABLE_COILS, 0, 800, findArea("%QX"), 0);
+    addSegment(MB_TABLE_DISCRETE_INPUTS, 0, 800, findArea("%IX"), 0);
+
+    addSegment(MB_TABLE_HOLDING_REGISTERS, 0, BUFFER_SIZE, findArea("%QW"), 0);
+    addSegment(MB_TABLE_HOLDING_REGISTERS, 1024, BUFFER_SIZE, findArea("%MW"), 0);
+    addSegment(MB_TABLE_HOLDING_REGISTERS, 2048, BUFFER_SIZE, findArea("%MD"), 0);
+    addSegment(MB_TABLE_HOLDING_REGISTERS, 4096, BUFFER_SIZE, findArea("%ML"), 0);
+
+    addSegment(MB_TABLE_INPUT_REGISTERS, 0, BUFFER_SIZE, findArea("%IW"), 0);
+    addStatsSegment(MIN_STATS_RANGE, 0, MAX_STATS_RANGE - MIN_STATS_RANGE + 1);
+}
+
+//-----------------------------------------------------------------------------
+// Parses a map entry such as table.address = "%MD10, 4", which maps 4
+// variables starting at %MD10 from the given Modbus address on. Returns
+// false if the entry is invalid
+//-----------------------------------------------------------------------------
+static bool parseMapEntry(const char *line, const char *value)
+{
+    int table;
+    for (table = 0; table < MB_NUM_TABLES; table++)
+    {
+        int len = strlen(map_tables[table].name);
+        if (!strncmp(line, map_tables[table].name, len) && line[len] == '.') break;
+    }
+    if (table == MB_NUM_TABLES) return false;
+
+    int first = atoi(line + strlen(map_tables[table].name) + 1);
+    int count = 1;
+    const char *separator = strchr(value, ',');
+    if (separator != NULL) count = atoi(separator + 1);
+    if (first < 0 || count <= 0) return false;
+
+    //the scan stats can only be read as input registers
+    if (!strncmp(value, "scan_stats", 10))
+    {
+        int index = (value[10] == '+') ? atoi(value + 11) : 0;
+        if (table != MB_TABLE_INPUT_REGISTERS || index < 0 ||
+            index + count > MAX_STATS_RANGE - MIN_STATS_RANGE + 1 || first + count > 65536) return false;
+
+        addStatsSegment(first, index, count);
+        return true;
+    }
+
+    char prefix[4];
+    strncpy(prefix, value, 3);
+    prefix[3] = '\0';
+    const struct map_area *area = findArea(prefix);
+    if (area == NULL || (area->width != 0) != map_tables[table].registers) return false;
+
+    int index, limit;
+    if (area->width == 0)
+    {
+        int byte, bit;
+        if (sscanf(value + 3, "%d.%d", &byte, &bit) != 2 || bit < 0 || bit > 7) return false;
+        index = byte * 8 + bit;
+        limit = BUFFER_SIZE * 8;
+    }
+    else
+    {
+        if (sscanf(value + 3, "%d", &index) != 1) return false;
+        limit = BUFFER_SIZE;
+    }
+    if (index < 0 || index + count > limit) return false;
+    if (first + count * (area->width ? area->width : 1) > 65536) return false;
+
+    return addSegment(table, first, count, area, index);
+}
+
+static int compareSegments(const void *a, const void *b)
+{
+    return ((const struct map_segment *)a)->first - ((const struct map_segment *)b)->first;
+}
+
+//-----------------------------------------------------------------------------
+// Sorts every table and drops the segments that overlap the previous one.
+// Returns the number of segments dropped
+//-----------------------------------------------------------------------------
+static int sortTables()
+{
+    int dropped = 0;
+
+    for (int table = 0; table < MB_NUM_TABLES; table++)
+    {
+        struct map_table *t = &map_tables[table];
+        qsort(t->segments, t->count, sizeof(struct map_segment), compareSegments);
+
+        int kept = 0;
+        for (int i = 0; i < t->count; i++)
+        {
+            if (kept > 0 && t->segments[i].first <= t->segments[kept - 1].last)
+            {
+                printf("Modbus map: %s %d-%d overlaps %d-%d and was ignored\n", t->name,
+                       t->segments[i].first, t->segments[i].last,
+                       t->segments[kept - 1].first, t->segments[kept - 1].last);
+                dropped++;
+                continue;
+            }
+            t->segments[kept++] = t->segments[i];
+        }
+        t->count = kept;
+    }
+
+    return dropped;
+}
+
+//-----------------------------------------------------------------------------
+// Builds the Modbus map from MB_MAP_FILE. Lines look like
+// table.address = "variable, count". Without the file, or with
+// defaults = "true" on it, the default map is also used. Must be called
+// before the protocol servers start
+//-----------------------------------------------------------------------------
+void loadModbusMap()
+{
+    char line[1024];
+    char value[64];
+    bool defaults = true;
+    FILE *cfgfile = fopen(MB_MAP_FILE, "r");
+
+    if (cfgfile != NULL)
+    {
+        printf("Reading Modbus map from %s\n", MB_MAP_FILE);
+        while (fgets(line, sizeof(line), cfgfile) != NULL)
+        {
+            if (line[0] == '#' || strlen(line) <= 1) continue;
+
+            //value between the quotes
+            const char *start = strchr(line, '"');
+            value[0] = '\0';
+            if (start != NULL)
+            {
+                int i = 0;
+                start++;
+                while (start[i] != '"' && start[i] != '\0' && i < (int)sizeof(value) - 1)
+                {
+                    value[i] = start[i];
+                    i++;
+                }
+                value[i] = '\0';
+            }
+
+            if (!strncmp(line, "defaults", 8))
+            {
+                defaults = !strcmp(value, "true");
+            }
+            else if (!parseMapEntry(line, value))
+            {
+                printf("Modbus map: invalid entry %s", line);
+            }
+        }
+        fclose(cfgfile);
+    }
+    else
+    {
+        printf("No Modbus map (%s). Using the default map\n", MB_MAP_FILE);
+    }
+
+    if (defaults) addDefaultSegments();
+    sortTables();
+
+    for (int table = 0; table < MB_NUM_TABLES; table++)
+    {
+        printf("Modbus map: %d segments on %s\n", map_tables[table].count, map_tables[table].name);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Finds the segment that holds a Modbus address. Returns NULL if the address
+// is not mapped
+//-----------------------------------------------------------------------------
+static const struct map_segment *findSegment(const struct map_table *t, int address)
+{
+    int low = 0, high = t->count - 1;
+
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        const struct map_segment *segment = &t->segments[middle];
+
+        if (address < segment->first) high = middle - 1;
+        else if (address > segment->last) low = middle + 1;
+        else return segment;
+    }
+
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Calls copy for each piece of the range [start, start + count), with the
+// segment that maps it and the offset of the piece on the segment. Returns
+// false, before calling copy at all, if any address in the range is not
+// mapped
+//-----------------------------------------------------------------------------
+template <typename Copy>
+static bool forEachSegment(int table, int start, int count, Copy copy)
+{
+    const struct map_table *t = &map_tables[table];
+    const struct map_segment *first = findSegment(t, start);
+    const struct map_segment *end = t->segments + t->count;
+    int last = start + count - 1;
+
+    if (count <= 0) return true;
+    if (first == NULL) return false;
+
+    //segments are sorted, so the range must continue on the next ones
+    const struct map_segment *segment = first;
+    while (segment->last < last)
+    {
+        if (segment + 1 == end || segment[1].first != segment->last + 1) return false;
+        segment++;
+    }
+
+    int done = 0;
+    for (segment = first; done < count; segment++)
+    {
+        int offset = start + done - segment->first;
+        int length = segment->last - (start + done) + 1;
+        if (length > count - done) length = count - done;
+
+        copy(segment, offset, length, done);
+        done += length;
+    }
+
+    return true;
+}
+
+static inline const void *areaPointer(const struct process_image *image, const struct map_segment *segment)
+{
+    return (const char *)image + segment->offset;
+}
+
+//-----------------------------------------------------------------------------
+// Reads count bits from a coil or discrete input table into dest, packed
+// the way Modbus sends them (first bit on the lowest bit of the first
+// byte). Returns false if any address is not mapped
+//-----------------------------------------------------------------------------
+bool readModbusBits(int table, const struct process_image *image, int start, int count, unsigned char *dest)
+{
+    memset(dest, 0, (count + 7) / 8);
+
+    return forEachSegment(table, start, count,
+        [&](const struct map_segment *segment, int offset, int length, int done)
+        {
+            const IEC_BOOL *bits = (const IEC_BOOL *)areaPointer(image, segment) + segment->index + offset;
+            packBits(bits, length, dest, done);
+        });
+}
+
+//-----------------------------------------------------------------------------
+// Tells if a range of registers includes scan stats registers, which are
+// read live and not from the process image snapshot
+//-----------------------------------------------------------------------------
+bool mapsStatsRegisters(int table, int start, int count)
+{
+    bool stats = false;
+    forEachSegment(table, start, count,
+        [&](const struct map_segment *segment, int offset, int length, int done)
+        {
+            if (segment->area == MAP_AREA_STATS) stats = true;
+        });
+
+    return stats;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the value of a variable with the pending writes applied to it
+//-----------------------------------------------------------------------------
+static uint64_t applyPendingWrites(uint64_t value, const struct map_segment *segment, int element,
+                                   const struct image_write *pending, int pendingCount)
+{
+    for (int i = 0; i < pendingCount; i++)
+    {
+        if (pending[i].area == segment->area && pending[i].index == element)
+        {
+            value = (value & ~pending[i].mask) | (pending[i].value & pending[i].mask);
+        }
+    }
+
+    return value;
+}
+
+//-----------------------------------------------------------------------------
+// Reads count registers from a holding or input register table into dest,
+// in network byte order. Returns false if any address is not mapped. The
+// registers are read as if the pending writes, which were not queued yet,
+// had already been applied to the image
+//-----------------------------------------------------------------------------
+bool readModbusRegisters(int table, const struct process_image *image, int start, int count, unsigned char *dest,
+                         const struct image_write *pending, int pendingCount)
+{
+    return forEachSegment(table, start, count,
+        [&](const struct map_segment *segment, int offset, int length, int done)
+        {
+            unsigned char *out = dest + done * 2;
+
+            if (segment->area == MAP_AREA_STATS)
+            {
+                IEC_UINT stats[MAX_STATS_RANGE - MIN_STATS_RANGE + 1];
+                readScanStatsRegisters(segment->index + offset, length, stats);
+                for (int i = 0; i < length; i++)
+                {
+                    *out++ = stats[i] >> 8;
+                    *out++ = stats[i] & 0xff;
+                }
+                return;
+            }
+
+            const void *area = areaPointer(image, segment);
+            int element = segment->index + offset / segment->width;
+            int word = offset % segment->width;
+
+            //only the first variable may start halfway, and only the
+            //last one may end halfway
+            while (length > 0)
+            {
+                uint64_t value;
+                if (segment->width == 1) value = ((const IEC_UINT *)area)[element];
+                else if (segment->width == 2) value = (uint32_t)((const IEC_DINT *)area)[element];
+                else value = (uint64_t)((const IEC_LINT *)area)[element];
+                if (pendingCount > 0) value = applyPendingWrites(value, segment, element, pending, pendingCount);
+
+                for (; word < segment->width && length > 0; word++, length--)
+                {
+                    uint16_t part = (uint16_t)(value >> ((segment->width - 1 - word) * 16));
+                    *out++ = part >> 8;
+                    *out++ = part & 0xff;
+                }
+                word = 0;
+                element++;
+            }
+        });
+}
+
+//-----------------------------------------------------------------------------
+// Builds the image writes for count coils, packed the way Modbus sends them.
+// Coils on the same byte address share a write. Returns the number of writes,
+// -1 if any coil is not mapped or max_writes + 1 if there are more writes
+// than fit on writes
+//-----------------------------------------------------------------------------
+int mapCoilWrites(int start, int count, const unsigned char *bits, struct image_write *writes, int max_writes)
+{
+    int writeCount = 0;
+
+    bool mapped = forEachSegment(MB_TABLE_COILS, start, count,
+        [&](const struct map_segment *segment, int offset, int length, int done)
+        {
+            for (int i = 0; i < length && writeCount <= max_writes; )
+            {
+                int position = segment->index + offset + i;
+                int bit = done + i;
+                struct image_write *write = (writeCount > 0) ? &writes[writeCount - 1] : NULL;
+
+                if (write == NULL || write->area != segment->area || write->index != position / 8)
+                {
+                    if (writeCount == max_writes)
+                    {
+                        writeCount = max_writes + 1;
+                        return;
+                    }
+                    write = &writes[writeCount++];
+                    write->area = segment->area;
+                    write->index = position / 8;
+                    write->mask = 0;
+                    write->value = 0;
+                }
+
+                //a whole byte address is spread into its lanes at once
+                if (position % 8 == 0 && length - i >= 8)
+                {
+                    unsigned int byte = bits[bit / 8] >> (bit % 8);
+                    if (bit % 8) byte |= bits[bit / 8 + 1] << (8 - bit % 8);
+                    write->mask = ~(uint64_t)0;
+                    write->value = unpackByteLanes(byte);
+                    i += 8;
+                    continue;
+                }
+
+                int lane = (position % 8) * 8;
+                write->mask |= (uint64_t)0xff << lane;
+                write->value |= (uint64_t)((bits[bit / 8] >> (bit % 8)) & 1) << lane;
+                i++;
+            }
+        });
+
+    return mapped ? writeCount : -1;
+}
+
+//-----------------------------------------------------------------------------
+// Builds the image writes for count holding registers, in network byte
+// order. Registers of the same variable share a write, so a variable is
+// never seen half written. Returns the number of writes, or -1 if any
+// register is not mapped. writes must have room for count writes
+//-----------------------------------------------------------------------------
+int mapRegisterWrites(int start, int count, const unsigned char *data, struct image_write *writes)
+{
+    int writeCount = 0;
+
+    bool mapped = forEachSegment(MB_TABLE_HOLDING_REGISTERS, start, count,
+        [&](const struct map_segment *segment, int offset, int length, int done)
+        {
+            const unsigned char *in = data + done * 2;
+            int element = segment->index + offset / segment->width;
+            int word = offset % segment->width;
+
+            while (length > 0)
+            {
+                struct image_write *write = &writes[writeCount++];
+                write->area = segment->area;
+                write->index = element;
+                write->mask = 0;
+                write->value = 0;
+
+                for (; word < segment->width && length > 0; word++, length--)
+                {
+                    int shift = (segment->width - 1 - word) * 16;
+                    write->mask |= (uint64_t)0xffff << shift;
+                    write->value |= (uint64_t)((in[0] << 8) | in[1]) << shift;
+                    in += 2;
+                }
+                word = 0;
+                element++;
+            }
+        });
+
+    return mapped ? writeCount : -1;
+}
+
+//-----------------------------------------------------------------------------
+// Builds the image write for a mask write to a holding register: the bits set
+// on andMask are kept, and the others are taken from orMask. Returns 1, or -1
+// if the register is not mapped
+//-----------------------------------------------------------------------------
+int mapRegisterMaskWrite(int address, uint16_t andMask, uint16_t orMask, struct image_write *write)
+{
+    bool mapped = forEachSegment(MB_TABLE_HOLDING_REGISTERS, address, 1,
+        [&](const struct map_segment *segment, int offset, int length, int done)
+        {
+            int shift = (segment->width - 1 - offset % segment->width) * 16;
+            write->area = segment->area;
+            write->index = segment->index + offset / segment->width;
+            write->mask = (uint64_t)(uint16_t)~andMask << shift;
+            write->value = (uint64_t)(orMask & ~andMask & 0xffff) << shift;
+        });
+
+    return mapped ? 1 : -1;
+}
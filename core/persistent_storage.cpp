@@ -21,6 +21,7 @@
 //-----------------------------------------------------------------------------
 
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <pthread.h>
 
@@ -34,32 +35,33 @@
 void *persistentStorage(void *args)
 {
 	IEC_INT persistentBuffer[BUFFER_SIZE];
+	IEC_INT currentBuffer[BUFFER_SIZE];
+	const struct process_image *image;
+	unsigned int snapshot;
 
-	pthread_mutex_lock(&bufferLock); //lock mutex
-	for (int i = 0; i < BUFFER_SIZE; i++)
+	do
 	{
-		if (int_output[i] != NULL) persistentBuffer[i] = *int_output[i];
-	}
-	pthread_mutex_unlock(&bufferLock); //unlock mutex
+		snapshot = beginSnapshotRead(&image);
+		memcpy(persistentBuffer, image->int_output, sizeof(persistentBuffer));
+	} while (!endSnapshotRead(snapshot));
 
 	while (1)
 	{
 		//printf("checking data...\n");
 		bool bufferOutdated = false;
 
-		pthread_mutex_lock(&bufferLock); //lock mutex
-		for (int i = 0; i < BUFFER_SIZE; i++)
+		//read from the published snapshot, so the scan is never held
+		do
 		{
-			if (int_output[i] != NULL)
-			{
-				if (persistentBuffer[i] != *int_output[i])
-				{
-					persistentBuffer[i] = *int_output[i];
-					bufferOutdated = true;
-				}
-			}
+			snapshot = beginSnapshotRead(&image);
+			memcpy(currentBuffer, image->int_output, sizeof(currentBuffer));
+		} while (!endSnapshotRead(snapshot));
+
+		if (memcmp(persistentBuffer, currentBuffer, sizeof(persistentBuffer)) != 0)
+		{
+			memcpy(persistentBuffer, currentBuffer, sizeof(persistentBuffer));
+			bufferOutdated = true;
 		}
-		pthread_mutex_unlock(&bufferLock); //unlock mutex
 
 		if (bufferOutdated)
 		{
@@ -102,9 +104,6 @@ int readPersistentStorage()
 	fclose(fd);
 
 	pthread_mutex_lock(&bufferLock); //lock mutex
-	for (int i = 0; i < BUFFER_SIZE; i++)
-	{
-		if (int_output[i] != NULL) *int_output[i] = persistentBuffer[i];
-	}
+	memcpy(int_output, persistentBuffer, sizeof(persistentBuffer));
 	pthread_mutex_unlock(&bufferLock); //unlock mutex
 }
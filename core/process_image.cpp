@@ -0,0 +1,308 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file shares the process image between the scan thread and the
+// protocol servers without making the scan wait for them.
+//
+// At the end of every scan the image is copied into one of two snapshot
+// buffers, which is then published. Readers copy what they need from the
+// published buffer and retry if the scan thread reused it while they were
+// reading (only possible if a reader takes longer than a whole scan).
+//
+// Writes from the protocols go into a bounded lock-free queue, which the
+// scan thread applies at the start of the next scan (or a SINGLE task
+// applies as soon as it wakes up). A batch of writes queued with a single
+// call is always applied at once.
+//
+// The buffers of the process image are defined here, and not on the
+// generated glue, so they stay in place when the PLC program is replaced.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ladder.h"
+
+#define WRITE_QUEUE_SIZE        1024    //must be a power of 2
+
+//Booleans
+IEC_BOOL bool_input[BUFFER_SIZE][8];
+IEC_BOOL bool_output[BUFFER_SIZE][8];
+
+//Bytes
+IEC_BYTE byte_input[BUFFER_SIZE];
+IEC_BYTE byte_output[BUFFER_SIZE];
+
+//Analog I/O
+IEC_UINT int_input[BUFFER_SIZE];
+IEC_UINT int_output[BUFFER_SIZE];
+
+//Memory
+IEC_UINT int_memory[BUFFER_SIZE];
+IEC_DINT dint_memory[BUFFER_SIZE];
+IEC_LINT lint_memory[BUFFER_SIZE];
+
+struct write_slot
+{
+    volatile unsigned int sequence;     //position + 1 when the slot is ready
+    struct image_write write;
+};
+
+static struct process_image snapshots[2];
+static volatile unsigned int snapshot_sequence[2];
+static volatile unsigned int published_snapshot = 0;
+
+static struct write_slot write_queue[WRITE_QUEUE_SIZE];
+static volatile unsigned int enqueue_position = 0;
+static volatile unsigned int dequeue_position = 0;
+
+//-----------------------------------------------------------------------------
+// Copies the live process image into copy. Must be called with bufferLock
+// held
+//-----------------------------------------------------------------------------
+void saveProcessImage(struct process_image *copy)
+{
+    memcpy(copy->bool_input, bool_input, sizeof(bool_input));
+    memcpy(copy->bool_output, bool_output, sizeof(bool_output));
+    memcpy(copy->byte_input, byte_input, sizeof(byte_input));
+    memcpy(copy->byte_output, byte_output, sizeof(byte_output));
+    memcpy(copy->int_input, int_input, sizeof(int_input));
+    memcpy(copy->int_output, int_output, sizeof(int_output));
+    memcpy(copy->int_memory, int_memory, sizeof(int_memory));
+    memcpy(copy->dint_memory, dint_memory, sizeof(dint_memory));
+    memcpy(copy->lint_memory, lint_memory, sizeof(lint_memory));
+}
+
+//-----------------------------------------------------------------------------
+// Writes copy back into the live process image. Must be called with
+// bufferLock held
+//-----------------------------------------------------------------------------
+void restoreProcessImage(const struct process_image *copy)
+{
+    memcpy(bool_input, copy->bool_input, sizeof(bool_input));
+    memcpy(bool_output, copy->bool_output, sizeof(bool_output));
+    memcpy(byte_input, copy->byte_input, sizeof(byte_input));
+    memcpy(byte_output, copy->byte_output, sizeof(byte_output));
+    memcpy(int_input, copy->int_input, sizeof(int_input));
+    memcpy(int_output, copy->int_output, sizeof(int_output));
+    memcpy(int_memory, copy->int_memory, sizeof(int_memory));
+    memcpy(dint_memory, copy->dint_memory, sizeof(dint_memory));
+    memcpy(lint_memory, copy->lint_memory, sizeof(lint_memory));
+}
+
+//-----------------------------------------------------------------------------
+// Copies the process image into the snapshot buffer that is not published
+// and then publishes it. Must be called by the scan thread only
+//-----------------------------------------------------------------------------
+void publishImageSnapshot()
+{
+    unsigned int i = 1 - published_snapshot;
+
+    snapshot_sequence[i]++;
+    __sync_synchronize();
+
+    saveProcessImage(&snapshots[i]);
+
+    __sync_synchronize();
+    snapshot_sequence[i]++;
+    __sync_synchronize();
+    published_snapshot = i;
+}
+
+//-----------------------------------------------------------------------------
+// Starts reading the published snapshot. Returns a token that must be
+// passed to endSnapshotRead() once the reader is done with the snapshot
+//-----------------------------------------------------------------------------
+unsigned int beginSnapshotRead(const struct process_image **image)
+{
+    unsigned int i, sequence;
+
+    do
+    {
+        i = published_snapshot;
+        __sync_synchronize();
+        sequence = snapshot_sequence[i];
+    } while (sequence & 1);
+    __sync_synchronize();
+
+    *image = &snapshots[i];
+
+    //sequence is always even here, so the buffer index fits on the last bit
+    return sequence | i;
+}
+
+//-----------------------------------------------------------------------------
+// Finishes reading a snapshot. Returns false if the scan thread reused the
+// buffer in the meantime. In that case, whatever was read must be discarded
+// and the read must be started again
+//-----------------------------------------------------------------------------
+bool endSnapshotRead(unsigned int token)
+{
+    __sync_synchronize();
+    return snapshot_sequence[token & 1] == (token & ~1U);
+}
+
+//-----------------------------------------------------------------------------
+// Returns how many snapshots had been published when the snapshot of a
+// token was. Buffer 1 takes the odd ones and buffer 0 the even ones, and
+// each publish adds 2 to the sequence of its buffer
+//-----------------------------------------------------------------------------
+unsigned int snapshotNumber(unsigned int token)
+{
+    return (token & ~1U) - (token & 1);
+}
+
+//-----------------------------------------------------------------------------
+// Helper to take a full copy of the published snapshot. Returns the number
+// of the snapshot copied
+//-----------------------------------------------------------------------------
+unsigned int copyImageSnapshot(struct process_image *copy)
+{
+    const struct process_image *image;
+    unsigned int token;
+
+    do
+    {
+        token = beginSnapshotRead(&image);
+        memcpy(copy, image, sizeof(struct process_image));
+    } while (!endSnapshotRead(token));
+
+    return snapshotNumber(token);
+}
+
+//-----------------------------------------------------------------------------
+// Gives the published snapshot and the one published before it, and returns
+// the number of the published one. Must be called by the scan thread only,
+// which is the only one that changes the snapshots
+//-----------------------------------------------------------------------------
+unsigned int lastImageSnapshots(const struct process_image **current, const struct process_image **previous)
+{
+    unsigned int i = published_snapshot;
+
+    *current = &snapshots[i];
+    *previous = &snapshots[1 - i];
+    return snapshotNumber(snapshot_sequence[i] | i);
+}
+
+//-----------------------------------------------------------------------------
+// Queues a batch of writes to the process image. All writes on the batch
+// are applied on the same scan. Returns false if there is no room for the
+// batch on the queue. Safe to call from any thread
+//-----------------------------------------------------------------------------
+bool queueImageWrites(struct image_write *writes, int count)
+{
+    unsigned int position;
+
+    if (count <= 0) return true;
+    if (count > WRITE_QUEUE_SIZE) return false;
+
+    //reserve count consecutive slots
+    do
+    {
+        position = enqueue_position;
+        if (position + count - dequeue_position > WRITE_QUEUE_SIZE) return false;
+    } while (!__sync_bool_compare_and_swap(&enqueue_position, position, position + count));
+
+    for (int i = 0; i < count; i++)
+    {
+        write_queue[(position + i) & (WRITE_QUEUE_SIZE - 1)].write = writes[i];
+    }
+
+    //the first slot is released last, so the scan thread never sees only
+    //part of a batch
+    __sync_synchronize();
+    for (int i = count - 1; i >= 0; i--)
+    {
+        write_queue[(position + i) & (WRITE_QUEUE_SIZE - 1)].sequence = position + i + 1;
+        if (i == 1) __sync_synchronize();
+    }
+
+    notifyImageChange();
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Applies a single write to the process image
+//-----------------------------------------------------------------------------
+static void applyImageWrite(struct image_write *write)
+{
+    if (write->index >= BUFFER_SIZE) return;
+
+    switch (write->area)
+    {
+        case IMAGE_BOOL_INPUT:
+        case IMAGE_BOOL_OUTPUT:
+        {
+            //one byte lane per boolean
+            IEC_BOOL *row = (write->area == IMAGE_BOOL_INPUT) ? bool_input[write->index] : bool_output[write->index];
+            for (int i = 0; i < 8; i++)
+            {
+                if ((write->mask >> (i * 8)) & 0xff) row[i] = (write->value >> (i * 8)) & 0xff;
+            }
+            break;
+        }
+        case IMAGE_BYTE_INPUT:
+            byte_input[write->index] = (byte_input[write->index] & ~write->mask) | (write->value & write->mask);
+            break;
+        case IMAGE_BYTE_OUTPUT:
+            byte_output[write->index] = (byte_output[write->index] & ~write->mask) | (write->value & write->mask);
+            break;
+        case IMAGE_INT_INPUT:
+            int_input[write->index] = (int_input[write->index] & ~write->mask) | (write->value & write->mask);
+            break;
+        case IMAGE_INT_OUTPUT:
+            int_output[write->index] = (int_output[write->index] & ~write->mask) | (write->value & write->mask);
+            break;
+        case IMAGE_INT_MEMORY:
+            int_memory[write->index] = (int_memory[write->index] & ~write->mask) | (write->value & write->mask);
+            break;
+        case IMAGE_DINT_MEMORY:
+            dint_memory[write->index] = ((uint32_t)dint_memory[write->index] & ~write->mask) | (write->value & write->mask);
+            break;
+        case IMAGE_LINT_MEMORY:
+            lint_memory[write->index] = ((uint64_t)lint_memory[write->index] & ~write->mask) | (write->value & write->mask);
+            break;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Applies every write that is ready on the queue. Must be called with
+// bufferLock held. Returns the number of writes applied
+//-----------------------------------------------------------------------------
+int applyImageWrites()
+{
+    int applied = 0;
+    unsigned int position = dequeue_position;
+
+    while (1)
+    {
+        struct write_slot *slot = &write_queue[position & (WRITE_QUEUE_SIZE - 1)];
+        if (slot->sequence != position + 1) break;
+        __sync_synchronize();
+
+        applyImageWrite(&slot->write);
+        position++;
+        applied++;
+    }
+
+    __sync_synchronize();
+    dequeue_position = position;
+
+    return applied;
+}
@@ -0,0 +1,364 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file loads the PLC program. The compiled POUs and the glue are built
+// as a shared object (plc_program.so, next to the openplc executable), which
+// is opened with dlopen. The process image stays on the runtime, so the
+// located variables of the program point to the same buffers.
+//
+// Sending SIGUSR1 to the runtime loads plc_program.so again. The new program
+// is opened and resolved on a separate thread, and the main loop swaps it in
+// between two scans: the task threads are stopped, the new program is
+// initialized, the variables that have the same name and type on both
+// programs are copied over and the tasks start again. The process image,
+// the PLC time and the protocol connections are not touched, so the new
+// program takes over on the next scan.
+//
+// Builds without dlopen (Windows) define STATIC_PROGRAM and link the program
+// into the runtime. Those builds can't swap programs.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+
+#ifndef STATIC_PROGRAM
+#include <dlfcn.h>
+#endif
+
+#include "ladder.h"
+
+#define PROGRAM_FILE            "plc_program.so"
+#define PROGRAM_ENTRY           "plc_program_entry"
+
+struct loaded_program
+{
+    void *handle;
+    struct plc_program *program;
+};
+
+struct plc_program *plc_program = NULL;
+
+static struct loaded_program *running_program = NULL;
+
+//Handshake between the loader thread and the main loop. The loader publishes
+//the new program on pending_program and waits until the main loop hands the
+//program it replaced (or the rejected one) back on retired_program
+static pthread_mutex_t programLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t programSwapped = PTHREAD_COND_INITIALIZER;
+static struct loaded_program *volatile pending_program = NULL;
+static struct loaded_program *retired_program = NULL;
+
+//The new program is initialized over this copy of the process image, so its
+//initial values don't reach the located variables
+static struct process_image saved_image;
+
+#ifdef STATIC_PROGRAM
+extern "C" struct plc_program plc_program_entry;
+
+static struct loaded_program *openProgram()
+{
+    struct loaded_program *loaded = (struct loaded_program *)malloc(sizeof(struct loaded_program));
+    loaded->handle = NULL;
+    loaded->program = &plc_program_entry;
+
+    return loaded;
+}
+
+#else
+//-----------------------------------------------------------------------------
+// Finds the path of the program file, which is on the same directory as the
+// runtime executable
+//-----------------------------------------------------------------------------
+static void programPath(char *path, size_t size)
+{
+    char executable[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+
+    if (length <= 0)
+    {
+        snprintf(path, size, "%s", PROGRAM_FILE);
+        return;
+    }
+
+    executable[length] = '\0';
+    char *separator = strrchr(executable, '/');
+    if (separator != NULL) *separator = '\0';
+    snprintf(path, size, "%s/%s", executable, PROGRAM_FILE);
+}
+
+//-----------------------------------------------------------------------------
+// Copies the program file to a new file with a unique name. Returns false
+// if the copy failed
+//-----------------------------------------------------------------------------
+static bool copyProgramFile(const char *path, char *copy_path)
+{
+    FILE *source = fopen(path, "rb");
+    if (source == NULL) return false;
+
+    int fd = mkstemp(copy_path);
+    if (fd < 0)
+    {
+        fclose(source);
+        return false;
+    }
+
+    char buffer[16384];
+    size_t count;
+    bool ok = true;
+    while (ok && (count = fread(buffer, 1, sizeof(buffer), source)) > 0)
+    {
+        ok = (write(fd, buffer, count) == (ssize_t)count);
+    }
+    if (ferror(source)) ok = false;
+
+    fclose(source);
+    close(fd);
+    if (!ok) unlink(copy_path);
+
+    return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Opens the program file and resolves its entry points. Returns NULL if the
+// program can't be used
+//-----------------------------------------------------------------------------
+static struct loaded_program *openProgram()
+{
+    char path[PATH_MAX];
+    char copy_path[PATH_MAX + 8];
+
+    programPath(path, sizeof(path));
+
+    //dlopen returns the handle it already has when a path is opened twice,
+    //so every version of the program is opened from a copy with a unique name
+    snprintf(copy_path, sizeof(copy_path), "%s.XXXXXX", path);
+    if (!copyProgramFile(path, copy_path))
+    {
+        printf("Can't read PLC program %s\n", path);
+        return NULL;
+    }
+
+    void *handle = dlopen(copy_path, RTLD_NOW | RTLD_LOCAL);
+    unlink(copy_path);
+    if (handle == NULL)
+    {
+        printf("Can't load PLC program %s: %s\n", path, dlerror());
+        return NULL;
+    }
+
+    struct plc_program *program = (struct plc_program *)dlsym(handle, PROGRAM_ENTRY);
+    if (program == NULL)
+    {
+        printf("PLC program %s has no %s. Please build it again\n", path, PROGRAM_ENTRY);
+        dlclose(handle);
+        return NULL;
+    }
+
+    struct loaded_program *loaded = (struct loaded_program *)malloc(sizeof(struct loaded_program));
+    loaded->handle = handle;
+    loaded->program = program;
+
+    return loaded;
+}
+
+static void closeProgram(struct loaded_program *loaded)
+{
+    dlclose(loaded->handle);
+    free(loaded);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// Finds a variable by name on a variable table. The search starts at hint,
+// as both programs usually list their variables in the same order
+//-----------------------------------------------------------------------------
+static struct program_variable *findVariable(struct program_variable *variables, int count,
+                                             const char *name, int *hint)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int position = (*hint + i) % count;
+        if (!strcmp(variables[position].name, name))
+        {
+            *hint = position + 1;
+            return &variables[position];
+        }
+    }
+
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Copies the value of every variable of the old program that exists on the
+// new one with the same name and type. Returns the number of variables copied
+//-----------------------------------------------------------------------------
+static int transferProgramState(struct plc_program *from, struct plc_program *to)
+{
+    if (from->variables == NULL || to->variables == NULL) return 0;
+
+    int count = 0, copied = 0, hint = 0;
+    while (from->variables[count].name != NULL) count++;
+    if (count == 0) return 0;
+
+    for (struct program_variable *dest = to->variables; dest->name != NULL; dest++)
+    {
+        struct program_variable *src = findVariable(from->variables, count, dest->name, &hint);
+        if (src == NULL || strcmp(src->type, dest->type) || src->size != dest->size) continue;
+
+        memcpy(dest->pointer, src->pointer, dest->size);
+        copied++;
+    }
+
+    return copied;
+}
+
+//-----------------------------------------------------------------------------
+// Loads and initializes the first program. Must be called before the main
+// loop starts. Returns 0 on success
+//-----------------------------------------------------------------------------
+int loadProgram()
+{
+    running_program = openProgram();
+    if (running_program == NULL) return -1;
+
+    plc_program = running_program->program;
+    plc_program->init();
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Tells whether a new program is waiting to be swapped in. Cheap enough to
+// be called on every scan
+//-----------------------------------------------------------------------------
+bool programSwapPending()
+{
+    return pending_program != NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Swaps the pending program in. Must be called by the main loop between two
+// scans, without bufferLock held. The task threads are stopped, and must be
+// started again for the new program if this returns true. elapsed_ns is the
+// PLC time, which carries over to the new program
+//-----------------------------------------------------------------------------
+bool swapProgram(unsigned long long elapsed_ns)
+{
+    pthread_mutex_lock(&programLock);
+    struct loaded_program *next = pending_program;
+    pthread_mutex_unlock(&programLock);
+    if (next == NULL) return false;
+
+    stopTaskScheduler();
+
+    pthread_mutex_lock(&bufferLock);
+    saveProcessImage(&saved_image);
+    next->program->init();
+    restoreProcessImage(&saved_image);
+
+    struct plc_program *previous = plc_program;
+    int copied = transferProgramState(previous, next->program);
+
+    plc_program = next->program;
+    int errors = bindLocatedVariables();
+    if (errors > 0)
+    {
+        //keep running the old program
+        plc_program = previous;
+        bindLocatedVariables();
+    }
+    else
+    {
+        plc_program->update_time(elapsed_ns);
+    }
+    pthread_mutex_unlock(&bufferLock);
+
+    if (errors > 0)
+    {
+        printf("Located variables of the new program are not attached to the process image. Keeping the running program\n");
+    }
+    else
+    {
+        printf("PLC program replaced. %d variables carried over\n", copied);
+    }
+
+    pthread_mutex_lock(&programLock);
+    if (errors > 0)
+    {
+        retired_program = next;
+    }
+    else
+    {
+        retired_program = running_program;
+        running_program = next;
+    }
+    pending_program = NULL;
+    pthread_cond_signal(&programSwapped);
+    pthread_mutex_unlock(&programLock);
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Thread that loads a new program every time the runtime receives SIGUSR1.
+// SIGUSR1 must be blocked on all threads before this thread starts
+//-----------------------------------------------------------------------------
+void *programLoaderThread(void *arg)
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    while (1)
+    {
+        int signal;
+        if (sigwait(&signals, &signal) != 0) continue;
+
+#ifdef STATIC_PROGRAM
+        printf("This build can't replace the PLC program. Please restart the runtime\n");
+#else
+        printf("Loading new PLC program...\n");
+        struct loaded_program *next = openProgram();
+        if (next == NULL)
+        {
+            printf("Keeping the running program\n");
+            continue;
+        }
+
+        pthread_mutex_lock(&programLock);
+        pending_program = next;
+        while (pending_program != NULL)
+        {
+            pthread_cond_wait(&programSwapped, &programLock);
+        }
+        struct loaded_program *retired = retired_program;
+        retired_program = NULL;
+        pthread_mutex_unlock(&programLock);
+
+        //the main loop is done with the old program by now
+        closeProgram(retired);
+#endif
+    }
+
+    return NULL;
+}
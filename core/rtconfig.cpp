@@ -0,0 +1,434 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file holds the real-time profile of the OpenPLC. Every thread of the
+// runtime belongs to a class (scan, task, modbus, modbus_client, dnp3 or
+// driver), and each class can be pinned to a set of CPUs and given its own
+// scheduling policy and priority on RT_CONFIG_FILE. Without the file, the
+// scan thread and the tasks run with SCHED_FIFO as they always did, and the
+// other threads run with the default policy on any CPU.
+//
+// The profile also selects what the scan loop and the tasks do when a cycle
+// finishes after the start of the next one (see waitNextCycle()), and where
+// the program can read how many cycles were skipped.
+//
+// The socket options of the protocol servers (Nagle, delayed ACKs, busy
+// polling and buffer sizes) are part of the profile too, since they trade
+// CPU time and throughput for response latency the same way.
+//
+// It also has a latency self-test, similar to cyclictest, that measures the
+// wake-up jitter of a thread with the scan thread profile before the PLC
+// program starts.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <alloca.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "ladder.h"
+
+//Opened on the directory the runtime is started from (the OpenPLC folder,
+//next to dnp3.cfg), like the other configuration files
+#define RT_CONFIG_FILE          "rtconfig.cfg"
+#define RT_MAX_CPUS             64
+#define LATENCY_HIST_BUCKETS    16
+
+struct rt_profile
+{
+    const char *name;
+    char cpus[RT_MAX_CPUS];     //"" runs on any CPU
+    int policy;
+    int priority;
+};
+
+//Defaults keep the scheduling the runtime had before the profile existed
+static struct rt_profile rt_profiles[RT_NUM_THREAD_CLASSES] =
+{
+    {"scan", "", SCHED_FIFO, 30},
+    {"task", "", SCHED_FIFO, 29},
+    {"modbus", "", SCHED_OTHER, 0},
+    {"modbus_client", "", SCHED_OTHER, 0},
+    {"dnp3", "", SCHED_OTHER, 0},
+    {"driver", "", SCHED_OTHER, 0},
+};
+
+static int stack_prefault = 64 * 1024;  //bytes
+static int latency_test_interval = 1000;  //us
+static int pacing_policy = PACING_SKIP_MISSED;
+static int skipped_cycles_address = -1;  //%MD index, -1 if not exposed
+
+//Socket options for the protocol servers. 0 keeps the system default
+static bool socket_nodelay = true;
+static bool socket_quickack = false;
+static int socket_busy_poll = 0;         //us
+static int socket_rcvbuf = 0;            //bytes
+static int socket_sndbuf = 0;            //bytes
+
+//-----------------------------------------------------------------------------
+// Finds the data between the quotes on the line provided
+//-----------------------------------------------------------------------------
+static void getQuotedValue(const char *line, char *buf, int size)
+{
+    const char *start = strchr(line, '"');
+    buf[0] = '\0';
+    if (start == NULL) return;
+    start++;
+
+    int i = 0;
+    while (start[i] != '"' && start[i] != '\0' && i < size - 1)
+    {
+        buf[i] = start[i];
+        i++;
+    }
+    buf[i] = '\0';
+}
+
+//-----------------------------------------------------------------------------
+// Converts a policy name (FIFO, RR or OTHER) to a scheduling policy
+//-----------------------------------------------------------------------------
+static int parsePolicy(const char *value)
+{
+    if (!strcmp(value, "FIFO")) return SCHED_FIFO;
+    if (!strcmp(value, "RR")) return SCHED_RR;
+    if (!strcmp(value, "OTHER")) return SCHED_OTHER;
+
+    printf("Real-time profile: unknown policy %s, using OTHER\n", value);
+    return SCHED_OTHER;
+}
+
+//-----------------------------------------------------------------------------
+// Converts a pacing policy name (catchup, skip or rephase) to a pacing policy
+//-----------------------------------------------------------------------------
+static int parsePacing(const char *value)
+{
+    if (!strcmp(value, "catchup")) return PACING_CATCH_UP;
+    if (!strcmp(value, "skip")) return PACING_SKIP_MISSED;
+    if (!strcmp(value, "rephase")) return PACING_REPHASE;
+
+    printf("Real-time profile: unknown pacing %s, using skip\n", value);
+    return PACING_SKIP_MISSED;
+}
+
+//-----------------------------------------------------------------------------
+// Reads the real-time profile from RT_CONFIG_FILE. Lines look like
+// class.parameter = "value". Missing parameters keep their defaults
+//-----------------------------------------------------------------------------
+void readRealTimeConfig()
+{
+    char line[1024];
+    char value[RT_MAX_CPUS];
+    FILE *cfgfile = fopen(RT_CONFIG_FILE, "r");
+
+    if (cfgfile == NULL)
+    {
+        printf("No real-time profile (%s). Using the defaults\n", RT_CONFIG_FILE);
+        return;
+    }
+
+    printf("Reading real-time profile from %s\n", RT_CONFIG_FILE);
+    while (fgets(line, sizeof(line), cfgfile) != NULL)
+    {
+        if (line[0] == '#' || strlen(line) <= 1) continue;
+        getQuotedValue(line, value, sizeof(value));
+
+        if (!strncmp(line, "stack_prefault", 14))
+        {
+            stack_prefault = atoi(value);
+            continue;
+        }
+        if (!strncmp(line, "latency_test.interval", 21))
+        {
+            latency_test_interval = atoi(value);
+            if (latency_test_interval <= 0) latency_test_interval = 1000;
+            continue;
+        }
+        if (!strncmp(line, "pacing.skipped_cycles", 21))
+        {
+            //accepts both "1023" and "%MD1023"
+            const char *address = value;
+            if (!strncmp(address, "%MD", 3)) address += 3;
+            skipped_cycles_address = (address[0] != '\0') ? atoi(address) : -1;
+            if (skipped_cycles_address >= BUFFER_SIZE) skipped_cycles_address = -1;
+            continue;
+        }
+        if (!strncmp(line, "pacing", 6))
+        {
+            pacing_policy = parsePacing(value);
+            continue;
+        }
+        if (!strncmp(line, "socket.", 7))
+        {
+            const char *parameter = line + 7;
+            if (!strncmp(parameter, "nodelay", 7)) socket_nodelay = !strcmp(value, "true");
+            else if (!strncmp(parameter, "quickack", 8)) socket_quickack = !strcmp(value, "true");
+            else if (!strncmp(parameter, "busy_poll", 9)) socket_busy_poll = atoi(value);
+            else if (!strncmp(parameter, "rcvbuf", 6)) socket_rcvbuf = atoi(value);
+            else if (!strncmp(parameter, "sndbuf", 6)) socket_sndbuf = atoi(value);
+            continue;
+        }
+
+        for (int i = 0; i < RT_NUM_THREAD_CLASSES; i++)
+        {
+            struct rt_profile *profile = &rt_profiles[i];
+            int len = strlen(profile->name);
+            if (strncmp(line, profile->name, len) || line[len] != '.') continue;
+
+            const char *parameter = line + len + 1;
+            if (!strncmp(parameter, "cpus", 4))
+            {
+                strncpy(profile->cpus, value, RT_MAX_CPUS);
+            }
+            else if (!strncmp(parameter, "policy", 6))
+            {
+                profile->policy = parsePolicy(value);
+            }
+            else if (!strncmp(parameter, "priority", 8))
+            {
+                profile->priority = atoi(value);
+            }
+            break;
+        }
+    }
+    fclose(cfgfile);
+
+    for (int i = 0; i < RT_NUM_THREAD_CLASSES; i++)
+    {
+        struct rt_profile *profile = &rt_profiles[i];
+        if (profile->policy == SCHED_OTHER) profile->priority = 0;
+        printf("Thread class %s: policy %s, priority %d, cpus %s\n", profile->name,
+               profile->policy == SCHED_FIFO ? "FIFO" : (profile->policy == SCHED_RR ? "RR" : "OTHER"),
+               profile->priority, profile->cpus[0] ? profile->cpus : "any");
+    }
+    printf("Sockets: nodelay %s, quickack %s, busy poll %d us, rcvbuf %d, sndbuf %d\n",
+           socket_nodelay ? "on" : "off", socket_quickack ? "on" : "off",
+           socket_busy_poll, socket_rcvbuf, socket_sndbuf);
+}
+
+//-----------------------------------------------------------------------------
+// Returns the priority configured for a thread class
+//-----------------------------------------------------------------------------
+int realTimePriority(int thread_class)
+{
+    return rt_profiles[thread_class].priority;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the pacing policy for the scan loop and the tasks
+//-----------------------------------------------------------------------------
+int pacingPolicy()
+{
+    return pacing_policy;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the %MD index where the skipped cycle count is published for the
+// program, or -1 if it isn't published
+//-----------------------------------------------------------------------------
+int skippedCyclesAddress()
+{
+    return skipped_cycles_address;
+}
+
+//-----------------------------------------------------------------------------
+// Applies the socket options of the profile to a socket of a protocol
+// server. stream tells if it is a TCP socket, which also takes the TCP
+// options. Options the system doesn't have are skipped
+//-----------------------------------------------------------------------------
+void applySocketProfile(int fd, bool stream)
+{
+    int on = 1;
+
+    if (socket_rcvbuf > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &socket_rcvbuf, sizeof(socket_rcvbuf));
+    if (socket_sndbuf > 0) setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &socket_sndbuf, sizeof(socket_sndbuf));
+#ifdef SO_BUSY_POLL
+    if (socket_busy_poll > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &socket_busy_poll, sizeof(socket_busy_poll)))
+    {
+        printf("WARNING: Failed to set busy polling on socket %d\n", fd);
+    }
+#endif
+
+    if (!stream) return;
+    if (socket_nodelay) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    rearmQuickAck(fd);
+}
+
+//-----------------------------------------------------------------------------
+// TCP_QUICKACK only lasts until the kernel goes back to delayed ACKs, so it
+// is set again after every read
+//-----------------------------------------------------------------------------
+void rearmQuickAck(int fd)
+{
+#ifdef TCP_QUICKACK
+    if (!socket_quickack) return;
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif
+}
+
+#ifdef __linux__
+//-----------------------------------------------------------------------------
+// Converts a CPU list like "0,2-3" to a CPU set. Returns the number of CPUs
+// on the set
+//-----------------------------------------------------------------------------
+static int parseCpuList(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+
+    const char *p = list;
+    while (*p != '\0')
+    {
+        char *end;
+        int first = strtol(p, &end, 10);
+        if (end == p) break;
+
+        int last = first;
+        p = end;
+        if (*p == '-')
+        {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p) last = first;
+            p = end;
+        }
+
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+        {
+            if (cpu >= 0) CPU_SET(cpu, set);
+        }
+
+        while (*p == ',' || *p == ' ') p++;
+    }
+
+    return CPU_COUNT(set);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// Touches the top of the stack of the calling thread so that, with the
+// memory locked, the thread never page faults on its stack
+//-----------------------------------------------------------------------------
+static void prefaultStack()
+{
+    if (stack_prefault <= 0) return;
+
+    volatile unsigned char *stack = (volatile unsigned char *)alloca(stack_prefault);
+    for (int i = 0; i < stack_prefault; i += 4096)
+    {
+        stack[i] = 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Applies the profile of a thread class to the calling thread. priority
+// overrides the priority of the class (tasks derive theirs from the IEC
+// PRIORITY), and -1 uses the configured one
+//-----------------------------------------------------------------------------
+void applyRealTimeProfile(int thread_class, int priority, const char *name)
+{
+    struct rt_profile *profile = &rt_profiles[thread_class];
+
+#ifdef __linux__
+    if (profile->cpus[0] != '\0')
+    {
+        cpu_set_t set;
+        if (parseCpuList(profile->cpus, &set) == 0 ||
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        {
+            printf("WARNING: Failed to pin %s to cpus %s\n", name, profile->cpus);
+        }
+    }
+#endif
+
+    struct sched_param sp;
+    sp.sched_priority = (profile->policy == SCHED_OTHER) ? 0 : (priority < 0 ? profile->priority : priority);
+    if (pthread_setschedparam(pthread_self(), profile->policy, &sp))
+    {
+        printf("WARNING: Failed to set %s to real-time priority\n", name);
+    }
+
+    prefaultStack();
+}
+
+//-----------------------------------------------------------------------------
+// Sleeps on absolute deadlines, like the scan thread does, and reports how
+// late the wake-ups were. Runs with the scan thread profile
+//-----------------------------------------------------------------------------
+void runLatencyTest(int seconds)
+{
+    unsigned long long interval = latency_test_interval * 1000ULL;
+    unsigned long long samples = 0, total = 0;
+    long long min = -1, max = 0;
+    unsigned long histogram[LATENCY_HIST_BUCKETS];
+    struct timespec next, now, end;
+
+    memset(histogram, 0, sizeof(histogram));
+
+    printf("Running latency test for %d seconds (interval %d us)...\n", seconds, latency_test_interval);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    end = next;
+    end.tv_sec += seconds;
+
+    while (1)
+    {
+        next.tv_nsec += interval;
+        while (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timespecDiff(&now, &end) >= 0) break;
+
+        long long latency = timespecDiff(&now, &next);
+        if (latency < 0) latency = 0;
+        if (min < 0 || latency < min) min = latency;
+        if (latency > max) max = latency;
+        total += latency;
+        samples++;
+
+        //bucket 0 counts wake-ups below 1us and bucket N the range [2^(N-1), 2^N) us
+        int bucket = 0;
+        for (long long us = latency / 1000; us > 0 && bucket < LATENCY_HIST_BUCKETS - 1; us >>= 1) bucket++;
+        histogram[bucket]++;
+    }
+
+    if (samples == 0)
+    {
+        printf("Latency test: no samples\n");
+        return;
+    }
+
+    printf("Latency test: %llu samples, min %lld us, avg %llu us, max %lld us\n",
+           samples, min / 1000, total / samples / 1000, max / 1000);
+    for (int i = 0; i < LATENCY_HIST_BUCKETS; i++)
+    {
+        if (histogram[i] == 0) continue;
+        if (i == 0) printf("  < 1 us: %lu\n", histogram[i]);
+        else if (i == LATENCY_HIST_BUCKETS - 1) printf("  >= %d us: %lu\n", 1 << (i - 1), histogram[i]);
+        else printf("  < %d us: %lu\n", 1 << i, histogram[i]);
+    }
+}
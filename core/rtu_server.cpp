@@ -0,0 +1,396 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file is the Modbus RTU slave of the OpenPLC. It serves the same
+// requests as the Modbus/TCP server, from a serial port: each RTU frame is
+// turned into the equivalent Modbus/TCP request, processed by the PDU engine
+// on modbus.cpp, and the response goes back as an RTU frame.
+//
+// Frames are delimited by 3.5 character times of silence on the line. The
+// port is read with VMIN = 1 and VTIME = 0, so the thread sleeps on read()
+// until the first byte of a frame comes in. Every read is timestamped, and
+// the frame ends when nothing else arrives within 3.5 character times of the
+// last read. Responses therefore go out 3.5 character times after the last
+// byte of the request, as the spec asks. On Linux the port is also switched
+// to low latency mode, so the driver hands bytes over right away instead of
+// batching them.
+//
+// The master on the line is admitted as one client with address 0.0.0.0,
+// which puts it on the normal class unless a rule on the admission settings
+// covers that address. A request that is over the limit of its class is
+// dropped, and the master sees it time out.
+//
+// The serial port is given as device[,baud[,format[,slave_id]]], for
+// instance /dev/ttyUSB0,19200,8E1,1. The format is the data bits (always 8
+// on RTU), the parity (N, E or O) and the stop bits (1 or 2). It can be
+// tested without hardware over a pseudo-terminal pair:
+//
+//     socat -d -d pty,raw,echo=0 pty,raw,echo=0
+//     ./openplc -r /dev/pts/3,19200,8E1,1
+//
+// and a Modbus RTU master on the other end (/dev/pts/4).
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+#include "ladder.h"
+
+#define RTU_MAX_FRAME           256     //address, 253 bytes of PDU and CRC
+#define RTU_MIN_FRAME           4       //address, function code and CRC
+#define RTU_BROADCAST           0
+
+#define DEFAULT_BAUD            19200
+#define DEFAULT_SLAVE_ID        1
+
+struct rtu_port
+{
+    char device[256];
+    int baud;
+    char parity;                //'N', 'E' or 'O'
+    int stop_bits;
+    int slave_id;
+    long long frame_gap_ns;     //3.5 character times
+    struct client_admission admission;
+};
+
+static uint16_t crc_table[256];
+
+//-----------------------------------------------------------------------------
+// Fills the table for the Modbus CRC (polynomial 0xA001, reflected)
+//-----------------------------------------------------------------------------
+static void initializeCrcTable()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+}
+
+static uint16_t modbusCrc(const unsigned char *data, int length)
+{
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < length; i++)
+    {
+        crc = (crc >> 8) ^ crc_table[(crc ^ data[i]) & 0xff];
+    }
+
+    return crc;
+}
+
+//-----------------------------------------------------------------------------
+// Parses device[,baud[,format[,slave_id]]]. Returns false if the settings
+// are invalid
+//-----------------------------------------------------------------------------
+static bool parsePortSettings(const char *settings, struct rtu_port *port)
+{
+    char format[8] = "8E1";
+
+    port->baud = DEFAULT_BAUD;
+    port->slave_id = DEFAULT_SLAVE_ID;
+
+    const char *comma = strchr(settings, ',');
+    int length = comma ? comma - settings : strlen(settings);
+    if (length == 0 || length >= (int)sizeof(port->device)) return false;
+    memcpy(port->device, settings, length);
+    port->device[length] = '\0';
+
+    if (comma != NULL)
+    {
+        sscanf(comma + 1, "%d,%7[^,],%d", &port->baud, format, &port->slave_id);
+    }
+
+    if (format[0] != '8' || strchr("NEO", format[1]) == NULL || format[1] == '\0' ||
+        (format[2] != '1' && format[2] != '2'))
+    {
+        printf("Modbus RTU: invalid format %s. Only 8 data bits are allowed, with parity N, E or O and 1 or 2 stop bits\n", format);
+        return false;
+    }
+    port->parity = format[1];
+    port->stop_bits = format[2] - '0';
+
+    if (port->slave_id < 1 || port->slave_id > 247)
+    {
+        printf("Modbus RTU: slave id must be between 1 and 247\n");
+        return false;
+    }
+
+    //the spec fixes the gap at 1.75ms above 19200 bauds
+    int char_bits = 1 + 8 + (port->parity != 'N') + port->stop_bits;
+    if (port->baud > 19200)
+        port->frame_gap_ns = 1750000;
+    else
+        port->frame_gap_ns = 3500000000LL * char_bits / port->baud;
+
+    return true;
+}
+
+static speed_t baudConstant(int baud)
+{
+    switch (baud)
+    {
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+#ifdef B230400
+        case 230400: return B230400;
+#endif
+        default: return 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Opens and configures the serial port. Returns the file descriptor, or -1
+//-----------------------------------------------------------------------------
+static int openPort(struct rtu_port *port)
+{
+    speed_t speed = baudConstant(port->baud);
+    if (speed == 0)
+    {
+        printf("Modbus RTU: unsupported baud rate %d\n", port->baud);
+        return -1;
+    }
+
+    int fd = open(port->device, O_RDWR | O_NOCTTY);
+    if (fd < 0)
+    {
+        perror("Modbus RTU: can't open serial port");
+        return -1;
+    }
+
+    struct termios tty;
+    if (tcgetattr(fd, &tty) < 0)
+    {
+        perror("Modbus RTU: can't read serial port settings");
+        close(fd);
+        return -1;
+    }
+
+    cfmakeraw(&tty);
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~(PARENB | PARODD | CSTOPB);
+    if (port->parity != 'N') tty.c_cflag |= PARENB;
+    if (port->parity == 'O') tty.c_cflag |= PARODD;
+    if (port->stop_bits == 2) tty.c_cflag |= CSTOPB;
+
+    //read() sleeps until the first byte of a frame. The end of the frame is
+    //found by the silence after it, not by the terminal driver
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+
+    if (tcsetattr(fd, TCSANOW, &tty) < 0)
+    {
+        perror("Modbus RTU: can't configure serial port");
+        close(fd);
+        return -1;
+    }
+    tcflush(fd, TCIOFLUSH);
+
+#ifdef __linux__
+    //not every driver (or a pty) has it, which is fine
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0)
+    {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+#endif
+
+    return fd;
+}
+
+//-----------------------------------------------------------------------------
+// Waits until the port has bytes to read or the deadline passes. Returns 1
+// if there are bytes, 0 on the deadline and -1 on errors
+//-----------------------------------------------------------------------------
+static int waitForBytes(int fd, struct timespec *deadline)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (1)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long remaining = timespecDiff(deadline, &now);
+        if (remaining < 0) remaining = 0;
+
+#ifdef __linux__
+        struct timespec timeout;
+        timeout.tv_sec = remaining / 1000000000LL;
+        timeout.tv_nsec = remaining % 1000000000LL;
+        int ready = ppoll(&pfd, 1, &timeout, NULL);
+#else
+        int ready = poll(&pfd, 1, (remaining + 999999) / 1000000);
+#endif
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) return -1;
+
+        return ready > 0 ? 1 : 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Processes a complete frame and sends the response, unless the request was
+// a broadcast. Frames with a bad CRC or for other slaves are dropped silently,
+// as the spec asks
+//-----------------------------------------------------------------------------
+static void processFrame(int fd, struct rtu_port *port, const unsigned char *frame, int length)
+{
+    unsigned char request[RTU_MAX_FRAME + 8];
+    unsigned char response[MAX_MODBUS_RESPONSE];
+    unsigned char reply[RTU_MAX_FRAME];
+
+    if (length < RTU_MIN_FRAME) return;
+    if (frame[0] != port->slave_id && frame[0] != RTU_BROADCAST) return;
+
+    uint16_t crc = frame[length - 2] | (frame[length - 1] << 8);
+    if (modbusCrc(frame, length - 2) != crc) return;
+
+    //the same request over Modbus/TCP: MBAP header, then the PDU
+    int pduLength = length - 3;
+    request[0] = 0;     //transaction identifier
+    request[1] = 0;
+    request[2] = 0;     //protocol identifier
+    request[3] = 0;
+    request[4] = 0;
+    request[5] = pduLength + 1;
+    request[6] = frame[0];
+    memcpy(&request[7], &frame[1], pduLength);
+
+    if (!scanBudgetLeft(port->admission.client_class))
+    {
+        countDeferredRequest(port->admission.client_class, false);
+        return;
+    }
+    long long start = monotonicNanoseconds();
+    if (admitRequest(&port->admission, start) > 0)
+    {
+        countDeferredRequest(port->admission.client_class, true);
+        return;
+    }
+
+    int responseSize = processModbusRequest(request, pduLength + 7, response);
+    chargeScanBudget(monotonicNanoseconds() - start);
+    if (frame[0] == RTU_BROADCAST || responseSize <= 7) return;
+
+    int replyLength = responseSize - 6;
+    reply[0] = port->slave_id;
+    memcpy(&reply[1], &response[7], responseSize - 7);
+    crc = modbusCrc(reply, replyLength);
+    reply[replyLength] = crc & 0xff;
+    reply[replyLength + 1] = crc >> 8;
+
+    if (write(fd, reply, replyLength + 2) < 0)
+    {
+        perror("Modbus RTU: can't write response");
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Serves Modbus RTU requests on the serial port given by settings. Only
+// returns if the port can't be used
+//-----------------------------------------------------------------------------
+void startRtuServer(const char *settings)
+{
+    struct rtu_port port;
+    unsigned char frame[RTU_MAX_FRAME];
+    unsigned char discard[RTU_MAX_FRAME];
+
+    if (!parsePortSettings(settings, &port)) return;
+    int fd = openPort(&port);
+    if (fd < 0) return;
+    admitClient(&port.admission, 0);
+
+    initializeCrcTable();
+    printf("Modbus RTU: slave %d on %s, %d bauds, 8%c%d, frame gap %lld us\n", port.slave_id, port.device,
+           port.baud, port.parity, port.stop_bits, port.frame_gap_ns / 1000);
+
+    while (1)
+    {
+        int length = 0;
+        bool overflow = false;
+        struct timespec last_read;
+
+        //first byte of a frame
+        int n = read(fd, frame, sizeof(frame));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            perror("Modbus RTU: can't read serial port");
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &last_read);
+        length = n;
+
+        //the rest of it, until the line is silent for 3.5 characters
+        while (1)
+        {
+            struct timespec deadline = last_read;
+            deadline.tv_nsec += port.frame_gap_ns;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+
+            int ready = waitForBytes(fd, &deadline);
+            if (ready <= 0) break;
+
+            //bytes past the longest frame are read and dropped with the frame
+            if (length < RTU_MAX_FRAME)
+                n = read(fd, frame + length, RTU_MAX_FRAME - length);
+            else
+                n = read(fd, discard, sizeof(discard));
+            if (n <= 0) break;
+
+            clock_gettime(CLOCK_MONOTONIC, &last_read);
+            if (length < RTU_MAX_FRAME) length += n;
+            else overflow = true;
+        }
+
+        if (!overflow)
+        {
+            processFrame(fd, &port, frame, length);
+        }
+    }
+
+    close(fd);
+}
@@ -0,0 +1,208 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file keeps a journal of the changes every scan makes to the process
+// image, for the protocols that report events (DNP3). Right after a scan
+// publishes its snapshot, the scan thread compares it with the snapshot of
+// the scan before, 8 bytes at a time, and appends one record for every
+// element that changed. Records carry the snapshot number and the time the
+// scan read its inputs, so events keep the order and the time they really
+// happened in, even if they revert on the next scan.
+//
+// The journal is a single producer, single consumer ring. The scan thread
+// never waits for the consumer: if the ring is full, the rest of the
+// records are dropped and the consumer is told to resynchronize from a
+// full snapshot. Until a consumer enables it, the journal costs nothing.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <semaphore.h>
+
+#include "ladder.h"
+
+#define JOURNAL_SIZE            8192    //records, must be a power of 2
+
+struct journal_area
+{
+    uint8_t area;
+    uint8_t size;           //bytes per element
+    size_t offset;          //offset on struct process_image
+};
+
+static const struct journal_area journal_areas[] =
+{
+    {IMAGE_BOOL_INPUT, 1, offsetof(struct process_image, bool_input)},
+    {IMAGE_BOOL_OUTPUT, 1, offsetof(struct process_image, bool_output)},
+    {IMAGE_BYTE_INPUT, 1, offsetof(struct process_image, byte_input)},
+    {IMAGE_BYTE_OUTPUT, 1, offsetof(struct process_image, byte_output)},
+    {IMAGE_INT_INPUT, 2, offsetof(struct process_image, int_input)},
+    {IMAGE_INT_OUTPUT, 2, offsetof(struct process_image, int_output)},
+    {IMAGE_INT_MEMORY, 2, offsetof(struct process_image, int_memory)},
+    {IMAGE_DINT_MEMORY, 4, offsetof(struct process_image, dint_memory)},
+    {IMAGE_LINT_MEMORY, 8, offsetof(struct process_image, lint_memory)},
+};
+#define NUM_JOURNAL_AREAS       (sizeof(journal_areas) / sizeof(journal_areas[0]))
+
+static struct scan_change journal[JOURNAL_SIZE];
+static volatile unsigned int journal_head = 0;      //written by the scan thread
+static volatile unsigned int journal_tail = 0;      //written by the consumer
+static volatile bool journal_enabled = false;
+static volatile bool journal_overflow = false;
+static sem_t journal_ready;
+
+//-----------------------------------------------------------------------------
+// Starts recording. Called once by the consumer, which must then take a
+// full snapshot and skip the records of the snapshots it already has
+//-----------------------------------------------------------------------------
+void enableScanJournal()
+{
+    sem_init(&journal_ready, 0, 0);
+    __sync_synchronize();
+    journal_enabled = true;
+}
+
+//-----------------------------------------------------------------------------
+// Appends a record. Returns false if the ring is full
+//-----------------------------------------------------------------------------
+static inline bool appendChange(unsigned int *head, uint8_t area, int index, uint64_t value,
+                                unsigned int scan, uint64_t time)
+{
+    if (*head - journal_tail == JOURNAL_SIZE) return false;
+
+    struct scan_change *change = &journal[*head & (JOURNAL_SIZE - 1)];
+    change->value = value;
+    change->time = time;
+    change->scan = scan;
+    change->index = index;
+    change->area = area;
+    (*head)++;
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Records the changes of the snapshot just published. scan_start is when
+// the scan began (CLOCK_MONOTONIC). Must be called by the scan thread,
+// right after publishImageSnapshot()
+//-----------------------------------------------------------------------------
+void recordScanChanges(struct timespec *scan_start)
+{
+    if (!journal_enabled || journal_overflow) return;
+
+    const struct process_image *current, *previous;
+    unsigned int scan = lastImageSnapshots(&current, &previous);
+    unsigned int head = journal_head;
+    uint64_t time = 0;
+
+    for (unsigned int a = 0; a < NUM_JOURNAL_AREAS; a++)
+    {
+        const struct journal_area *area = &journal_areas[a];
+        const unsigned char *now = (const unsigned char *)current + area->offset;
+        const unsigned char *last = (const unsigned char *)previous + area->offset;
+        int bytes = BUFFER_SIZE * ((area->area <= IMAGE_BOOL_OUTPUT) ? 8 : area->size);
+
+        for (int offset = 0; offset < bytes; offset += 8)
+        {
+            uint64_t x, y;
+            memcpy(&x, now + offset, 8);
+            memcpy(&y, last + offset, 8);
+            if (x == y) continue;
+
+            //the wall clock is only read on scans that changed something
+            if (time == 0)
+            {
+                struct timespec mono, real;
+                clock_gettime(CLOCK_MONOTONIC, &mono);
+                clock_gettime(CLOCK_REALTIME, &real);
+                time = (real.tv_sec * 1000000000LL + real.tv_nsec - timespecDiff(&mono, scan_start)) / 1000000;
+            }
+
+            for (int i = offset; i < offset + 8; i += area->size)
+            {
+                uint64_t value = 0, old = 0;
+                memcpy(&value, now + i, area->size);
+                memcpy(&old, last + i, area->size);
+                if (value == old) continue;
+
+                if (!appendChange(&head, area->area, i / area->size, value, scan, time))
+                {
+                    journal_overflow = true;
+                    break;
+                }
+            }
+            if (journal_overflow) break;
+        }
+        if (journal_overflow) break;
+    }
+
+    if (head == journal_head && !journal_overflow) return;
+
+    __sync_synchronize();
+    journal_head = head;
+
+    int waiting;
+    sem_getvalue(&journal_ready, &waiting);
+    if (waiting == 0) sem_post(&journal_ready);
+}
+
+//-----------------------------------------------------------------------------
+// Blocks until the journal has records, or has to be resynchronized
+//-----------------------------------------------------------------------------
+void waitScanChanges()
+{
+    while (journal_head == journal_tail && !journal_overflow)
+    {
+        sem_wait(&journal_ready);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Takes up to max records from the journal, oldest first. Returns how many
+// were taken. *overflow tells if records were dropped after the last one
+// available. In that case the consumer must take a full snapshot once the
+// journal is empty, and skip the records of the snapshots it already has
+//-----------------------------------------------------------------------------
+int readScanChanges(struct scan_change *changes, int max, bool *overflow)
+{
+    unsigned int head = journal_head;
+    unsigned int tail = journal_tail;
+    int count = 0;
+
+    __sync_synchronize();
+    while (tail != head && count < max)
+    {
+        changes[count++] = journal[tail & (JOURNAL_SIZE - 1)];
+        tail++;
+    }
+
+    *overflow = false;
+    if (tail == head && journal_overflow)
+    {
+        //the scan thread starts recording again on its next scan
+        *overflow = true;
+        journal_overflow = false;
+    }
+
+    __sync_synchronize();
+    journal_tail = tail;
+
+    return count;
+}
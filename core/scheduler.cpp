@@ -0,0 +1,523 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file is the task scheduler of the OpenPLC. When the IEC program has
+// more than one TASK, each task runs on its own thread, with its own
+// INTERVAL and a real-time priority derived from its PRIORITY (0 is the
+// highest), instead of running everything from config_run__() at the
+// common tick.
+//
+// Every task runs on a private copy of the located variables of its
+// programs, listed for it on the task table. The task takes bufferLock only
+// to copy them in from the process image before its programs run, and to
+// copy back the ones it wrote when they finish. So every task sees an image
+// that doesn't change during its execution, its outputs are published as a
+// whole, and a higher priority task can preempt a lower priority one while
+// it runs. When the programs may also reach the process image through
+// global variables or program connections, the task table has no variable
+// lists, and the tasks run one at a time with bufferLock held. bufferLock
+// uses priority inheritance, so a task never waits for more than one
+// execution of a lower priority task. The main loop keeps doing the I/O
+// exchange at the common tick.
+//
+// SINGLE tasks have no interval. Their threads sleep until something changes
+// the process image (the input update, a write from the protocols or the
+// end of another task) and then check the task trigger, so they react to
+// the edge right away instead of on the next common tick.
+//
+// When the PLC program is replaced, the task threads are cancelled and
+// started again for the tasks of the new program. A task thread can only be
+// cancelled while it is waiting, never while it holds a lock or runs its
+// programs. The located variables are pointed back to the process image
+// before the new program takes over.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ladder.h"
+
+#define MAX_TASKS               32
+
+//The task with IEC priority 0 runs with the priority of the task thread
+//class on the real-time profile (29 by default, below the main loop, which
+//does the I/O exchange). Lower priority tasks go down from there
+#define TASK_RT_PRIORITY_MIN    1
+
+//Every located variable takes a slot of this size (or a multiple) on the
+//private image of a task, so all of them are aligned
+#define TASK_VAR_ALIGN          8
+
+struct task_thread
+{
+    struct iec_task *task;
+    pthread_t thread;
+    int rt_priority;
+    struct timespec start;
+    unsigned long activations;
+    bool private_image;         //false to run the programs on the process image, with the lock held
+    int var_count;              //located variables on the private image
+    void **locations;           //where each located variable points to on the process image
+    unsigned char *image;       //private image of the task
+    unsigned char *before;      //private image as copied in, to find what the task changed
+};
+
+static struct task_thread task_threads[MAX_TASKS];
+static int task_count = 0;
+static int event_task_count = 0;
+
+//Wakes the SINGLE task threads. image_events counts the notifications, so a
+//notification is never lost while a thread is busy running its task
+static pthread_mutex_t eventLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t imageChanged = PTHREAD_COND_INITIALIZER;
+static unsigned long image_events = 0;
+
+//-----------------------------------------------------------------------------
+// Helper to advance a timestamp by ns nanoseconds
+//-----------------------------------------------------------------------------
+static void timespecAdd(struct timespec *ts, unsigned long long ns)
+{
+    ts->tv_sec += ns / 1000000000ULL;
+    ts->tv_nsec += ns % 1000000000ULL;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_nsec -= 1000000000L;
+        ts->tv_sec++;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Waits for the start of the next cycle of a loop with the given period.
+// deadline holds the start of the cycle that just ran, and is moved to the
+// start of the next one. When the cycle finished late, the pacing policy
+// decides whether the missed cycles run back to back, are skipped, or the
+// loop takes a new phase. Returns the number of cycles that were skipped.
+// If overrun is not NULL, it tells whether the cycle finished late
+//-----------------------------------------------------------------------------
+unsigned long waitNextCycle(struct timespec *deadline, unsigned long long period, bool *overrun)
+{
+    struct timespec now;
+    unsigned long skipped = 0;
+
+    timespecAdd(deadline, period);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long long late = timespecDiff(&now, deadline);
+    if (overrun != NULL) *overrun = (late > 0);
+    if (late > 0)
+    {
+        switch (pacingPolicy())
+        {
+            case PACING_SKIP_MISSED:
+                skipped = late / period + 1;
+                timespecAdd(deadline, skipped * period);
+                break;
+            case PACING_REPHASE:
+                skipped = late / period;
+                *deadline = now;
+                break;
+            default:
+                break;
+        }
+    }
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL);
+
+    return skipped;
+}
+
+//-----------------------------------------------------------------------------
+// Maps an IEC priority to a real-time priority for the task thread
+//-----------------------------------------------------------------------------
+static int taskRtPriority(int priority)
+{
+    //programs without task run with the lowest priority
+    if (priority < 0) return TASK_RT_PRIORITY_MIN;
+
+    int rt_priority = realTimePriority(RT_THREAD_TASK) - priority;
+    if (rt_priority < TASK_RT_PRIORITY_MIN) rt_priority = TASK_RT_PRIORITY_MIN;
+
+    return rt_priority;
+}
+
+//-----------------------------------------------------------------------------
+// Size of the slot of a located variable on the private image of a task
+//-----------------------------------------------------------------------------
+static unsigned int taskVarSlot(unsigned int size)
+{
+    return (size + TASK_VAR_ALIGN - 1) / TASK_VAR_ALIGN * TASK_VAR_ALIGN;
+}
+
+//-----------------------------------------------------------------------------
+// Points the located variables of a task to its private image. Returns false
+// if the task has no variable list, and must run on the process image
+//-----------------------------------------------------------------------------
+static bool attachPrivateImage(struct task_thread *t)
+{
+    struct iec_task_var *vars = t->task->vars;
+    unsigned int image_size = 0;
+    int count = 0;
+
+    t->private_image = false;
+    t->var_count = 0;
+    if (vars == NULL) return false;
+
+    for (count = 0; vars[count].pointer != NULL; count++)
+    {
+        image_size += taskVarSlot(vars[count].size);
+    }
+    t->private_image = true;
+    if (count == 0) return true;
+
+    t->locations = (void **)malloc(count * sizeof(void *));
+    t->image = (unsigned char *)malloc(image_size);
+    t->before = (unsigned char *)malloc(image_size);
+    if (t->locations == NULL || t->image == NULL || t->before == NULL)
+    {
+        free(t->locations);
+        free(t->image);
+        free(t->before);
+        t->private_image = false;
+        return false;
+    }
+
+    unsigned int offset = 0;
+    for (int i = 0; i < count; i++)
+    {
+        t->locations[i] = *vars[i].pointer;
+        *vars[i].pointer = t->image + offset;
+        offset += taskVarSlot(vars[i].size);
+    }
+    t->var_count = count;
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Points the located variables of a task back to the process image
+//-----------------------------------------------------------------------------
+static void detachPrivateImage(struct task_thread *t)
+{
+    t->private_image = false;
+    if (t->var_count == 0) return;
+
+    for (int i = 0; i < t->var_count; i++)
+    {
+        *t->task->vars[i].pointer = t->locations[i];
+    }
+
+    free(t->locations);
+    free(t->image);
+    free(t->before);
+    t->var_count = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Copies the located variables of a task from the process image to its
+// private image. Must be called with bufferLock held
+//-----------------------------------------------------------------------------
+static void copyTaskInputs(struct task_thread *t)
+{
+    struct iec_task_var *vars = t->task->vars;
+    unsigned int offset = 0;
+
+    for (int i = 0; i < t->var_count; i++)
+    {
+        memcpy(t->image + offset, t->locations[i], vars[i].size);
+        *vars[i].flags &= ~IEC_WRITTEN_FLAG;
+        offset += taskVarSlot(vars[i].size);
+    }
+    memcpy(t->before, t->image, offset);
+}
+
+//-----------------------------------------------------------------------------
+// Copies the located variables written by a task back to the process image,
+// even when the task wrote the value it read. Variables the task didn't
+// write keep the values written meanwhile by the I/O exchange, the protocols
+// and the other tasks. Must be called with bufferLock held
+//-----------------------------------------------------------------------------
+static void copyTaskOutputs(struct task_thread *t)
+{
+    struct iec_task_var *vars = t->task->vars;
+    unsigned int offset = 0;
+
+    for (int i = 0; i < t->var_count; i++)
+    {
+        //writes through references don't set the flag, but change the value
+        if ((*vars[i].flags & IEC_WRITTEN_FLAG) ||
+            memcmp(t->image + offset, t->before + offset, vars[i].size) != 0)
+        {
+            memcpy(t->locations[i], t->image + offset, vars[i].size);
+        }
+        offset += taskVarSlot(vars[i].size);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Runs the task programs once. Must be called with bufferLock held, and
+// returns with it released. Tasks with a private image release it while
+// their programs run
+//-----------------------------------------------------------------------------
+static void runTask(struct task_thread *t)
+{
+    if (!t->private_image)
+    {
+        t->task->run(t->activations++);
+        pthread_mutex_unlock(&bufferLock);
+        return;
+    }
+
+    copyTaskInputs(t);
+    pthread_mutex_unlock(&bufferLock);
+
+    t->task->run(t->activations++);
+
+    pthread_mutex_lock(&bufferLock);
+    copyTaskOutputs(t);
+    pthread_mutex_unlock(&bufferLock);
+}
+
+//-----------------------------------------------------------------------------
+// Cleanup handler for a SINGLE task thread cancelled while waiting for an
+// image change
+//-----------------------------------------------------------------------------
+static void unlockEventLock(void *arg)
+{
+    pthread_mutex_unlock(&eventLock);
+}
+
+//-----------------------------------------------------------------------------
+// Thread for a single task. Runs the task programs on every interval
+//-----------------------------------------------------------------------------
+static void *taskThread(void *arg)
+{
+    struct task_thread *t = (struct task_thread *)arg;
+    struct timespec next = t->start;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    applyRealTimeProfile(RT_THREAD_TASK, t->rt_priority, t->task->name);
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while (1)
+    {
+        pthread_mutex_lock(&bufferLock);
+        runTask(t);
+        notifyImageChange();
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        waitNextCycle(&next, t->task->interval, NULL);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    }
+
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Thread for a SINGLE task. Waits for a change on the process image, and runs
+// the task programs when the trigger sees a rising edge
+//-----------------------------------------------------------------------------
+static void *eventTaskThread(void *arg)
+{
+    struct task_thread *t = (struct task_thread *)arg;
+    unsigned long seen_events;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    applyRealTimeProfile(RT_THREAD_TASK, t->rt_priority, t->task->name);
+
+    pthread_mutex_lock(&eventLock);
+    seen_events = image_events;
+    pthread_mutex_unlock(&eventLock);
+
+    while (1)
+    {
+        pthread_mutex_lock(&eventLock);
+        pthread_cleanup_push(unlockEventLock, NULL);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        while (image_events == seen_events)
+        {
+            pthread_cond_wait(&imageChanged, &eventLock);
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        seen_events = image_events;
+        pthread_cleanup_pop(1);
+
+        //writes from the protocols are applied right away, so a trigger
+        //written through Modbus or DNP3 doesn't wait for the next scan
+        bool triggered;
+        pthread_mutex_lock(&bufferLock);
+        applyImageWrites();
+        triggered = t->task->trigger();
+        if (triggered)
+        {
+            runTask(t);
+            notifyImageChange();
+        }
+        else
+        {
+            pthread_mutex_unlock(&bufferLock);
+        }
+    }
+
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Wakes the SINGLE tasks so they check their triggers. Must be called after
+// anything that changes the process image. Safe to call from any thread
+//-----------------------------------------------------------------------------
+void notifyImageChange()
+{
+    if (event_task_count == 0) return;
+
+    pthread_mutex_lock(&eventLock);
+    image_events++;
+    pthread_cond_broadcast(&imageChanged);
+    pthread_mutex_unlock(&eventLock);
+}
+
+//-----------------------------------------------------------------------------
+// Reads the task table generated for the running IEC program. Returns the
+// number of tasks that will run on their own threads, or 0 if the main loop
+// must keep running the program through config_run__()
+//-----------------------------------------------------------------------------
+int initializeTaskScheduler()
+{
+    struct iec_task **tasks = plc_program->tasks;
+    task_count = 0;
+    event_task_count = 0;
+
+    //programs built with an older MatIEC compiler have no task table
+    if (tasks == NULL) return 0;
+
+    for (int i = 0; tasks[i] != NULL; i++)
+    {
+        for (struct iec_task *task = tasks[i]; task->name != NULL; task++)
+        {
+            if (task->interval == 0 && task->trigger == NULL)
+            {
+                printf("Task %s has no INTERVAL. Running all tasks at the common tick\n", task->name);
+                task_count = 0;
+                event_task_count = 0;
+                return 0;
+            }
+            if (task_count == MAX_TASKS)
+            {
+                printf("Too many tasks. Running all tasks at the common tick\n");
+                task_count = 0;
+                event_task_count = 0;
+                return 0;
+            }
+
+            task_threads[task_count].task = task;
+            task_threads[task_count].rt_priority = taskRtPriority(task->priority);
+            task_threads[task_count].activations = 0;
+            task_threads[task_count].private_image = false;
+            task_threads[task_count].var_count = 0;
+            if (task->trigger != NULL) event_task_count++;
+            task_count++;
+        }
+    }
+
+    //a single cyclic task gains nothing from a thread of its own
+    if (task_count < 2 && event_task_count == 0)
+    {
+        task_count = 0;
+        return 0;
+    }
+
+    for (int i = 0; i < task_count; i++)
+    {
+        if (task_threads[i].task->trigger != NULL)
+        {
+            printf("Task %s: SINGLE, priority %d\n", task_threads[i].task->name, task_threads[i].task->priority);
+        }
+        else
+        {
+            printf("Task %s: interval %llu us, priority %d\n", task_threads[i].task->name,
+                   task_threads[i].task->interval / 1000, task_threads[i].task->priority);
+        }
+    }
+
+    return task_count;
+}
+
+//-----------------------------------------------------------------------------
+// Starts one thread per task. All tasks are phased from start. Must be called
+// after the program is initialized, as the located variables of the tasks are
+// pointed to their private images
+//-----------------------------------------------------------------------------
+void startTaskScheduler(struct timespec *start)
+{
+    int locked_tasks = 0;
+    pthread_mutex_lock(&bufferLock);
+    for (int i = 0; i < task_count; i++)
+    {
+        if (!attachPrivateImage(&task_threads[i])) locked_tasks++;
+    }
+    pthread_mutex_unlock(&bufferLock);
+    if (locked_tasks > 0)
+    {
+        printf("%d of %d tasks use global variables or program connections. They run one at a time, with the process image locked\n",
+               locked_tasks, task_count);
+    }
+
+    for (int i = 0; i < task_count; i++)
+    {
+        task_threads[i].start = *start;
+        if (task_threads[i].task->trigger != NULL)
+        {
+            pthread_create(&task_threads[i].thread, NULL, eventTaskThread, &task_threads[i]);
+        }
+        else
+        {
+            pthread_create(&task_threads[i].thread, NULL, taskThread, &task_threads[i]);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Stops all task threads and waits for them to finish. Must not be called
+// with bufferLock held, as a task may be waiting for it
+//-----------------------------------------------------------------------------
+void stopTaskScheduler()
+{
+    for (int i = 0; i < task_count; i++)
+    {
+        pthread_cancel(task_threads[i].thread);
+    }
+    for (int i = 0; i < task_count; i++)
+    {
+        pthread_join(task_threads[i].thread, NULL);
+    }
+
+    pthread_mutex_lock(&bufferLock);
+    for (int i = 0; i < task_count; i++)
+    {
+        detachPrivateImage(&task_threads[i]);
+    }
+    pthread_mutex_unlock(&bufferLock);
+
+    task_count = 0;
+    event_task_count = 0;
+}
@@ -19,6 +19,29 @@
 // This is the file for the network routines of the OpenPLC. It has procedures
 // to create a socket, bind it and start network communication.
 // Thiago Alves, Dec 2015
+//
+// On Linux all clients are served by a single thread, which waits on epoll
+// for any socket to be ready. Sockets are non-blocking, and responses that
+// the socket can't take right away wait on a small output buffer of the
+// connection. The number of connections is bounded, and connections with no
+// traffic for longer than the idle timeout are closed. Other systems keep
+// one thread per client.
+//
+// The connections are allocated once, when the server starts, from memory
+// that is populated and locked right away, so serving clients never page
+// faults. Sockets take the options of the real-time profile (TCP_NODELAY,
+// TCP_QUICKACK, SO_BUSY_POLL and the buffer sizes, see rtconfig.cpp).
+//
+// TCP is a byte stream, so a read may hold part of a request or several
+// requests at once. Bytes are accumulated per connection and split into
+// requests by the length field of the MBAP header, and pipelined requests
+// are answered in the order they arrived.
+//
+// Requests are admitted as admission.cpp decides. On each wake-up the
+// clients of the high class are served first, then normal and low. A
+// connection whose request has to wait, for a token or for the next scan,
+// is not read until it is served again, so a flooding client is slowed down
+// by TCP itself instead of by the server buffering its requests.
 //-----------------------------------------------------------------------------
 
 #include <stdio.h>
@@ -28,6 +51,15 @@
 #include <netdb.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#endif
 
 #include "ladder.h"
 
@@ -35,6 +67,40 @@
 #define MAX_OUTPUT 16
 #define MAX_MODBUS 100
 
+#define MESSAGE_BUFFER_SIZE     1024
+#define OUTPUT_BUFFER_SIZE      4096    //room for a few responses waiting for the socket
+#define MAX_EVENTS              64
+#define DEFERRED_POLL_MS        1       //how often requests waiting for the next scan are retried
+
+#ifdef __linux__
+struct connection
+{
+	int fd;
+	time_t last_activity;
+	uint32_t events;                    //events registered on epoll
+	unsigned int input_length;          //bytes received and not processed yet
+	unsigned int output_start;          //ring buffer with the bytes not sent yet
+	unsigned int output_length;
+	struct client_admission admission;
+	bool deferred;                      //a request is waiting to be admitted
+	bool listed;                        //on the list of deferred connections
+	long long ready_at;                 //ns when the waiting request gets a token, 0 if it waits for a scan
+	unsigned char input[MESSAGE_BUFFER_SIZE];
+	unsigned char output[OUTPUT_BUFFER_SIZE];
+	struct connection *next_free;
+};
+
+static struct connection *connections = NULL;
+static struct connection *free_connections = NULL;
+static int active_connections = 0;
+static struct connection **deferred_connections = NULL;
+static int deferred_count = 0;
+
+static int epoll_fd = -1;
+static int listen_fd = -1;
+static bool accepting = true;
+#endif
+
 //-----------------------------------------------------------------------------
 // Create the socket and bind it. Returns the file descriptor for the socket
 // created.
@@ -52,6 +118,11 @@ int createSocket(int port)
 		exit(1);
 	}
 
+	//The server closes idle clients itself, which leaves their sockets on
+	//TIME_WAIT. Without this, a restart can't bind the port for a while
+	int reuse = 1;
+	setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
 	//Initialize Server Struct
 	bzero((char *) &server_addr, sizeof(server_addr));
 	server_addr.sin_family = AF_INET;
@@ -64,8 +135,7 @@ int createSocket(int port)
 		perror("Server: error binding socket");
 		exit(1);
 	}
-        // we accept max 5 pending connections
-	listen(socket_fd,5);
+	listen(socket_fd, SOMAXCONN);
 	printf("Server: Listening on port %d\n", port);
 
 	return socket_fd;
@@ -85,49 +155,50 @@ int waitForClient(int socket_fd)
 
 	client_len = sizeof(client_addr);
 	client_fd = accept(socket_fd, (struct sockaddr *)&client_addr, &client_len); //blocking call
+	if (client_fd >= 0) applySocketProfile(client_fd, true);
 
 	return client_fd;
 }
 
 //-----------------------------------------------------------------------------
 // Blocking call. Holds here until something is received from the client.
-// Once the message is received, it is stored on the buffer and the function
-// returns the number of bytes received.
+// The bytes received are appended to the length bytes already on the buffer,
+// and the function returns the number of bytes received. A read may return
+// part of a request, or several requests at once
 //-----------------------------------------------------------------------------
-int listenToClient(int client_fd, unsigned char *buffer)
+int listenToClient(int client_fd, unsigned char *buffer, int length)
 {
-	bzero(buffer, 1024);
-	int n = read(client_fd, buffer, 1024);
+	int n = read(client_fd, buffer + length, MESSAGE_BUFFER_SIZE - length);
 	return n;
 }
 
-//-----------------------------------------------------------------------------
-// Process client's request
-//-----------------------------------------------------------------------------
-void processMessage(unsigned char *buffer, int bufferSize, int client_fd)
-{
-	int messageSize = processModbusMessage(buffer, bufferSize);
-	write(client_fd, buffer, messageSize);
-}
-
 //-----------------------------------------------------------------------------
 // Thread to handle requests for each connected client
 //-----------------------------------------------------------------------------
 void *handleConnections(void *arguments)
 {
 	int client_fd = *(int *)arguments;
-	unsigned char buffer[1024];
+	unsigned char buffer[MESSAGE_BUFFER_SIZE];
+	unsigned char response[MAX_MODBUS_RESPONSE];
+	int length = 0;
 	int messageSize;
+	struct client_admission admission;
+	struct sockaddr_in client_addr;
+	socklen_t client_len = sizeof(client_addr);
+
+	if (getpeername(client_fd, (struct sockaddr *)&client_addr, &client_len) < 0)
+	{
+		client_addr.sin_addr.s_addr = INADDR_ANY;
+	}
+	admitClient(&admission, client_addr.sin_addr.s_addr);
 
 	printf("Server: Thread created for client ID: %d\n", client_fd);
+	applyRealTimeProfile(RT_THREAD_MODBUS_CLIENT, -1, "modbus client thread");
 
 	while(1)
 	{
-		//unsigned char buffer[1024];
-		//int messageSize;
-
-		messageSize = listenToClient(client_fd, buffer);
-		if (messageSize <= 0 || messageSize > 1024)
+		messageSize = listenToClient(client_fd, buffer, length);
+		if (messageSize <= 0)
 		{
 			// something has  gone wrong or the client has closed connection
 			if (messageSize == 0)
@@ -140,25 +211,526 @@ void *handleConnections(void *arguments)
 			}
 			break;
 		}
+		length += messageSize;
+		rearmQuickAck(client_fd);
+
+		//answer every complete request, keeping a partial one for the next read
+		int consumed = 0, requestSize;
+		while ((requestSize = frameModbusRequest(buffer + consumed, length - consumed)) > 0)
+		{
+			//this thread only serves one client, so it just waits for a token
+			long long wait = admitRequest(&admission, monotonicNanoseconds());
+			if (wait > 0)
+			{
+				countDeferredRequest(admission.client_class, true);
+				do
+				{
+					struct timespec ts;
+					ts.tv_sec = wait / 1000000000LL;
+					ts.tv_nsec = wait % 1000000000LL;
+					nanosleep(&ts, NULL);
+				} while ((wait = admitRequest(&admission, monotonicNanoseconds())) > 0);
+			}
 
-		processMessage(buffer, messageSize, client_fd);
+			int responseSize = processModbusRequest(buffer + consumed, requestSize, response);
+			write(client_fd, response, responseSize);
+			consumed += requestSize;
+		}
+		if (requestSize < 0)
+		{
+			printf("Server: client ID: %d sent an invalid MBAP header\n", client_fd);
+			break;
+		}
+		length -= consumed;
+		memmove(buffer, buffer + consumed, length);
 	}
 	//printf("Debug: Closing client socket and calling pthread_exit in server.cpp\n");
 	close(client_fd);
 	pthread_exit(NULL);
 }
 
+#ifdef __linux__
+//-----------------------------------------------------------------------------
+// Helper to read the monotonic clock in seconds
+//-----------------------------------------------------------------------------
+static time_t monotonicSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+//-----------------------------------------------------------------------------
+// Changes the events a connection waits for, if they are different
+//-----------------------------------------------------------------------------
+static void setConnectionEvents(struct connection *c, uint32_t events)
+{
+	if (c->events == events) return;
+
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = c;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+	c->events = events;
+}
+
+//-----------------------------------------------------------------------------
+// Helper to add the listening socket to epoll
+//-----------------------------------------------------------------------------
+static void watchListeningSocket()
+{
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+	accepting = true;
+}
+
+//-----------------------------------------------------------------------------
+// Closes a connection and returns it to the free list
+//-----------------------------------------------------------------------------
+static void closeConnection(struct connection *c)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->deferred = false;
+	c->next_free = free_connections;
+	free_connections = c;
+	active_connections--;
+
+	//a file descriptor is free again
+	if (!accepting) watchListeningSocket();
+}
+
+//-----------------------------------------------------------------------------
+// Accepts all pending clients. Clients beyond the connection limit are
+// closed right away. If the process runs out of file descriptors, the
+// listening socket is left out of epoll until a client disconnects
+//-----------------------------------------------------------------------------
+static void acceptClients()
+{
+	while (1)
+	{
+		struct sockaddr_in client_addr;
+		socklen_t client_len = sizeof(client_addr);
+		int client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno == EMFILE || errno == ENFILE)
+			{
+				printf("Server: Out of file descriptors. Not accepting clients until one disconnects\n");
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+				accepting = false;
+			}
+			return;
+		}
+
+		if (free_connections == NULL)
+		{
+			printf("Server: Connection limit reached. Refusing client ID: %d\n", client_fd);
+			close(client_fd);
+			continue;
+		}
+
+		struct connection *c = free_connections;
+		c->fd = client_fd;
+		applySocketProfile(client_fd, true);
+		c->last_activity = monotonicSeconds();
+		c->events = EPOLLIN;
+		c->input_length = 0;
+		c->output_start = 0;
+		c->output_length = 0;
+		c->deferred = false;
+		admitClient(&c->admission, client_addr.sin_addr.s_addr);
+
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = c;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0)
+		{
+			close(client_fd);
+			c->fd = -1;
+			continue;
+		}
+
+		free_connections = c->next_free;
+		active_connections++;
+		printf("Server: Client accepted! Client ID: %d (%d connected)\n", client_fd, active_connections);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Sends as much of the output buffer as the socket takes. Returns false if
+// the connection is broken
+//-----------------------------------------------------------------------------
+static bool flushOutput(struct connection *c)
+{
+	while (c->output_length > 0)
+	{
+		struct iovec iov[2];
+		int count = 1;
+		unsigned int first = OUTPUT_BUFFER_SIZE - c->output_start;
+		if (first > c->output_length) first = c->output_length;
+
+		iov[0].iov_base = c->output + c->output_start;
+		iov[0].iov_len = first;
+		if (first < c->output_length)
+		{
+			iov[1].iov_base = c->output;
+			iov[1].iov_len = c->output_length - first;
+			count = 2;
+		}
+
+		ssize_t sent = writev(c->fd, iov, count);
+		if (sent < 0)
+		{
+			if (errno == EINTR) continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK);
+		}
+
+		c->output_start = (c->output_start + sent) % OUTPUT_BUFFER_SIZE;
+		c->output_length -= sent;
+	}
+
+	c->output_start = 0;
+	return true;
+}
+
 //-----------------------------------------------------------------------------
-// Function to start the server. It receives the port number as argument and
-// creates an infinite loop to listen and parse the messages sent by the
-// clients
+// Appends a response to the output buffer. The caller makes sure it fits
 //-----------------------------------------------------------------------------
-void startServer(int port)
+static void queueOutput(struct connection *c, unsigned char *data, int size)
+{
+	unsigned int end = (c->output_start + c->output_length) % OUTPUT_BUFFER_SIZE;
+	unsigned int first = OUTPUT_BUFFER_SIZE - end;
+	if (first > (unsigned int)size) first = size;
+
+	memcpy(c->output + end, data, first);
+	memcpy(c->output, data + first, size - first);
+	c->output_length += size;
+}
+
+//-----------------------------------------------------------------------------
+// Holds the next request of a connection back until ready_at (ns), or until
+// the next scan if ready_at is 0. Each request is counted once, however many
+// times it has to wait
+//-----------------------------------------------------------------------------
+static void deferConnection(struct connection *c, long long ready_at)
+{
+	if (!c->deferred) countDeferredRequest(c->admission.client_class, ready_at != 0);
+
+	c->deferred = true;
+	c->ready_at = ready_at;
+	if (!c->listed)
+	{
+		c->listed = true;
+		deferred_connections[deferred_count++] = c;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Answers the complete requests on the input buffer of a connection, for as
+// long as the output buffer has room for the responses and the requests are
+// admitted. Pipelined requests are answered in order. Returns false if the
+// client sent an invalid header
+//-----------------------------------------------------------------------------
+static bool processInput(struct connection *c)
+{
+	unsigned char response[MAX_MODBUS_RESPONSE];
+	unsigned int consumed = 0;
+	bool held = false;
+
+	while (OUTPUT_BUFFER_SIZE - c->output_length >= MAX_MODBUS_RESPONSE)
+	{
+		int requestSize = frameModbusRequest(c->input + consumed, c->input_length - consumed);
+		if (requestSize < 0)
+		{
+			printf("Server: client ID: %d sent an invalid MBAP header\n", c->fd);
+			return false;
+		}
+		if (requestSize == 0) break;
+
+		if (!scanBudgetLeft(c->admission.client_class))
+		{
+			deferConnection(c, 0);
+			held = true;
+			break;
+		}
+		long long start = monotonicNanoseconds();
+		long long wait = admitRequest(&c->admission, start);
+		if (wait > 0)
+		{
+			deferConnection(c, start + wait);
+			held = true;
+			break;
+		}
+
+		int responseSize = processModbusRequest(c->input + consumed, requestSize, response);
+		queueOutput(c, response, responseSize);
+		consumed += requestSize;
+		chargeScanBudget(monotonicNanoseconds() - start);
+	}
+	if (!held) c->deferred = false;
+
+	c->input_length -= consumed;
+	memmove(c->input, c->input + consumed, c->input_length);
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Reads what a client sent and queues the responses. Returns false if the
+// connection must be closed
+//-----------------------------------------------------------------------------
+static bool serviceClient(struct connection *c)
+{
+	int messageSize = listenToClient(c->fd, c->input, c->input_length);
+	if (messageSize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	{
+		return true;
+	}
+	if (messageSize <= 0)
+	{
+		// something has gone wrong or the client has closed connection
+		if (messageSize == 0)
+		{
+			printf("Server: client ID: %d has closed the connection\n", c->fd);
+		}
+		else
+		{
+			printf("Server: Something is wrong with the client ID: %d (%s)\n", c->fd, strerror(errno));
+		}
+		return false;
+	}
+
+	c->last_activity = monotonicSeconds();
+	c->input_length += messageSize;
+	rearmQuickAck(c->fd);
+
+	return processInput(c) && flushOutput(c);
+}
+
+//-----------------------------------------------------------------------------
+// Registers the events a connection needs now. Clients that don't read
+// their responses, or whose requests are waiting to be admitted, are not
+// read from
+//-----------------------------------------------------------------------------
+static void updateConnectionEvents(struct connection *c)
+{
+	uint32_t wanted = 0;
+	if (OUTPUT_BUFFER_SIZE - c->output_length >= MAX_MODBUS_RESPONSE &&
+		c->input_length < MESSAGE_BUFFER_SIZE && !c->deferred) wanted |= EPOLLIN;
+	if (c->output_length > 0) wanted |= EPOLLOUT;
+	setConnectionEvents(c, wanted);
+}
+
+//-----------------------------------------------------------------------------
+// Serves the ready events of one client class
+//-----------------------------------------------------------------------------
+static void serviceEvents(struct epoll_event *events, int count, int client_class)
+{
+	for (int i = 0; i < count; i++)
+	{
+		struct connection *c = (struct connection *)events[i].data.ptr;
+		if (c == NULL || c->fd < 0 || c->admission.client_class != client_class) continue;
+
+		bool ok = !(events[i].events & (EPOLLERR | EPOLLHUP)) || (events[i].events & EPOLLIN);
+		if (ok && (events[i].events & EPOLLOUT))
+		{
+			//requests held back by a full output buffer go first
+			ok = flushOutput(c) && processInput(c) && flushOutput(c);
+		}
+		if (ok && (events[i].events & EPOLLIN) && (c->events & EPOLLIN))
+		{
+			ok = serviceClient(c);
+		}
+		if (!ok)
+		{
+			closeConnection(c);
+			continue;
+		}
+
+		updateConnectionEvents(c);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Retries the deferred requests that may be admitted now, high class first.
+// Returns how long epoll may wait before the next retry, in ms, or -1 if
+// nothing is deferred
+//-----------------------------------------------------------------------------
+static int serviceDeferred()
+{
+	long long now = monotonicNanoseconds();
+
+	for (int client_class = 0; client_class < NUM_CLIENT_CLASSES; client_class++)
+	{
+		for (int i = 0; i < deferred_count; i++)
+		{
+			struct connection *c = deferred_connections[i];
+			if (c->fd < 0 || !c->deferred || c->admission.client_class != client_class) continue;
+			if (c->ready_at > now) continue;
+
+			if (!(processInput(c) && flushOutput(c)))
+			{
+				closeConnection(c);
+				continue;
+			}
+			updateConnectionEvents(c);
+		}
+	}
+
+	//drop the connections that were served or closed, and find the next retry
+	long long next = -1;
+	int kept = 0;
+	for (int i = 0; i < deferred_count; i++)
+	{
+		struct connection *c = deferred_connections[i];
+		if (c->fd < 0 || !c->deferred)
+		{
+			c->listed = false;
+			continue;
+		}
+		deferred_connections[kept++] = c;
+
+		long long wait = (c->ready_at == 0) ? DEFERRED_POLL_MS * 1000000LL : c->ready_at - now;
+		if (next < 0 || wait < next) next = wait;
+	}
+	deferred_count = kept;
+
+	if (next < 0) return -1;
+	return (next + 999999) / 1000000;
+}
+
+//-----------------------------------------------------------------------------
+// Raises the limit of open files of the process, if needed, so the
+// connection limit can be reached
+//-----------------------------------------------------------------------------
+static void raiseFileLimit(int max_connections)
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+
+	rlim_t needed = max_connections + 64;
+	if (limit.rlim_cur >= needed) return;
+
+	limit.rlim_cur = (limit.rlim_max < needed) ? limit.rlim_max : needed;
+	if (setrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur < needed)
+	{
+		printf("Server: WARNING: open file limit is too low for %d connections\n", max_connections);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Allocates size bytes that are populated and locked in memory. Memory that
+// can't be locked is still populated, so it is only faulted in again if it
+// is swapped out
+//-----------------------------------------------------------------------------
+static void *allocateLocked(size_t size)
+{
+	void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (memory == MAP_FAILED) return NULL;
+
+	if (mlock(memory, size) != 0)
+	{
+		printf("Server: WARNING: Failed to lock %lu bytes of connection buffers\n", (unsigned long)size);
+	}
+	return memory;
+}
+
+//-----------------------------------------------------------------------------
+// Serves all clients from the calling thread. Never returns
+//-----------------------------------------------------------------------------
+static void runReactor(int socket_fd, int max_connections, int idle_timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	time_t last_sweep = monotonicSeconds();
+
+	raiseFileLimit(max_connections);
+	connections = (struct connection *)allocateLocked(max_connections * sizeof(struct connection));
+	deferred_connections = (struct connection **)allocateLocked(max_connections * sizeof(struct connection *));
+	if (connections == NULL || deferred_connections == NULL)
+	{
+		printf("Server: Can't allocate %d connections\n", max_connections);
+		exit(1);
+	}
+	for (int i = max_connections - 1; i >= 0; i--)
+	{
+		connections[i].fd = -1;
+		connections[i].next_free = free_connections;
+		free_connections = &connections[i];
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+	{
+		perror("Server: error creating epoll instance");
+		exit(1);
+	}
+
+	listen_fd = socket_fd;
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+	watchListeningSocket();
+
+	printf("Server: serving up to %d clients\n", max_connections);
+
+	int timeout = 1000;
+	while (1)
+	{
+		int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+
+		//new clients are accepted before any connection is served, so a
+		//connection closed below is not reused until the next wake-up
+		for (int i = 0; i < count; i++)
+		{
+			if (events[i].data.ptr == NULL) acceptClients();
+		}
+		for (int client_class = 0; client_class < NUM_CLIENT_CLASSES; client_class++)
+		{
+			serviceEvents(events, count, client_class);
+		}
+
+		timeout = 1000;
+		if (deferred_count > 0)
+		{
+			int retry = serviceDeferred();
+			if (retry >= 0 && retry < timeout) timeout = retry;
+		}
+
+		time_t now = monotonicSeconds();
+		if (idle_timeout > 0 && now != last_sweep)
+		{
+			last_sweep = now;
+			for (int i = 0; i < max_connections; i++)
+			{
+				if (connections[i].fd >= 0 && now - connections[i].last_activity > idle_timeout)
+				{
+					printf("Server: client ID: %d idle for %d seconds. Closing connection\n", connections[i].fd, idle_timeout);
+					closeConnection(&connections[i]);
+				}
+			}
+		}
+	}
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// Function to start the server. It receives the port number, the maximum
+// number of connected clients and the idle timeout in seconds (0 to keep
+// idle clients connected) as arguments and creates an infinite loop to
+// listen and parse the messages sent by the clients
+//-----------------------------------------------------------------------------
+void startServer(int port, int max_connections, int idle_timeout)
 {
 	int socket_fd, client_fd;
 
 	socket_fd = createSocket(port);
-	mapUnusedIO();
+
+#ifdef __linux__
+	runReactor(socket_fd, max_connections, idle_timeout);
+#endif
 
 	while(1)
 	{
@@ -0,0 +1,267 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file holds the scan cycle telemetry for the OpenPLC. The main loop
+// reports how long each phase of the scan took, and this file keeps latency
+// histograms, worst case values and overrun counters for them. The stats can
+// be read at runtime through a block of Modbus input registers or through
+// the shared memory segment STATS_SHM_FILE.
+//
+// Modbus input register layout (starting at MIN_STATS_RANGE). All values are
+// 32 bits wide, high word first:
+//   +0  scan count
+//   +2  overrun count
+//   +4  task interval (us)
+//   +6  one block of STATS_PHASE_REGS registers per phase, in the order
+//       input, logic, output, jitter, cycle:
+//         +0  last value (us)
+//         +2  worst value since reset (us)
+//         +4  average value (us)
+//         +6  histogram, STATS_HIST_BUCKETS counters. Bucket 0 counts
+//             samples below 1us and bucket N counts samples in the range
+//             [2^(N-1), 2^N) us. The last bucket also counts anything
+//             longer than that
+//   +236 admission counters of the Modbus/TCP server (see admission.cpp):
+//        throttled and deferred requests of the high, normal and low
+//        classes, then the scans on which the request budget ran out
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ladder.h"
+
+#define STATS_SHM_FILE          "/dev/shm/openplc_stats"
+#define STATS_HIST_BUCKETS      20
+#define STATS_HEADER_REGS       6
+#define STATS_PHASE_REGS        (6 + STATS_HIST_BUCKETS * 2)
+#define STATS_ADMISSION_REGS    (STATS_HEADER_REGS + STATS_NUM_PHASES * STATS_PHASE_REGS)
+
+struct phase_stats
+{
+    uint64_t count;
+    uint64_t last_ns;
+    uint64_t max_ns;
+    uint64_t total_ns;
+    uint32_t histogram[STATS_HIST_BUCKETS];
+};
+
+struct scan_stats
+{
+    //Odd while the scan thread is updating the stats. Readers must retry
+    //their copy if the sequence changed or was odd while they were reading
+    volatile uint32_t sequence;
+
+    //Any non zero value written here by an external tool resets the stats
+    //at the end of the next scan
+    volatile uint32_t reset_request;
+
+    uint64_t tick_ns;
+    uint64_t scan_count;
+    uint64_t overrun_count;
+    struct phase_stats phases[STATS_NUM_PHASES];
+};
+
+static struct scan_stats local_stats;
+static struct scan_stats *stats = &local_stats;
+
+//-----------------------------------------------------------------------------
+// Returns the difference between two timestamps in nanoseconds
+//-----------------------------------------------------------------------------
+long long timespecDiff(struct timespec *end, struct timespec *start)
+{
+    return (long long)(end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+//-----------------------------------------------------------------------------
+// Finds the histogram bucket for a sample
+//-----------------------------------------------------------------------------
+static int histogramBucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+
+    while (us > 0 && bucket < STATS_HIST_BUCKETS - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+//-----------------------------------------------------------------------------
+// Clears all counters, keeping only the task interval
+//-----------------------------------------------------------------------------
+static void clearScanStats()
+{
+    stats->scan_count = 0;
+    stats->overrun_count = 0;
+    memset(stats->phases, 0, sizeof(stats->phases));
+}
+
+//-----------------------------------------------------------------------------
+// Sets up the stats buffer. If the shared memory segment can't be created
+// the stats are still kept in a private buffer, so Modbus can serve them
+//-----------------------------------------------------------------------------
+void initializeScanStats()
+{
+    int fd = open(STATS_SHM_FILE, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(struct scan_stats)) < 0)
+    {
+        printf("WARNING: Failed to create scan stats segment %s\n", STATS_SHM_FILE);
+    }
+    else
+    {
+        void *segment = mmap(NULL, sizeof(struct scan_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (segment == MAP_FAILED)
+        {
+            printf("WARNING: Failed to map scan stats segment %s\n", STATS_SHM_FILE);
+        }
+        else
+        {
+            stats = (struct scan_stats *)segment;
+            memset(stats, 0, sizeof(struct scan_stats));
+        }
+    }
+    if (fd >= 0) close(fd);
+}
+
+//-----------------------------------------------------------------------------
+// Starts a stats update. Must be called by the scan thread before recording
+// the phases of a cycle
+//-----------------------------------------------------------------------------
+void beginScanStats()
+{
+    stats->sequence++;
+    __sync_synchronize();
+
+    //the tick changes when the program is replaced
+    stats->tick_ns = *plc_program->ticktime;
+}
+
+//-----------------------------------------------------------------------------
+// Records one sample for the given phase. Must be called between
+// beginScanStats() and endScanStats()
+//-----------------------------------------------------------------------------
+void recordScanPhase(int phase, long long ns)
+{
+    struct phase_stats *p = &stats->phases[phase];
+    if (ns < 0) ns = 0;
+
+    p->count++;
+    p->last_ns = ns;
+    p->total_ns += ns;
+    if ((uint64_t)ns > p->max_ns) p->max_ns = ns;
+    p->histogram[histogramBucket(ns)]++;
+}
+
+//-----------------------------------------------------------------------------
+// Closes the stats update for a cycle. The overrun flag tells if the cycle
+// finished after its deadline
+//-----------------------------------------------------------------------------
+void endScanStats(bool overrun)
+{
+    stats->scan_count++;
+    if (overrun) stats->overrun_count++;
+
+    if (stats->reset_request)
+    {
+        clearScanStats();
+        stats->reset_request = 0;
+    }
+
+    __sync_synchronize();
+    stats->sequence++;
+}
+
+//-----------------------------------------------------------------------------
+// Takes a consistent copy of the stats. Safe to call from any thread
+//-----------------------------------------------------------------------------
+static void copyScanStats(struct scan_stats *copy)
+{
+    uint32_t seq;
+    do
+    {
+        seq = stats->sequence;
+        __sync_synchronize();
+        memcpy(copy, stats, sizeof(struct scan_stats));
+        __sync_synchronize();
+    } while ((seq & 1) || seq != stats->sequence);
+}
+
+//-----------------------------------------------------------------------------
+// Helper to write a 32 bit value into two registers, high word first
+//-----------------------------------------------------------------------------
+static void putStatsValue(IEC_UINT *regs, int offset, uint64_t value)
+{
+    if (value > 0xffffffff) value = 0xffffffff;
+    regs[offset] = (IEC_UINT)(value >> 16);
+    regs[offset + 1] = (IEC_UINT)(value & 0xffff);
+}
+
+//-----------------------------------------------------------------------------
+// Fills dest with count stats registers starting at register start (relative
+// to MIN_STATS_RANGE). Registers outside the stats block read as zero
+//-----------------------------------------------------------------------------
+void readScanStatsRegisters(int start, int count, IEC_UINT *dest)
+{
+    IEC_UINT regs[MAX_STATS_RANGE - MIN_STATS_RANGE + 1];
+    struct scan_stats copy;
+
+    copyScanStats(&copy);
+    memset(regs, 0, sizeof(regs));
+
+    putStatsValue(regs, 0, copy.scan_count);
+    putStatsValue(regs, 2, copy.overrun_count);
+    putStatsValue(regs, 4, copy.tick_ns / 1000);
+
+    for (int i = 0; i < STATS_NUM_PHASES; i++)
+    {
+        struct phase_stats *p = &copy.phases[i];
+        int base = STATS_HEADER_REGS + i * STATS_PHASE_REGS;
+
+        putStatsValue(regs, base, p->last_ns / 1000);
+        putStatsValue(regs, base + 2, p->max_ns / 1000);
+        putStatsValue(regs, base + 4, p->count ? (p->total_ns / p->count) / 1000 : 0);
+        for (int j = 0; j < STATS_HIST_BUCKETS; j++)
+        {
+            putStatsValue(regs, base + 6 + j * 2, p->histogram[j]);
+        }
+    }
+
+    uint32_t counters[ADMISSION_COUNTERS];
+    readAdmissionCounters(counters);
+    for (int i = 0; i < ADMISSION_COUNTERS; i++)
+    {
+        putStatsValue(regs, STATS_ADMISSION_REGS + i * 2, counters[i]);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        int position = start + i;
+        if (position >= 0 && position <= MAX_STATS_RANGE - MIN_STATS_RANGE)
+            dest[i] = regs[position];
+        else
+            dest[i] = 0;
+    }
+}
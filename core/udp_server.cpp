@@ -0,0 +1,253 @@
+//-----------------------------------------------------------------------------
+// Copyright 2015 Thiago Alves
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file is the Modbus/UDP server of the OpenPLC. Every datagram carries
+// one request with its MBAP header, exactly as over TCP, and is answered with
+// one datagram by the PDU engine on modbus.cpp. There are no connections to
+// accept or keep, which suits clients that poll a few registers at a high
+// rate.
+//
+// On Linux, the datagrams waiting on the socket are received with a single
+// recvmmsg() call and all their responses are sent with a single sendmmsg()
+// call, so a burst of requests costs two system calls. Other systems receive
+// and answer one datagram at a time. Datagrams that don't hold exactly one
+// valid request are dropped.
+//
+// Each datagram is admitted as admission.cpp decides for its source address.
+// The token buckets of the recent clients are kept on a small table indexed
+// by address, so a client that shares its slot with another starts over with
+// a full bucket. A request that is over the limit of its class is dropped,
+// as there is no connection to hold it on.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "ladder.h"
+
+#define UDP_BATCH_SIZE          32      //datagrams per system call
+#define UDP_MAX_DATAGRAM        260     //MBAP header and the longest PDU
+#define UDP_CLIENT_SLOTS        64      //token buckets of the recent clients
+
+struct udp_datagram
+{
+    struct sockaddr_in client;
+    unsigned char request[UDP_MAX_DATAGRAM + 1];
+    unsigned char response[MAX_MODBUS_RESPONSE];
+};
+
+struct udp_client
+{
+    bool used;
+    uint32_t address;                   //network byte order
+    struct client_admission admission;
+};
+
+//Only used by the thread that serves the socket
+static struct udp_client clients[UDP_CLIENT_SLOTS];
+
+//-----------------------------------------------------------------------------
+// Creates the UDP socket and binds it to the port
+//-----------------------------------------------------------------------------
+static int createUdpSocket(int port)
+{
+    struct sockaddr_in server_addr;
+
+    int socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socket_fd < 0)
+    {
+        perror("Modbus/UDP: error creating socket");
+        return -1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("Modbus/UDP: error binding socket");
+        close(socket_fd);
+        return -1;
+    }
+    applySocketProfile(socket_fd, false);
+
+    return socket_fd;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the admission state of the client with the address, taking over
+// its slot if it belonged to another client
+//-----------------------------------------------------------------------------
+static struct client_admission *findClient(uint32_t address)
+{
+    struct udp_client *client = &clients[ntohl(address) % UDP_CLIENT_SLOTS];
+    if (!client->used || client->address != address)
+    {
+        client->used = true;
+        client->address = address;
+        admitClient(&client->admission, address);
+    }
+
+    return &client->admission;
+}
+
+//-----------------------------------------------------------------------------
+// Processes the request of a datagram. Returns the size of the response, or
+// 0 if the datagram must be dropped
+//-----------------------------------------------------------------------------
+static int processDatagram(struct udp_datagram *datagram, int size)
+{
+    if (size <= 0 || size > UDP_MAX_DATAGRAM) return 0;
+    if (frameModbusRequest(datagram->request, size) != size) return 0;
+
+    struct client_admission *admission = findClient(datagram->client.sin_addr.s_addr);
+    if (!scanBudgetLeft(admission->client_class))
+    {
+        countDeferredRequest(admission->client_class, false);
+        return 0;
+    }
+    long long start = monotonicNanoseconds();
+    if (admitRequest(admission, start) > 0)
+    {
+        countDeferredRequest(admission->client_class, true);
+        return 0;
+    }
+
+    int responseSize = processModbusRequest(datagram->request, size, datagram->response);
+    chargeScanBudget(monotonicNanoseconds() - start);
+
+    return responseSize;
+}
+
+#ifdef __linux__
+//-----------------------------------------------------------------------------
+// Serves requests a batch at a time. Never returns unless the socket fails
+//-----------------------------------------------------------------------------
+static void serveBatches(int socket_fd)
+{
+    static struct udp_datagram datagrams[UDP_BATCH_SIZE];
+    struct mmsghdr received[UDP_BATCH_SIZE];
+    struct mmsghdr replies[UDP_BATCH_SIZE];
+    struct iovec requestVectors[UDP_BATCH_SIZE];
+    struct iovec responseVectors[UDP_BATCH_SIZE];
+
+    memset(received, 0, sizeof(received));
+    for (int i = 0; i < UDP_BATCH_SIZE; i++)
+    {
+        requestVectors[i].iov_base = datagrams[i].request;
+        requestVectors[i].iov_len = sizeof(datagrams[i].request);
+        received[i].msg_hdr.msg_iov = &requestVectors[i];
+        received[i].msg_hdr.msg_iovlen = 1;
+        received[i].msg_hdr.msg_name = &datagrams[i].client;
+    }
+
+    while (1)
+    {
+        for (int i = 0; i < UDP_BATCH_SIZE; i++)
+        {
+            received[i].msg_hdr.msg_namelen = sizeof(datagrams[i].client);
+        }
+
+        //blocks for the first datagram only, then takes whatever else is queued
+        int count = recvmmsg(socket_fd, received, UDP_BATCH_SIZE, MSG_WAITFORONE, NULL);
+        if (count < 0)
+        {
+            if (errno == EINTR) continue;
+            perror("Modbus/UDP: error receiving");
+            return;
+        }
+
+        int replyCount = 0;
+        for (int i = 0; i < count; i++)
+        {
+            int responseSize = processDatagram(&datagrams[i], received[i].msg_len);
+            if (responseSize <= 0) continue;
+
+            struct mmsghdr *reply = &replies[replyCount];
+            memset(reply, 0, sizeof(*reply));
+            responseVectors[replyCount].iov_base = datagrams[i].response;
+            responseVectors[replyCount].iov_len = responseSize;
+            reply->msg_hdr.msg_iov = &responseVectors[replyCount];
+            reply->msg_hdr.msg_iovlen = 1;
+            reply->msg_hdr.msg_name = &datagrams[i].client;
+            reply->msg_hdr.msg_namelen = received[i].msg_hdr.msg_namelen;
+            replyCount++;
+        }
+
+        //sendmmsg may stop early, in which case the rest is sent again. A
+        //response that can't be sent is lost, as any other UDP datagram
+        int sent = 0;
+        while (sent < replyCount)
+        {
+            int n = sendmmsg(socket_fd, replies + sent, replyCount - sent, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0)
+            {
+                sent++;
+                continue;
+            }
+            sent += n;
+        }
+    }
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// Serves Modbus/UDP requests on the port. Only returns if the socket can't
+// be used
+//-----------------------------------------------------------------------------
+void startUdpServer(int port)
+{
+    int socket_fd = createUdpSocket(port);
+    if (socket_fd < 0) return;
+
+    printf("Modbus/UDP: Listening on port %d\n", port);
+
+#ifdef __linux__
+    serveBatches(socket_fd);
+#else
+    static struct udp_datagram datagram;
+    while (1)
+    {
+        socklen_t client_len = sizeof(datagram.client);
+        int size = recvfrom(socket_fd, datagram.request, sizeof(datagram.request), 0,
+                            (struct sockaddr *)&datagram.client, &client_len);
+        if (size < 0)
+        {
+            if (errno == EINTR) continue;
+            perror("Modbus/UDP: error receiving");
+            break;
+        }
+
+        int responseSize = processDatagram(&datagram, size);
+        if (responseSize > 0)
+        {
+            sendto(socket_fd, datagram.response, responseSize, 0, (struct sockaddr *)&datagram.client, client_len);
+        }
+    }
+#endif
+
+    close(socket_fd);
+}
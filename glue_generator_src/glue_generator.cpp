@@ -1,6 +1,9 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <sstream>
+#include <vector>
+#include <set>
 
 #include <string.h>
 #include <stdlib.h>
@@ -9,6 +12,9 @@ using namespace std;
 
 ifstream locatedVars;
 ofstream glueVars;
+stringstream bindingTable;
+stringstream variableDeclarations;
+stringstream variableTable;
 
 void generateHeader()
 {
@@ -40,41 +46,34 @@ void generateHeader()
 //-----------------------------------------------------------------------------\r\n\
 \r\n\
 #include \"iec_std_lib.h\"\r\n\
+#include \"POUS.h\"\r\n\
 \r\n\
 TIME __CURRENT_TIME;\r\n\
 extern unsigned long long common_ticktime__;\r\n\
 \r\n\
-//Internal buffers for I/O and memory. These buffers are defined in the\r\n\
-//auto-generated glueVars.cpp file\r\n\
+//Process image for I/O and memory. Located variables are bound directly\r\n\
+//to their positions on these buffers. The buffers belong to the runtime,\r\n\
+//so they outlive the program when it is swapped for a new one\r\n\
 #define BUFFER_SIZE		1024\r\n\
 \r\n\
 //Booleans\r\n\
-IEC_BOOL *bool_input[BUFFER_SIZE][8];\r\n\
-IEC_BOOL *bool_output[BUFFER_SIZE][8];\r\n\
+extern IEC_BOOL bool_input[BUFFER_SIZE][8];\r\n\
+extern IEC_BOOL bool_output[BUFFER_SIZE][8];\r\n\
 \r\n\
 //Bytes\r\n\
-IEC_BYTE *byte_input[BUFFER_SIZE];\r\n\
-IEC_BYTE *byte_output[BUFFER_SIZE];\r\n\
+extern IEC_BYTE byte_input[BUFFER_SIZE];\r\n\
+extern IEC_BYTE byte_output[BUFFER_SIZE];\r\n\
 \r\n\
 //Analog I/O\r\n\
-IEC_UINT *int_input[BUFFER_SIZE];\r\n\
-IEC_UINT *int_output[BUFFER_SIZE];\r\n\
+extern IEC_UINT int_input[BUFFER_SIZE];\r\n\
+extern IEC_UINT int_output[BUFFER_SIZE];\r\n\
 \r\n\
 //Memory\r\n\
-IEC_UINT *int_memory[BUFFER_SIZE];\r\n\
-IEC_DINT *dint_memory[BUFFER_SIZE];\r\n\
-IEC_LINT *lint_memory[BUFFER_SIZE];\r\n\
+extern IEC_UINT int_memory[BUFFER_SIZE];\r\n\
+extern IEC_DINT dint_memory[BUFFER_SIZE];\r\n\
+extern IEC_LINT lint_memory[BUFFER_SIZE];\r\n\
 \r\n\
-\r\n\
-#define __LOCATED_VAR(type, name, ...) type __##name;\r\n\
-#include \"LOCATED_VARIABLES.h\"\r\n\
-#undef __LOCATED_VAR\r\n\
-#define __LOCATED_VAR(type, name, ...) type* name = &__##name;\r\n\
-#include \"LOCATED_VARIABLES.h\"\r\n\
-#undef __LOCATED_VAR\r\n\
-\r\n\
-void glueVars()\r\n\
-{\r\n";
+//Located variables\r\n";
 
 	}
 
@@ -163,27 +162,28 @@ void glueVar(char *varName, char *varType)
 {
 	cout << "varName: " << varName << "\tvarType: " << varType << endl;
 	int pos1, pos2;
+	string location = "";
 
 	findPositions(varName, &pos1, &pos2);
 
-	if (pos2 >= 8)
+	if (pos1 >= 1024 || pos2 >= 8)
 	{
 		cout << "***Invalid addressing on located variable" << varName << "***" << endl;
 	}
 
-	if (varName[2] == 'I')
+	else if (varName[2] == 'I')
 	{
 		//INPUT
 		switch (varName[3])
 		{
 			case 'X':
-				glueVars << "\tbool_input[" << pos1 << "][" << pos2 << "] = " << varName << ";\r\n";
+				location = "bool_input[" + to_string(pos1) + "][" + to_string(pos2) + "]";
 				break;
 			case 'B':
-				glueVars << "\tbyte_input[" << pos1 << "] = " << varName << ";\r\n";
+				location = "byte_input[" + to_string(pos1) + "]";
 				break;
 			case 'W':
-				glueVars << "\tint_input[" << pos1 << "] = " << varName << ";\r\n";
+				location = "int_input[" + to_string(pos1) + "]";
 				break;
 		}
 	}
@@ -193,13 +193,13 @@ void glueVar(char *varName, char *varType)
 		switch (varName[3])
 		{
 			case 'X':
-				glueVars << "\tbool_output[" << pos1 << "][" << pos2 << "] = " << varName << ";\r\n";
+				location = "bool_output[" + to_string(pos1) + "][" + to_string(pos2) + "]";
 				break;
-           		case 'B':
-				glueVars << "\tbyte_output[" << pos1 << "] = " << varName << ";\r\n";
+			case 'B':
+				location = "byte_output[" + to_string(pos1) + "]";
 				break;
 			case 'W':
-				glueVars << "\tint_output[" << pos1 << "] = " << varName << ";\r\n";
+				location = "int_output[" + to_string(pos1) + "]";
 				break;
 		}
 	}
@@ -209,32 +209,224 @@ void glueVar(char *varName, char *varType)
 		switch (varName[3])
 		{
 			case 'W':
-				glueVars << "\tint_memory[" << pos1 << "] = " << varName << ";\r\n";
+				location = "int_memory[" + to_string(pos1) + "]";
 				break;
 			case 'D':
-				glueVars << "\tdint_memory[" << pos1 << "] = (IEC_DINT *)" << varName << ";\r\n";
+				location = "dint_memory[" + to_string(pos1) + "]";
 				break;
 			case 'L':
-				glueVars << "\tlint_memory[" << pos1 << "] = (IEC_LINT *)" << varName << ";\r\n";
+				location = "lint_memory[" + to_string(pos1) + "]";
 				break;
 		}
 	}
+
+	if (location != "")
+	{
+		//the variable lives directly on the process image
+		glueVars << varType << " *" << varName << " = (" << varType << " *)&" << location << ";\r\n";
+		bindingTable << "\t{\"" << varName << "\", (void **)&" << varName << ", (void *)&" << location << "},\r\n";
+	}
+	else
+	{
+		//locations without a place on the process image get their own storage
+		glueVars << varType << " __" << varName << ";\r\n";
+		glueVars << varType << " *" << varName << " = &__" << varName << ";\r\n";
+		bindingTable << "\t{\"" << varName << "\", (void **)&" << varName << ", NULL},\r\n";
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Converts a variable path from VARIABLES.csv to the C expression for it.
+// CONFIG0.GLOBAL is CONFIG0__GLOBAL, CONFIG0.RES0.GLOBAL is RES0__GLOBAL and
+// CONFIG0.RES0.INSTANCE0.VAR is RES0__INSTANCE0.VAR. The root symbol (the
+// part before the first dot of the expression) is stored on root
+//-----------------------------------------------------------------------------
+string variableExpression(string path, string *root)
+{
+	vector<string> parts;
+	stringstream pathStream(path);
+	string part;
+
+	while (getline(pathStream, part, '.'))
+	{
+		parts.push_back(part);
+	}
+
+	if (parts.size() < 2)
+	{
+		*root = "";
+		return "";
+	}
+	if (parts.size() == 2)
+	{
+		*root = parts[0] + "__" + parts[1];
+		return *root;
+	}
+
+	*root = parts[1] + "__" + parts[2];
+	string expression = *root;
+	for (size_t i = 3; i < parts.size(); i++)
+	{
+		expression += "." + parts[i];
+	}
+
+	return expression;
+}
+
+//-----------------------------------------------------------------------------
+// Reads VARIABLES.csv and lists every variable that holds program state, so
+// the runtime can carry it over to a new program. Located and external
+// variables are left out, since their values live somewhere else
+//-----------------------------------------------------------------------------
+void parseProgramVariables()
+{
+	ifstream variablesFile("VARIABLES.csv", ios::in);
+	set<string> declaredRoots;
+	string line;
+	bool inPrograms = false, inVariables = false;
+
+	if (!variablesFile.is_open())
+	{
+		cout << "VARIABLES.csv not found. Program state will not be kept on a program swap" << endl;
+		return;
+	}
+
+	while (getline(variablesFile, line))
+	{
+		if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+		if (line.compare(0, 2, "//") == 0)
+		{
+			inPrograms = (line.find("Programs") != string::npos);
+			inVariables = (line.find("Variables") != string::npos);
+			continue;
+		}
+		if (line.empty() || (!inPrograms && !inVariables)) continue;
+
+		vector<string> fields;
+		stringstream lineStream(line);
+		string field;
+		while (getline(lineStream, field, ';'))
+		{
+			fields.push_back(field);
+		}
+
+		string root;
+		if (inPrograms && fields.size() >= 3)
+		{
+			//0;CONFIG0.RES0.INSTANCE0;PROGRAM0;
+			variableExpression(fields[1] + ".X", &root);
+			if (declaredRoots.insert(root).second)
+			{
+				variableDeclarations << "extern " << fields[2] << " " << root << ";\r\n";
+			}
+		}
+		else if (inVariables && fields.size() >= 5)
+		{
+			//0;VAR;CONFIG0.RES0.INSTANCE0.COUNTER;CONFIG0.RES0.INSTANCE0.COUNTER;INT;
+			string varClass = fields[1];
+			string expression = variableExpression(fields[3], &root);
+			if (expression == "" || expression.find("__debug") != string::npos) continue;
+
+			//globals are declared the first time they show up
+			if (expression == root && declaredRoots.insert(root).second)
+			{
+				if (varClass == "FB")
+					variableDeclarations << "extern " << fields[4] << " " << root << ";\r\n";
+				else if (varClass == "VAR")
+					variableDeclarations << "extern __IEC_" << fields[4] << "_t " << root << ";\r\n";
+			}
+
+			if (varClass != "VAR" || declaredRoots.count(root) == 0) continue;
+			variableTable << "\t{\"" << fields[2] << "\", \"" << fields[4] << "\", (void *)&" << expression;
+			variableTable << ", sizeof(" << expression << ")},\r\n";
+		}
+	}
 }
 
 void generateBottom()
 {
-	glueVars << "}\r\n\
+	glueVars << "\r\n\
+//Binding table. Lists where each located variable must point to on the\r\n\
+//process image (NULL if it has its own storage). The last entry is empty.\r\n\
+//This struct must match the one declared on ladder.h\r\n\
+struct located_binding\r\n\
+{\r\n\
+	const char *name;\r\n\
+	void **pointer;\r\n\
+	void *location;\r\n\
+};\r\n\
 \r\n\
-void updateTime()\r\n\
+struct located_binding located_bindings[] =\r\n\
+{\r\n";
+
+	glueVars << bindingTable.str();
+
+	glueVars << "\
+	{NULL, NULL, NULL}\r\n\
+};\r\n\
+\r\n\
+//Program variables, from VARIABLES.csv. When the runtime swaps programs,\r\n\
+//it copies every variable whose name and type match on both programs.\r\n\
+//This struct must match the one declared on ladder.h\r\n\
+struct program_variable\r\n\
+{\r\n\
+	const char *name;\r\n\
+	const char *type;\r\n\
+	void *pointer;\r\n\
+	unsigned int size;\r\n\
+};\r\n\
+\r\n";
+
+	glueVars << variableDeclarations.str();
+
+	glueVars << "\
+\r\n\
+struct program_variable program_variables[] =\r\n\
+{\r\n";
+
+	glueVars << variableTable.str();
+
+	glueVars << "\
+	{NULL, NULL, NULL, 0}\r\n\
+};\r\n\
+\r\n\
+//The main loop passes the monotonic time since the first scan, so the IEC\r\n\
+//timers don't drift when a scan overruns\r\n\
+void updateTime(unsigned long long elapsed_ns)\r\n\
 {\r\n\
-	__CURRENT_TIME.tv_nsec += common_ticktime__;\r\n\
+	__CURRENT_TIME.tv_sec = elapsed_ns / 1000000000ULL;\r\n\
+	__CURRENT_TIME.tv_nsec = elapsed_ns % 1000000000ULL;\r\n\
+}\r\n\
 \r\n\
-	if (__CURRENT_TIME.tv_nsec >= 1000000000)\r\n\
-	{\r\n\
-		__CURRENT_TIME.tv_nsec -= 1000000000;\r\n\
-		__CURRENT_TIME.tv_sec += 1;\r\n\
-	}\r\n\
-}";
+//Entry points of the program. The runtime looks plc_program_entry up by\r\n\
+//name when it loads the program, so it is the only symbol it needs.\r\n\
+//This struct must match the one declared on ladder.h\r\n\
+void config_init__(void);\r\n\
+void config_run__(unsigned long tick);\r\n\
+extern __IEC_TASK_t *config_tasks__[] __attribute__((weak));\r\n\
+\r\n\
+struct plc_program\r\n\
+{\r\n\
+	void (*init)(void);\r\n\
+	void (*run)(unsigned long tick);\r\n\
+	void (*update_time)(unsigned long long elapsed_ns);\r\n\
+	__IEC_TASK_t **tasks;\r\n\
+	struct located_binding *bindings;\r\n\
+	struct program_variable *variables;\r\n\
+	unsigned long long *ticktime;\r\n\
+};\r\n\
+\r\n\
+extern \"C\" struct plc_program plc_program_entry;\r\n\
+struct plc_program plc_program_entry =\r\n\
+{\r\n\
+	config_init__,\r\n\
+	config_run__,\r\n\
+	updateTime,\r\n\
+	config_tasks__,\r\n\
+	located_bindings,\r\n\
+	program_variables,\r\n\
+	&common_ticktime__\r\n\
+};";
 }
 
 int main()
@@ -251,6 +443,7 @@ int main()
 		glueVar(iecVar_name, iecVar_type);
 	}
 
+	parseProgramVariables();
 	generateBottom();
 
 	return 0;
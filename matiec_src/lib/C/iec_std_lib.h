@@ -57,6 +57,31 @@
 extern TIME __CURRENT_TIME;
 extern BOOL __DEBUG;
 
+/*
+ * Task table entry, generated for every TASK of a RESOURCE so the runtime
+ * can run each task on its own instead of calling config_run__().
+ * interval is in ns (0 for tasks without INTERVAL), and priority is the IEC
+ * priority (0 is the highest, -1 for the programs without task). SINGLE
+ * tasks have a trigger, which returns TRUE on a rising edge of the SINGLE
+ * data source (NULL for cyclic tasks). vars lists the located variables
+ * of the programs of the task, ended by a NULL pointer, or is NULL if the
+ * programs may also reach them through global variables or connections.
+ */
+typedef struct {
+    void **pointer;
+    IEC_BYTE *flags;
+    unsigned int size;
+} __IEC_TASK_VAR_t;
+
+typedef struct {
+    const char *name;
+    unsigned long long interval;
+    int priority;
+    void (*run)(unsigned long tick);
+    BOOL (*trigger)(void);
+    __IEC_TASK_VAR_t *vars;
+} __IEC_TASK_t;
+
 /* TODO
 typedef struct {
     __strlen_t len;
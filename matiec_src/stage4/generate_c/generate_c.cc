@@ -89,6 +89,21 @@
 /* Idem as body, but for run CONFIG and RESOURCE function */
 #define FB_RUN_SUFFIX "_run__"
 
+/* Idem as body, but for the entry point of each TASK of a RESOURCE, for the
+ * trigger of each SINGLE TASK, for the located variables used by each TASK,
+ * and for the table of tasks of a RESOURCE.
+ *
+ * e.g.: TASK FAST (INTERVAL := T#1ms, PRIORITY := 1) on RESOURCE RES0
+ * is mapped onto a RES0__FAST_task__ function, listed on RES0_tasks__
+ * together with its RES0__FAST_vars__ located variables
+ * e.g.: TASK TRIP (SINGLE := STOP, PRIORITY := 0) on RESOURCE RES0
+ * is also given a RES0__TRIP_trigger__ function
+ */
+#define TASK_ENTRY_SUFFIX "_task__"
+#define TASK_TRIGGER_SUFFIX "_trigger__"
+#define TASK_VARS_SUFFIX "_vars__"
+#define TASK_TABLE_SUFFIX "_tasks__"
+
 /* The FB body function is passed as the only parameter a pointer to the FB data
  * structure instance. The name of this parameter is given by the following constant.
  * In order not to clash with any variable in the IL and ST source codem the
@@ -1353,7 +1368,9 @@ class generate_c_config_c: public generate_c_base_and_typeid_c {
       initprotos_dt,
       initdeclare_dt,
       runprotos_dt,
-      rundeclare_dt
+      rundeclare_dt,
+      taskprotos_dt,
+      taskdeclare_dt
     } declaretype_t;
 
     declaretype_t wanted_declaretype;
@@ -1487,7 +1504,22 @@ void *visit(configuration_declaration_c *symbol) {
 
   /* (C.3) Close Public Function body */
   s4o.indent_left();
-  s4o.print(s4o.indent_spaces + "}\n");
+  s4o.print(s4o.indent_spaces + "}\n\n");
+
+  /* (D) Task tables, for runtimes that run each task on its own */
+  /* (D.1) Resources task tables protos... */
+  wanted_declaretype = taskprotos_dt;
+  symbol->resource_declarations->accept(*this);
+  s4o.print("\n");
+
+  /* (D.2) NULL terminated list of the resources task tables... */
+  s4o.print(s4o.indent_spaces + "__IEC_TASK_t *config_tasks__[] = {\n");
+  s4o.indent_right();
+  wanted_declaretype = taskdeclare_dt;
+  symbol->resource_declarations->accept(*this);
+  s4o.print(s4o.indent_spaces + "NULL\n");
+  s4o.indent_left();
+  s4o.print(s4o.indent_spaces + "};\n");
 
   return NULL;
 }
@@ -1517,6 +1549,18 @@ void *visit(resource_declaration_c *symbol) {
       s4o.print("(tick);\n");
     }
   }
+  if (wanted_declaretype == taskprotos_dt) {
+    s4o.print(s4o.indent_spaces + "extern __IEC_TASK_t ");
+    symbol->resource_name->accept(*this);
+    s4o.print(TASK_TABLE_SUFFIX);
+    s4o.print("[];\n");
+  }
+  if (wanted_declaretype == taskdeclare_dt) {
+    s4o.print(s4o.indent_spaces);
+    symbol->resource_name->accept(*this);
+    s4o.print(TASK_TABLE_SUFFIX);
+    s4o.print(",\n");
+  }
   return NULL;
 }
 
@@ -1543,6 +1587,16 @@ void *visit(single_resource_declaration_c *symbol) {
       s4o.print("(tick);\n");
     }
   }
+  if (wanted_declaretype == taskprotos_dt) {
+    s4o.print(s4o.indent_spaces + "extern __IEC_TASK_t RESOURCE");
+    s4o.print(TASK_TABLE_SUFFIX);
+    s4o.print("[];\n");
+  }
+  if (wanted_declaretype == taskdeclare_dt) {
+    s4o.print(s4o.indent_spaces + "RESOURCE");
+    s4o.print(TASK_TABLE_SUFFIX);
+    s4o.print(",\n");
+  }
   return NULL;
 }
 
@@ -1571,6 +1625,11 @@ class generate_c_resources_c: public generate_c_base_and_typeid_c {
     symbol_c *current_global_vars;
     bool configuration_name;
     stage4out_c *s4o_ptr;
+    /* The task whose programs are being printed on a task entry point (NULL for the programs without task)... */
+    symbol_c *wanted_task_name;
+    symbol_c *current_program_configuration_list;
+    /* true when the programs may reach located variables that are not their own (globals or connections)... */
+    bool task_vars_shared;
 
   public:
     generate_c_resources_c(stage4out_c *s4o_ptr, symbol_c *config_scope, symbol_c *resource_scope, unsigned long time)
@@ -1583,6 +1642,9 @@ class generate_c_resources_c: public generate_c_base_and_typeid_c {
       current_task_name = NULL;
       current_global_vars = NULL;
       configuration_name = false;
+      wanted_task_name = NULL;
+      current_program_configuration_list = NULL;
+      task_vars_shared = true;
       generate_c_resources_c::s4o_ptr = s4o_ptr;
     };
 
@@ -1594,7 +1656,10 @@ class generate_c_resources_c: public generate_c_base_and_typeid_c {
     typedef enum {
       declare_dt,
       init_dt,
-      run_dt
+      run_dt,
+      task_run_dt,
+      task_vars_dt,
+      task_table_dt
     } declaretype_t;
 
     declaretype_t wanted_declaretype;
@@ -1619,6 +1684,234 @@ class generate_c_resources_c: public generate_c_base_and_typeid_c {
     /* variable used to store the qualifier of program currently being processed... */
     unsigned int current_varqualifier;
 
+    /* Returns true if any program of the resource is not associated to a task */
+    bool has_programs_without_task(symbol_c *program_configuration_list) {
+      list_c *list = dynamic_cast<list_c *>(program_configuration_list);
+      if (NULL == list) ERROR;
+      for (int i = 0; i < list->n; i++) {
+        program_configuration_c *program = dynamic_cast<program_configuration_c *>(list->elements[i]);
+        if ((NULL != program) && (NULL == program->task_name))
+          return true;
+      }
+      return false;
+    }
+
+    /* Returns true if the programs of the resource may reach located variables
+     * through global variables or program connections, which are shared by
+     * all tasks and can't be copied for each task
+     */
+    bool has_shared_variables(symbol_c *program_configuration_list) {
+      configuration_declaration_c *configuration = dynamic_cast<configuration_declaration_c *>(current_configuration);
+      if ((NULL != configuration) && (NULL != configuration->global_var_declarations))
+        return true;
+      if (NULL != current_global_vars)
+        return true;
+      list_c *list = dynamic_cast<list_c *>(program_configuration_list);
+      if (NULL == list) ERROR;
+      for (int i = 0; i < list->n; i++) {
+        program_configuration_c *program = dynamic_cast<program_configuration_c *>(list->elements[i]);
+        if ((NULL != program) && (NULL != program->prog_conf_elements))
+          return true;
+      }
+      return false;
+    }
+
+    /* Returns true if the program runs on the task (NULL for the programs without task) */
+    bool runs_on_task(program_configuration_c *symbol, symbol_c *task_name) {
+      if (task_name == NULL)
+        return (symbol->task_name == NULL);
+      return ((symbol->task_name != NULL) && (compare_identifiers(symbol->task_name, task_name) == 0));
+    }
+
+    /* RES0__FAST_task__ for the task FAST, or RES0_task__ for the programs without task */
+    void print_task_entry_name(symbol_c *task_name) {
+      current_resource_name->accept(*this);
+      if (task_name != NULL) {
+        s4o.print("__");
+        task_name->accept(*this);
+      }
+      s4o.print(TASK_ENTRY_SUFFIX);
+    }
+
+    /* Entry point of a task, running only the programs associated to it */
+    void print_task_entry(symbol_c *task_name) {
+      s4o.print("void ");
+      print_task_entry_name(task_name);
+      s4o.print("(unsigned long tick) {\n");
+      s4o.indent_right();
+
+      wanted_declaretype = task_run_dt;
+      wanted_task_name = task_name;
+      current_program_configuration_list->accept(*this);
+      wanted_task_name = NULL;
+
+      s4o.indent_left();
+      s4o.print("}\n\n");
+
+      if (!task_vars_shared)
+        print_task_vars(task_name);
+    }
+
+    /* RES0__FAST_vars__ for the task FAST, or RES0_vars__ for the programs without task */
+    void print_task_vars_name(symbol_c *task_name) {
+      current_resource_name->accept(*this);
+      if (task_name != NULL) {
+        s4o.print("__");
+        task_name->accept(*this);
+      }
+      s4o.print(TASK_VARS_SUFFIX);
+    }
+
+    /* Located variables on the task table entry, NULL if they are shared */
+    void print_task_vars_entry(symbol_c *task_name) {
+      if (task_vars_shared)
+        s4o.print("NULL");
+      else
+        print_task_vars_name(task_name);
+    }
+
+    /* Located variables of the programs of a task, terminated by a NULL pointer.
+     * The runtime may point them to a copy of the process image of its own
+     * while the task runs.
+     */
+    void print_task_vars(symbol_c *task_name) {
+      s4o.print("__IEC_TASK_VAR_t ");
+      print_task_vars_name(task_name);
+      s4o.print("[] = {\n");
+      s4o.indent_right();
+
+      wanted_declaretype = task_vars_dt;
+      wanted_task_name = task_name;
+      current_program_configuration_list->accept(*this);
+      wanted_task_name = NULL;
+
+      s4o.print(s4o.indent_spaces + "{NULL, NULL, 0}\n");
+      s4o.indent_left();
+      s4o.print("};\n\n");
+      wanted_declaretype = task_run_dt;
+    }
+
+    /* One entry for every located variable declared by the program */
+    void print_program_vars(program_configuration_c *symbol) {
+      program_type_symtable_t::iterator iter = program_type_symtable.find(symbol->program_type_name);
+      if (iter == program_type_symtable.end()) ERROR; // The program being called MUST be in the symtable.
+      list_c *var_declarations = dynamic_cast<list_c *>(iter->second->var_declarations);
+      if (NULL == var_declarations) ERROR;
+
+      for (int i = 0; i < var_declarations->n; i++) {
+        located_var_declarations_c *located = dynamic_cast<located_var_declarations_c *>(var_declarations->elements[i]);
+        if (NULL == located)
+          continue;
+        list_c *located_var_decl_list = dynamic_cast<list_c *>(located->located_var_decl_list);
+        if (NULL == located_var_decl_list) ERROR;
+        for (int j = 0; j < located_var_decl_list->n; j++) {
+          located_var_decl_c *located_var_decl = dynamic_cast<located_var_decl_c *>(located_var_decl_list->elements[j]);
+          if (NULL == located_var_decl) ERROR;
+          /* unnamed located variables are named after their location */
+          symbol_c *var_name = located_var_decl->variable_name;
+          if (var_name == NULL)
+            var_name = located_var_decl->location;
+
+          s4o.print(s4o.indent_spaces + "{(void **)&");
+          symbol->program_name->accept(*this);
+          s4o.print(".");
+          var_name->accept(*this);
+          s4o.print(".value, &");
+          symbol->program_name->accept(*this);
+          s4o.print(".");
+          var_name->accept(*this);
+          s4o.print(".flags, sizeof(*");
+          symbol->program_name->accept(*this);
+          s4o.print(".");
+          var_name->accept(*this);
+          s4o.print(".value)},\n");
+        }
+      }
+    }
+
+    /* RES0__TRIP_trigger__ for the SINGLE task TRIP */
+    void print_task_trigger_name(symbol_c *task_name) {
+      current_resource_name->accept(*this);
+      s4o.print("__");
+      task_name->accept(*this);
+      s4o.print(TASK_TRIGGER_SUFFIX);
+    }
+
+    /* Feeds the SINGLE data source of the current task into its R_TRIG */
+    void print_single_edge(task_initialization_c *symbol) {
+      symbol_c *config_var_decl = NULL;
+      symbol_c *res_var_decl = NULL;
+      s4o.print(s4o.indent_spaces + "{");
+      symbol_c *current_var_reference = ((global_var_reference_c *)(symbol->single_data_source))->global_var_name;
+      res_var_decl = search_resource_instance->get_decl(current_var_reference);
+      if (res_var_decl == NULL) {
+        config_var_decl = search_config_instance->get_decl(current_var_reference);
+        if (config_var_decl == NULL)
+          ERROR;
+        config_var_decl->accept(*this);
+      }
+      else {
+        res_var_decl->accept(*this);
+      }
+      s4o.print("* ");
+      symbol->single_data_source->accept(*this);
+      s4o.print(" = __GET_GLOBAL_");
+      symbol->single_data_source->accept(*this);
+      s4o.print("();");
+      s4o.print(SET_VAR);
+      s4o.print("(");
+      current_task_name->accept(*this);
+      s4o.print("_R_TRIG.,CLK,, *");
+      symbol->single_data_source->accept(*this);
+      s4o.print(");}\n");
+      s4o.print(s4o.indent_spaces + "R_TRIG");
+      s4o.print(FB_FUNCTION_SUFFIX);
+      s4o.print("(&");
+      current_task_name->accept(*this);
+      s4o.print("_R_TRIG);\n");
+    }
+
+    /* Trigger of a SINGLE task, returning TRUE on a rising edge of its data source */
+    void print_task_trigger(task_initialization_c *symbol) {
+      s4o.print("BOOL ");
+      print_task_trigger_name(current_task_name);
+      s4o.print("(void) {\n");
+      s4o.indent_right();
+
+      print_single_edge(symbol);
+      s4o.print(s4o.indent_spaces + "return ");
+      s4o.print(GET_VAR);
+      s4o.print("(");
+      current_task_name->accept(*this);
+      s4o.print("_R_TRIG.Q);\n");
+
+      s4o.indent_left();
+      s4o.print("}\n\n");
+    }
+
+    /* Copies the program inputs, runs the program and copies the program outputs */
+    void print_program_run(program_configuration_c *symbol) {
+      { identifier_c *tmp_id = dynamic_cast<identifier_c*>(symbol->program_name);
+        if (NULL == tmp_id) ERROR;
+        current_program_name = tmp_id->value;
+      }
+
+      wanted_assigntype = assign_at;
+      if (symbol->prog_conf_elements != NULL)
+        symbol->prog_conf_elements->accept(*this);
+
+      s4o.print(s4o.indent_spaces);
+      symbol->program_type_name->accept(*this);
+      s4o.print(FB_FUNCTION_SUFFIX);
+      s4o.print("(&");
+      symbol->program_name->accept(*this);
+      s4o.print(");\n");
+
+      wanted_assigntype = send_at;
+      if (symbol->prog_conf_elements != NULL)
+        symbol->prog_conf_elements->accept(*this);
+    }
+
     void *print_retain(void) {
       s4o.print(",");
       switch (current_varqualifier) {
@@ -1817,6 +2110,42 @@ END_RESOURCE
       s4o.indent_left();
       s4o.print("}\n\n");
       
+      /* (D) Task entry points, for runtimes that run each task on its own... */
+      /* (D.1) One entry point per task... */
+      current_program_configuration_list = symbol->program_configuration_list;
+      task_vars_shared = has_shared_variables(symbol->program_configuration_list);
+      wanted_declaretype = task_run_dt;
+      symbol->task_configuration_list->accept(*this);
+      
+      /* (D.2) Programs without task run on every tick... */
+      bool programs_without_task = has_programs_without_task(symbol->program_configuration_list);
+      if (programs_without_task)
+        print_task_entry(NULL);
+      
+      /* (D.3) Task table, terminated by an entry with a NULL name... */
+      s4o.print("__IEC_TASK_t ");
+      current_resource_name->accept(*this);
+      s4o.print(TASK_TABLE_SUFFIX);
+      s4o.print("[] = {\n");
+      s4o.indent_right();
+      wanted_declaretype = task_table_dt;
+      symbol->task_configuration_list->accept(*this);
+      if (programs_without_task) {
+        s4o.print(s4o.indent_spaces + "{\"");
+        current_resource_name->accept(*this);
+        s4o.print("\", ");
+        s4o.print_long_long_integer(common_ticktime);
+        s4o.print(", -1, ");
+        print_task_entry_name(NULL);
+        s4o.print(", NULL, ");
+        print_task_vars_entry(NULL);
+        s4o.print("},\n");
+      }
+      s4o.print(s4o.indent_spaces + "{NULL, 0, 0, NULL, NULL, NULL}\n");
+      s4o.indent_left();
+      s4o.print("};\n\n");
+      current_program_configuration_list = NULL;
+      
       if (single_resource) {
         delete current_resource_name;
         current_resource_name = NULL;
@@ -1855,10 +2184,6 @@ END_RESOURCE
           s4o.print(");\n");
           break;
         case run_dt: 
-          { identifier_c *tmp_id = dynamic_cast<identifier_c*>(symbol->program_name);
-            if (NULL == tmp_id) ERROR;
-            current_program_name = tmp_id->value;
-	  }
           if (symbol->task_name != NULL) {
             s4o.print(s4o.indent_spaces);
             s4o.print("if (");
@@ -1867,26 +2192,21 @@ END_RESOURCE
             s4o.indent_right(); 
           }
         
-          wanted_assigntype = assign_at;
-          if (symbol->prog_conf_elements != NULL)
-            symbol->prog_conf_elements->accept(*this);
-          
-          s4o.print(s4o.indent_spaces);
-          symbol->program_type_name->accept(*this);
-          s4o.print(FB_FUNCTION_SUFFIX);
-          s4o.print("(&");
-          symbol->program_name->accept(*this);
-          s4o.print(");\n");
-          
-          wanted_assigntype = send_at;
-          if (symbol->prog_conf_elements != NULL)
-            symbol->prog_conf_elements->accept(*this);
+          print_program_run(symbol);
           
           if (symbol->task_name != NULL) {
             s4o.indent_left();
             s4o.print(s4o.indent_spaces + "}\n");
           }
           break;
+        case task_run_dt:
+          if (runs_on_task(symbol, wanted_task_name))
+            print_program_run(symbol);
+          break;
+        case task_vars_dt:
+          if (runs_on_task(symbol, wanted_task_name))
+            print_program_vars(symbol);
+          break;
         default:
           break;
       }
@@ -1913,6 +2233,39 @@ END_RESOURCE
         case run_dt:
           symbol->task_initialization->accept(*this);
           break;
+        case task_run_dt:
+          print_task_entry(current_task_name);
+          { task_initialization_c *task_initialization = dynamic_cast<task_initialization_c *>(symbol->task_initialization);
+            if (NULL == task_initialization) ERROR;
+            if (task_initialization->single_data_source != NULL)
+              print_task_trigger(task_initialization);
+          }
+          break;
+        case task_table_dt:
+          { task_initialization_c *task_initialization = dynamic_cast<task_initialization_c *>(symbol->task_initialization);
+            if (NULL == task_initialization) ERROR;
+            unsigned long long interval = 0;
+            if (task_initialization->interval_data_source != NULL)
+              interval = calculate_time(task_initialization->interval_data_source);
+
+            s4o.print(s4o.indent_spaces + "{\"");
+            current_task_name->accept(*this);
+            s4o.print("\", ");
+            s4o.print_long_long_integer(interval);
+            s4o.print(", ");
+            task_initialization->priority_data_source->accept(*this);
+            s4o.print(", ");
+            print_task_entry_name(current_task_name);
+            s4o.print(", ");
+            if (task_initialization->single_data_source != NULL)
+              print_task_trigger_name(current_task_name);
+            else
+              s4o.print("NULL");
+            s4o.print(", ");
+            print_task_vars_entry(current_task_name);
+            s4o.print("},\n");
+          }
+          break;
         default:
           break;
       }
@@ -1942,36 +2295,7 @@ END_RESOURCE
           break;
         case run_dt:
           if (symbol->single_data_source != NULL) {
-            symbol_c *config_var_decl = NULL;
-            symbol_c *res_var_decl = NULL;
-            s4o.print(s4o.indent_spaces + "{");
-            symbol_c *current_var_reference = ((global_var_reference_c *)(symbol->single_data_source))->global_var_name;
-            res_var_decl = search_resource_instance->get_decl(current_var_reference);
-            if (res_var_decl == NULL) {
-              config_var_decl = search_config_instance->get_decl(current_var_reference);
-              if (config_var_decl == NULL)
-                ERROR;
-              config_var_decl->accept(*this);
-            }
-            else {
-              res_var_decl->accept(*this);
-            }
-            s4o.print("* ");
-            symbol->single_data_source->accept(*this);
-            s4o.print(" = __GET_GLOBAL_");
-            symbol->single_data_source->accept(*this);
-            s4o.print("();");
-            s4o.print(SET_VAR);
-            s4o.print("(");
-            current_task_name->accept(*this);
-            s4o.print("_R_TRIG.,CLK,, *");
-            symbol->single_data_source->accept(*this);
-            s4o.print(");}\n");
-            s4o.print(s4o.indent_spaces + "R_TRIG");
-            s4o.print(FB_FUNCTION_SUFFIX);
-            s4o.print("(&");
-            current_task_name->accept(*this);
-            s4o.print("_R_TRIG);\n");
+            print_single_edge(symbol);
             s4o.print(s4o.indent_spaces);
             current_task_name->accept(*this);
             s4o.print(" = ");
@@ -3,25 +3,16 @@ var multer = require('multer');
 var app = express();
 var upload = multer({ dest: './st_files/'});
 var spawn = require('child_process').spawn;
+var fs = require('fs');
+var crypto = require('crypto');
 var plcLog = '';
 
-var openplc = spawn('./core/openplc');
-openplc.stdout.on('data', function(data)
-{
-	plcLog += data;
-	plcLog += '\r\n';
-});
-openplc.stderr.on('data', function(data)
-{
-	plcLog += data;
-	plcLog += '\r\n';
-});
-openplc.on('close', function(code)
-{
-	plcLog += 'OpenPLC application terminated\r\n';
-});
+var openplc;
+var plcRunning = false;
+startOpenPLC();
 
-var plcRunning = true;
+//an uploaded modbus configuration is only read when the runtime starts
+var modbusConfigChanged = false;
 var compilationOutput = '';
 var compilationEnded = false;
 var compilationSuccess = false;
@@ -55,23 +46,7 @@ app.get('/run',function(req,res)
 	{
 		console.log('Starting OpenPLC Software...');
 		plcLog = 'Starting OpenPLC Application...\r\n';
-		openplc = spawn('./core/openplc');
-		openplc.stdout.on('data', function(data)
-		{
-			plcLog += data;
-			plcLog += '\r\n';
-		});
-		openplc.stderr.on('data', function(data)
-		{
-			plcLog += data;
-			plcLog += '\r\n';
-		});
-		openplc.on('close', function(code)
-		{
-			plcLog += 'OpenPLC application terminated\r\n';
-		});
-		
-		plcRunning = true;
+		startOpenPLC();
 	}
 	
 	var htmlString = '\
@@ -125,9 +100,7 @@ app.post('/api/upload',function(req,res)
 		res.send(htmlString);
 		
 		console.log(uploadedFileName + ' uploaded to  ' + uploadedFilePath);
-		console.log('finishing old program...');
-		openplc.kill('SIGTERM');
-		plcRunning = false;
+		//the old program keeps running until the new one is compiled
 		compilationOutput = '';
 		compilationEnded = false;
 		compilationSuccess = false;
@@ -189,6 +162,7 @@ app.post('/api/changeModbusCfg',function(req,res)
 				console.log('error copying modbus config file');
 			}
 		});
+		modbusConfigChanged = true;
     });
 });
 
@@ -465,6 +439,7 @@ function compileOpenPLC()
 	console.log('compiling OpenPLC...');
 	compilationOutput += 'compiling OpenPLC...\r\n';
 	
+	var runtimeBefore = runtimeHash();
 	var exec = require('child_process').exec;
 	exec('./build_core.sh', function(error, stdout, stderr) 
 	{
@@ -483,27 +458,74 @@ function compileOpenPLC()
 		{
 			console.log('compiled without errors');
 			compilationOutput += 'compiled without errors\r\n';
-			console.log('Starting OpenPLC Software...');
-			plcLog = 'Starting OpenPLC Application...\r\n';
-			openplc = spawn('./core/openplc');
-			openplc.stdout.on('data', function(data)
+			if (plcRunning == true && modbusConfigChanged == false && runtimeHash() == runtimeBefore)
 			{
-				plcLog += data;
-				plcLog += '\r\n';
-			});
-			openplc.stderr.on('data', function(data)
+				//swap the program between two scans, keeping the connections
+				console.log('Loading new program on OpenPLC Software...');
+				plcLog += 'Loading new program...\r\n';
+				openplc.kill('SIGUSR1');
+			}
+			else if (plcRunning == true)
 			{
-				plcLog += data;
-				plcLog += '\r\n';
-			});
-			openplc.on('close', function(code)
+				//the runtime itself was rebuilt, or must read a new modbus
+				//configuration. Start it again once the old one is gone
+				console.log('Restarting OpenPLC Software...');
+				openplc.once('close', function(code)
+				{
+					plcLog = 'Starting OpenPLC Application...\r\n';
+					startOpenPLC();
+				});
+				openplc.kill('SIGTERM');
+			}
+			else
 			{
-				plcLog += 'OpenPLC application terminated\r\n';
-			});
-			
-			plcRunning = true;
+				console.log('Starting OpenPLC Software...');
+				plcLog = 'Starting OpenPLC Application...\r\n';
+				startOpenPLC();
+			}
+			modbusConfigChanged = false;
 			compilationSuccess = true;
 		}
 		compilationEnded = true;
 	});
 }
+
+function startOpenPLC()
+{
+	var runtime = spawn('./core/openplc');
+	runtime.stdout.on('data', function(data)
+	{
+		plcLog += data;
+		plcLog += '\r\n';
+	});
+	runtime.stderr.on('data', function(data)
+	{
+		plcLog += data;
+		plcLog += '\r\n';
+	});
+	runtime.on('close', function(code)
+	{
+		plcLog += 'OpenPLC application terminated\r\n';
+		//a runtime that was already replaced doesn't change the state
+		if (openplc == runtime)
+		{
+			plcRunning = false;
+		}
+	});
+	
+	openplc = runtime;
+	plcRunning = true;
+}
+
+//Hash of the runtime executable, to tell if a build changed it
+function runtimeHash()
+{
+	try
+	{
+		return crypto.createHash('md5').update(fs.readFileSync('./core/openplc')).digest('hex');
+	}
+	catch (err)
+	{
+		return '';
+	}
+}